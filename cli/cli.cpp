@@ -4,29 +4,74 @@
 #include <fstream>
 #include <string>
 #include <regex>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include <thread>
 #include <getopt.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 #include "opencv2/highgui.hpp"
+#include "opencv2/videoio.hpp"
+#include "Server.h"
+#include "Sweep.h"
 #include "SVGWriter.h"
+#include "ProjectWriter.h"
+#include "SequenceTracer.h"
+#include "TaskScheduler.h"
 #include "Log.h"
 #include "nalib/NACString.h"
 
 using namespace illustrace;
 
+static bool parseCPUList(const char *string, std::vector<int> &cpus);
+static bool setParameter(Document *document, const char *name, void (Document::*setter)(double), const char *value);
+static bool parseFramePattern(const std::string &pattern, std::string &prefix, int &width, std::string &suffix);
+
 const std::string CLI::VERSION = "0.1.0";
 
+enum LongOption {
+    Serve = 0x100,
+    Workers,
+    Queue,
+    Cache,
+    CacheSize,
+    SweepSpec,
+    Sequence,
+    Fit,
+    Despeckle,
+};
+
 int CLI::main(int argc, char **argv)
 {
     static struct option _options[] = {
         {"brightness", required_argument, NULL, 'b'},
         {"blur", required_argument, NULL, 'B'},
+        {"despeckle", required_argument, NULL, LongOption::Despeckle},
         {"detail", required_argument, NULL, 'd'},
         {"thickness", required_argument, NULL, 't'},
         {"smoothing", required_argument, NULL, 's'},
+        {"fit", required_argument, NULL, LongOption::Fit},
         {"color", required_argument, NULL, 'c'},
         {"wait", required_argument, NULL, 'w'},
         {"step", no_argument, NULL, 'S'},
         {"plot", no_argument, NULL, 'p'},
+        {"viewport", required_argument, NULL, 'V'},
+        {"zoom", required_argument, NULL, 'z'},
+        {"clip", required_argument, NULL, 'C'},
         {"edit", required_argument, NULL, 'e'},
+        {"journal", required_argument, NULL, 'j'},
+        {"async", no_argument, NULL, 'A'},
+        {"threads", required_argument, NULL, 'n'},
+        {"affinity", required_argument, NULL, 'a'},
+        {"serve", optional_argument, NULL, LongOption::Serve},
+        {"workers", required_argument, NULL, LongOption::Workers},
+        {"queue", required_argument, NULL, LongOption::Queue},
+        {"cache", required_argument, NULL, LongOption::Cache},
+        {"cache-size", required_argument, NULL, LongOption::CacheSize},
+        {"sweep", required_argument, NULL, LongOption::SweepSpec},
+        {"sequence", no_argument, NULL, LongOption::Sequence},
         {"output", required_argument, NULL, 'o'},
         {"trace", no_argument, NULL, 'T'},
         {"help", no_argument, NULL, 'h'},
@@ -37,23 +82,52 @@ int CLI::main(int argc, char **argv)
 
     CLI cli;
 
+    int threads = 0;
+    std::vector<int> cpus;
+
+    bool serve = false;
+    const char *socketPath = nullptr;
+    int workers = 2;
+    int queueSize = 16;
+
+    const char *cacheDirectory = nullptr;
+    int cacheSize = 256;
+
+    const char *sweepSpec = nullptr;
+    bool sequence = false;
+
     int opt;
-    while (-1 != (opt = getopt_long(argc, argv, "b:B:d:t:s:c:w:Spe:To:hv", _options, NULL))) {
+    while (-1 != (opt = getopt_long(argc, argv, "b:B:d:t:s:c:w:SpV:z:C:e:j:An:a:To:hv", _options, NULL))) {
         switch (opt) {
         case 'b':
-            cli.document->brightness(std::stod(optarg));
+            if (!setParameter(cli.document, "brightness", &Document::brightness, optarg)) {
+                cli.usage();
+                return EXIT_FAILURE;
+            }
             break;
         case 'B':
-            cli.document->blur(std::stod(optarg));
+            if (!setParameter(cli.document, "blur", &Document::blur, optarg)) {
+                cli.usage();
+                return EXIT_FAILURE;
+            }
             break;
         case 'd':
-            cli.document->detail(std::stod(optarg));
+            if (!setParameter(cli.document, "detail", &Document::detail, optarg)) {
+                cli.usage();
+                return EXIT_FAILURE;
+            }
             break;
         case 't':
-            cli.document->thickness(std::stod(optarg));
+            if (!setParameter(cli.document, "thickness", &Document::thickness, optarg)) {
+                cli.usage();
+                return EXIT_FAILURE;
+            }
             break;
         case 's':
-            cli.document->smoothing(std::stod(optarg));
+            if (!setParameter(cli.document, "smoothing", &Document::smoothing, optarg)) {
+                cli.usage();
+                return EXIT_FAILURE;
+            }
             break;
         case 'c':
             {
@@ -89,9 +163,118 @@ int CLI::main(int argc, char **argv)
         case 'p':
             cli.view.plot = true;
             break;
+        case 'V':
+            {
+                int x, y, width, height;
+                if (4 != sscanf(optarg, "%d,%d,%d,%d", &x, &y, &width, &height) || 0 >= width || 0 >= height) {
+                    std::cout << "Viewport format is invalid." << std::endl;
+                    cli.usage();
+                    return EXIT_FAILURE;
+                }
+                cli.view.viewport = cv::Rect(x, y, width, height);
+            }
+            break;
+        case 'z':
+            cli.view.zoom = std::stod(optarg);
+            if (0.0 >= cli.view.zoom) {
+                std::cout << "Zoom must be greater than 0." << std::endl;
+                cli.usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'C':
+            {
+                int x, y, width, height;
+                if (4 != sscanf(optarg, "%d,%d,%d,%d", &x, &y, &width, &height) || 0 >= width || 0 >= height) {
+                    std::cout << "Clipping rect format is invalid." << std::endl;
+                    cli.usage();
+                    return EXIT_FAILURE;
+                }
+                cli.clippingRect = cv::Rect(x, y, width, height);
+                cli.clip = true;
+            }
+            break;
         case 'e':
             cli.editFilePath = optarg;
             break;
+        case 'j':
+            cli.journalFilepath = optarg;
+            break;
+        case 'A':
+            if (!cli.tracer) {
+                cli.tracer = new AsyncTracer();
+                cli.editor->tracer = cli.tracer;
+            }
+            break;
+        case 'n':
+            threads = atoi(optarg);
+            if (0 >= threads) {
+                std::cout << "Threads must be greater than 0." << std::endl;
+                cli.usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'a':
+            if (!parseCPUList(optarg, cpus)) {
+                std::cout << "CPU list is invalid or names a CPU this machine does not have." << std::endl;
+                cli.usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case LongOption::Serve:
+            serve = true;
+            socketPath = optarg;
+            break;
+        case LongOption::Workers:
+            workers = atoi(optarg);
+            if (0 >= workers) {
+                std::cout << "Workers must be greater than 0." << std::endl;
+                cli.usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case LongOption::Queue:
+            queueSize = atoi(optarg);
+            if (0 >= queueSize) {
+                std::cout << "Queue size must be greater than 0." << std::endl;
+                cli.usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case LongOption::Cache:
+            cacheDirectory = optarg;
+            break;
+        case LongOption::CacheSize:
+            cacheSize = atoi(optarg);
+            if (0 >= cacheSize) {
+                std::cout << "Cache size must be greater than 0." << std::endl;
+                cli.usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case LongOption::SweepSpec:
+            sweepSpec = optarg;
+            break;
+        case LongOption::Sequence:
+            sequence = true;
+            break;
+        case LongOption::Despeckle:
+            if (!setParameter(cli.document, "despeckle", &Document::despeckle, optarg)) {
+                cli.usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case LongOption::Fit:
+            {
+                Document::FittingMode fitting;
+                if (!parseFitting(optarg, fitting)) {
+                    std::cout << "Fitting mode is invalid." << std::endl;
+                    cli.usage();
+                    return EXIT_FAILURE;
+                }
+                cli.document->fitting(fitting);
+            }
+            break;
         case 'o':
             cli.outputFilepath = optarg;
             break;
@@ -114,16 +297,61 @@ int CLI::main(int argc, char **argv)
         }
     }
 
-    if (argc <= optind) {
+    if (!serve && argc <= optind) {
         std::cout << "Input file not specified." << std::endl;
         cli.usage();
         return EXIT_FAILURE;
     }
 
+    if (0 < threads || !cpus.empty()) {
+        if (!TaskScheduler::shared().configure(threads, cpus)) {
+            std::cout << "Could not pin the threads to the CPU list." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (cacheDirectory) {
+        cli.cache = new TraceCache(cacheDirectory, (size_t)cacheSize * 1024 * 1024);
+        cli.illustrace.cache(cli.cache);
+    }
+
+    if (sweepSpec) {
+        Sweep sweep(cli.document);
+        if (!sweep.parse(sweepSpec)) {
+            std::cout << "Sweep format is invalid." << std::endl;
+            cli.usage();
+            return EXIT_FAILURE;
+        }
+        if (!cli.outputFilepath) {
+            std::cout << "Output file not specified." << std::endl;
+            cli.usage();
+            return EXIT_FAILURE;
+        }
+        return sweep.execute(argv[optind], cli.outputFilepath, cli.clip ? &cli.clippingRect : nullptr) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (sequence) {
+        if (!cli.outputFilepath) {
+            std::cout << "Output file not specified." << std::endl;
+            cli.usage();
+            return EXIT_FAILURE;
+        }
+        return cli.executeSequence(argv[optind]) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (serve) {
+        Server server(workers, queueSize, cli.cache);
+        if (!server.serve(socketPath)) {
+            std::cerr << "Could not serve on " << (socketPath ? socketPath : "stdin") << "." << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
     return cli.execute(argv[optind]) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-CLI::CLI() : editFilePath(nullptr), outputFilepath(nullptr)
+CLI::CLI() : tracer(nullptr), cache(nullptr), editFilePath(nullptr), journalFilepath(nullptr), outputFilepath(nullptr), clip(false)
 {
     document = new Document();
     editor = new Editor(&illustrace, document);
@@ -132,6 +360,8 @@ CLI::CLI() : editFilePath(nullptr), outputFilepath(nullptr)
 CLI::~CLI()
 {
     delete editor;
+    delete tracer;
+    delete cache;
     delete document;
 }
 
@@ -152,20 +382,43 @@ void CLI::usage()
 
     const std::string USAGE =
         "Usage: illustrace [options] <file>\n"
+        "       illustrace [options] --serve[=<socket>]\n"
         "Options:\n"
         "  -b, --brightness <value>    Adjustment for brightness. -1.0 to 1.0.\n"
         "  -B, --blur <value>          Blur size (%% of short side) of the preprocess for binarize. 0.0 to 1.0\n"
+        "      --despeckle <size>      Drop specks and pinholes smaller than size x size pixels after binarize.\n"
+        "                              Thin lines are kept. 0 (default) keeps everything.\n"
         "  -d, --detail <value>        Adjustment for line detail. 0.0 to 1.0.\n"
         "  -t, --thickness <value>     Adjustment for line thickness. 0 < value.\n"
         "  -s, --smooth <value>        Adjustment for bezier smoothness. 0 < value.\n"
+        "      --fit <mode>            Bezier fitting. spline (default, a curve per point) or leastsquares\n"
+        "                              (fewer curves within the detail tolerance, lines for straight runs).\n"
         "  -c, --color <color[,color]> Color for line and background(optional).\n"
         "                              Color format is HEX RGB. ex) FF0000,000000\n"
         "  -w, --wait <msec>           Wait milli seconds for each of image proccessing phase.\n"
         "                              0 is infinity and key input is needed for continue.\n"
         "  -S, --step                  Wait with drawing one line.\n"
         "  -p, --plot                  Plot points and handles.\n"
+        "  -V, --viewport <x,y,w,h>    Show only this part of the image.\n"
+        "  -z, --zoom <value>          Scale of the preview. 0 < value.\n"
+        "  -C, --clip <x,y,w,h>        Trace and output only this part of the image.\n"
         "  -e, --edit <file>           Edit with command instruction.\n"
-        "  -o, --output <file>         Output result to file. Currently, .svg only.\n"
+        "  -A, --async                 Re-trace detail changes of edit commands in background.\n"
+        "  -n, --threads <count>       Number of threads for image processing. Default is the number of cores.\n"
+        "  -a, --affinity <cpus>       Pin the threads to these CPUs. ex) 0-3,6 (Linux only)\n"
+        "  -j, --journal <file>        Journal edits to file. An existing journal is recovered instead of tracing.\n"
+        "      --serve[=<socket>]      Run as a daemon reading JSON-lines jobs from stdin or a Unix domain socket.\n"
+        "      --workers <count>       Number of jobs traced at once in serve mode. Default is 2.\n"
+        "      --queue <count>         Number of jobs queued in serve mode before reading blocks. Default is 16.\n"
+        "      --cache <dir>           Reuse trace results cached in the directory.\n"
+        "      --cache-size <MB>       Maximum size of the cache. Default is 256.\n"
+        "      --sweep <spec>          Trace with every combination of the values. Outputs are suffixed with the values.\n"
+        "                              ex) detail=0.5,1.0;smoothing=1,2;thickness=1,2 (brightness, blur, despeckle, detail, smoothing, thickness)\n"
+        "                              fitting=spline,leastsquares compares the fitting modes.\n"
+        "                              despeckle=0,2,4 reports the specks dropped and the bytes saved.\n"
+        "      --sequence              Trace a video or an image sequence (ex. frame_%%03d.png) frame by frame.\n"
+        "                              The output is numbered with %%d or %%0Nd in it, or suffixed with the frame number.\n"
+        "  -o, --output <file>         Output result to file. .svg or .illustrace (project).\n"
         "  -T, --trace                 Print trace log.\n"
         "  -h, --help                  This help text.\n"
         "  -v, --version               Show program version.\n";
@@ -185,12 +438,26 @@ bool CLI::execute(const char *inputFilePath)
         illustrace.addObserver(&view);
     }
 
-    bool ret = illustrace.traceFromFile(inputFilePath, document);
+    bool recovered = journalFilepath && editor->recover(journalFilepath);
+
+    bool ret = recovered
+        || (isProjectFile(inputFilePath)
+            ? illustrace.openProject(inputFilePath, document)
+            : illustrace.traceFromFile(inputFilePath, document, clip ? &clippingRect : nullptr));
     if (!ret) {
         std::cout << "Could not load source image." << std::endl;
         return EXIT_FAILURE;
     }
 
+    if (0 < document->specks()) {
+        std::cout << "Despeckle dropped " << document->specks() << " specks." << std::endl;
+    }
+
+    if (journalFilepath && !editor->startJournal(journalFilepath)) {
+        std::cout << "Could not start journal." << std::endl;
+        return EXIT_FAILURE;
+    }
+
 
     if (editFilePath) {
         char str[1024];
@@ -210,18 +477,85 @@ bool CLI::execute(const char *inputFilePath)
         while (ifs.getline(str, 1024 - 1)) {
             executeCommand(str, ++line);
         }
+
+        editor->settle();
     }
 
     if (!outputFilepath) {
         view.waitKey();
     }
+    else if (isProjectFile(outputFilepath)) {
+        ret = editor->save(outputFilepath);
+    }
     else {
-        ret = SVGWriter::write(outputFilepath, document, "Generator: illusTrace CLI 0.1.0");
+        ret = SVGWriter::write(outputFilepath, document, ("Generator: illusTrace CLI " + VERSION).c_str(), clip);
     }
 
     return ret ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
+// Frames are traced by one SequenceTracer, so parts of a frame unchanged from the previous one are
+// not traced again. Parameters stay the same across the frames.
+bool CLI::executeSequence(const char *inputFilePath)
+{
+    cv::VideoCapture capture(inputFilePath);
+    if (!capture.isOpened()) {
+        std::cout << "Could not open sequence." << std::endl;
+        return false;
+    }
+
+    std::string prefix, suffix;
+    int width;
+    if (!parseFramePattern(outputFilepath, prefix, width, suffix)) {
+        std::cout << "Output must contain one %d or %0Nd, and %% for a literal %." << std::endl;
+        return false;
+    }
+
+    bool project = isProjectFile(outputFilepath);
+    SequenceTracer sequenceTracer;
+    cv::Mat frame;
+    cv::Mat sourceImage;
+    int count = 0;
+    bool ret = true;
+
+    auto started = std::chrono::steady_clock::now();
+
+    while (capture.read(frame)) {
+        if (1 == frame.channels()) {
+            sourceImage = frame;
+        }
+        else {
+            cv::cvtColor(frame, sourceImage, 4 == frame.channels() ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY);
+        }
+
+        auto t0 = std::chrono::steady_clock::now();
+        sequenceTracer.trace(sourceImage, document, clip ? &clippingRect : nullptr);
+        auto t1 = std::chrono::steady_clock::now();
+
+        char number[16];
+        snprintf(number, sizeof(number), "%0*d", width, count);
+        std::string path = prefix + number + suffix;
+        const char *filepath = path.c_str();
+
+        bool written = project
+            ? ProjectWriter::write(filepath, document)
+            : SVGWriter::write(filepath, document, ("Generator: illusTrace CLI " + VERSION).c_str(), clip);
+        ret = ret && written;
+
+        const SequenceTracer::Statistics &statistics = sequenceTracer.statistics();
+        printf("%6d %5d/%-5d tiles %6d/%-6d contours %10.3f ms  %s%s\n", count,
+                statistics.changedTiles, statistics.tiles, statistics.reusedContours, statistics.contours,
+                std::chrono::duration<double, std::milli>(t1 - t0).count(), filepath, written ? "" : " (failed)");
+
+        ++count;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    printf("%d frames in %.3f s (%.2f fps)\n", count, seconds, 0.0 < seconds ? count / seconds : 0.0);
+
+    return ret && 0 < count;
+}
+
 enum Command {
     Mode,
     PaintState,
@@ -320,7 +654,15 @@ void CLI::executeCommand(char *commandLine, int line)
         }
         break;
     case Detail:
-        editor->detail(std::stod(argv[1]));
+        {
+            std::string error;
+            double detail = std::stod(argv[1]);
+            if (!checkParameter("detail", detail, error)) {
+                std::cout << error << " line: " << line << std::endl;
+                break;
+            }
+            editor->detail(detail);
+        }
         break;
     case BGEnable:
         editor->backgroundEnable(0 == strcasecmp("true", argv[1]));
@@ -350,3 +692,166 @@ void CLI::executeCommand(char *commandLine, int line)
         break;
     }
 }
+
+bool CLI::isProjectFile(const char *filepath)
+{
+    static const char Extension[] = ".illustrace";
+    size_t length = strlen(filepath);
+    size_t extensionLength = sizeof(Extension) - 1;
+    return length > extensionLength && 0 == strcasecmp(filepath + length - extensionLength, Extension);
+}
+
+bool CLI::parseFitting(const char *string, Document::FittingMode &fitting)
+{
+    for (Document::FittingMode mode : {Document::FittingMode::Spline, Document::FittingMode::LeastSquares}) {
+        if (0 == strcasecmp(string, Document::FittingMode2CString(mode))) {
+            fitting = mode;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Limits of the numeric parameters shared by the options, sweep specs and serve mode requests.
+// Values out of them make the image processing fail, ex. a negative blur size or a zero detail.
+bool CLI::checkParameter(const std::string &name, double value, std::string &error)
+{
+    bool valid;
+    const char *range;
+
+    if ("brightness" == name) {
+        valid = -1.0 <= value && value <= 1.0;
+        range = "-1.0 to 1.0";
+    }
+    else if ("blur" == name) {
+        valid = 0.0 <= value && value <= 1.0;
+        range = "0.0 to 1.0";
+    }
+    else if ("detail" == name) {
+        valid = 0.0 < value && value <= 1.0;
+        range = "greater than 0.0 and up to 1.0";
+    }
+    else if ("despeckle" == name) {
+        valid = 0.0 <= value;
+        range = "0 or greater";
+    }
+    else {
+        valid = 0.0 < value;
+        range = "greater than 0";
+    }
+
+    if (!valid || !std::isfinite(value)) {
+        error = name + " must be " + range + ".";
+        return false;
+    }
+
+    return true;
+}
+
+// CPUs are numbered from 0 up to the count of hardware threads, and must fit a cpu_set_t.
+static bool parseCPUList(const char *string, std::vector<int> &cpus)
+{
+    std::stringstream ss(string);
+    std::string item;
+    int limit = std::thread::hardware_concurrency();
+
+#ifdef __linux__
+    limit = 0 < limit ? MIN(limit, CPU_SETSIZE) : CPU_SETSIZE;
+#endif
+
+    while (std::getline(ss, item, ',')) {
+        int first, last;
+        char dash;
+        std::stringstream range(item);
+
+        if (!(range >> first) || 0 > first) {
+            return false;
+        }
+        last = first;
+
+        if (range >> dash && ('-' != dash || !(range >> last) || last < first)) {
+            return false;
+        }
+
+        if (0 < limit && limit <= last) {
+            return false;
+        }
+
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+
+    return !cpus.empty();
+}
+
+static bool setParameter(Document *document, const char *name, void (Document::*setter)(double), const char *value)
+{
+    std::string error;
+    double number = std::stod(value);
+
+    if (!CLI::checkParameter(name, number, error)) {
+        std::cout << error << std::endl;
+        return false;
+    }
+
+    (document->*setter)(number);
+    return true;
+}
+
+// The pattern is never handed to printf. It is split around its only conversion, %d or %0Nd,
+// with %% taken as a literal %. Without a conversion the number goes before the extension.
+static bool parseFramePattern(const std::string &pattern, std::string &prefix, int &width, std::string &suffix)
+{
+    std::string *part = &prefix;
+    bool converted = false;
+
+    prefix.clear();
+    suffix.clear();
+    width = 0;
+
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        if ('%' != pattern[i]) {
+            *part += pattern[i];
+            continue;
+        }
+
+        if (i + 1 < pattern.size() && '%' == pattern[i + 1]) {
+            *part += '%';
+            ++i;
+            continue;
+        }
+
+        size_t end = i + 1;
+        if (end < pattern.size() && '0' == pattern[end]) {
+            for (++end; end < pattern.size() && isdigit(pattern[end]); ++end);
+            width = atoi(pattern.substr(i + 2, end - i - 2).c_str());
+            if (i + 2 == end || 0 >= width || 10 < width) {
+                return false;
+            }
+        }
+
+        if (converted || end == pattern.size() || 'd' != pattern[end]) {
+            return false;
+        }
+
+        converted = true;
+        part = &suffix;
+        i = end;
+    }
+
+    if (!converted) {
+        size_t extension = prefix.rfind('.');
+        size_t separator = prefix.rfind('/');
+        if (std::string::npos == extension || (std::string::npos != separator && extension < separator)) {
+            extension = prefix.size();
+        }
+        suffix = prefix.substr(extension);
+        prefix = prefix.substr(0, extension) + "_";
+        width = 5;
+    }
+
+    return true;
+}
+
@@ -11,6 +11,9 @@ class CLI {
 public:
     static int main(int argc, char **argv);
     static const std::string VERSION;
+    static bool isProjectFile(const char *filepath);
+    static bool parseFitting(const char *string, Document::FittingMode &fitting);
+    static bool checkParameter(const std::string &name, double value, std::string &error);
 
     CLI();
     ~CLI();
@@ -19,14 +22,20 @@ public:
     void usage();
     void version();
     bool execute(const char *inputFilePath);
+    bool executeSequence(const char *inputFilePath);
     void executeCommand(char *commandLine, int line);
 
     Document *document;
     View view;
     Illustrace illustrace;
     Editor *editor;
+    AsyncTracer *tracer;
+    TraceCache *cache;
     const char *editFilePath;
+    const char *journalFilepath;
     const char *outputFilepath;
+    bool clip;
+    cv::Rect clippingRect;
 };
 
 } // namespace illustrace
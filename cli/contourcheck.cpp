@@ -0,0 +1,200 @@
+#include "ContourBuilder.h"
+#include "TaskScheduler.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "opencv2/imgproc.hpp"
+#include "opencv2/highgui.hpp"
+
+// Checks that ContourBuilder returns the same contours and hierarchy as cv::findContours with
+// CHAIN_APPROX_SIMPLE, in LIST and CCOMP modes, serial and in stripes, and compares the times.
+// Images are binarized with Otsu's threshold, lines as foreground like the tracer's negative image.
+// Without image arguments a set of generated images is checked.
+//
+// Usage: contourcheck [-i <iterations>] [image ...]
+
+using namespace illustrace;
+
+typedef std::chrono::steady_clock Clock;
+
+struct Sample {
+    std::string name;
+    cv::Mat image;
+};
+
+static void generateSamples(std::vector<Sample> &samples);
+static bool compare(const FlatContours<cv::Point> &contours, const std::vector<std::vector<cv::Point>> &expected, const std::vector<cv::Vec4i> &hierarchy, std::string &error);
+static double milliseconds(Clock::time_point from, Clock::time_point to);
+
+int main(int argc, char **argv)
+{
+    int iterations = 5;
+    std::vector<Sample> samples;
+
+    for (int i = 1; i < argc; ++i) {
+        if (0 == strcmp("-i", argv[i]) && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+            if (0 >= iterations) {
+                printf("Iterations must be greater than 0.\n");
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+
+        cv::Mat image = cv::imread(argv[i], cv::IMREAD_GRAYSCALE);
+        if (!image.data) {
+            printf("Could not load %s.\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+
+        cv::threshold(image, image, 0, 255, cv::THRESH_BINARY_INV | cv::THRESH_OTSU);
+        samples.push_back((Sample){argv[i], image});
+    }
+
+    if (samples.empty()) {
+        generateSamples(samples);
+    }
+
+    struct {
+        const char *name;
+        ContourBuilder::Mode mode;
+        int retrieval;
+    } modes[] = {
+        {"list", ContourBuilder::Mode::List, cv::RETR_LIST},
+        {"ccomp", ContourBuilder::Mode::CComp, cv::RETR_CCOMP},
+    };
+
+    int threads = TaskScheduler::shared().threads();
+    int failures = 0;
+
+    printf("%-24s %-6s %10s %9s %12s %12s %12s\n", "image", "mode", "size", "contours", "findContours", "serial", "stripes");
+
+    for (Sample &sample : samples) {
+        int stripes = MAX(1, MIN(threads, sample.image.rows));
+
+        for (auto &mode : modes) {
+            std::vector<std::vector<cv::Point>> expected;
+            std::vector<cv::Vec4i> hierarchy;
+            FlatContours<cv::Point> serial;
+            FlatContours<cv::Point> striped;
+            double times[3] = {0.0, 0.0, 0.0};
+
+            for (int i = 0; i < iterations; ++i) {
+                cv::Mat image = sample.image.clone();
+
+                Clock::time_point t0 = Clock::now();
+                cv::findContours(image, expected, hierarchy, mode.retrieval, cv::CHAIN_APPROX_SIMPLE);
+                Clock::time_point t1 = Clock::now();
+                ContourBuilder::build(sample.image, serial, mode.mode, cv::Point(), 1);
+                Clock::time_point t2 = Clock::now();
+                ContourBuilder::build(sample.image, striped, mode.mode, cv::Point(), stripes);
+                Clock::time_point t3 = Clock::now();
+
+                times[0] += milliseconds(t0, t1);
+                times[1] += milliseconds(t1, t2);
+                times[2] += milliseconds(t2, t3);
+            }
+
+            char size[32];
+            snprintf(size, sizeof(size), "%dx%d", sample.image.cols, sample.image.rows);
+            printf("%-24s %-6s %10s %9zu %9.3f ms %9.3f ms %9.3f ms\n", sample.name.c_str(), mode.name, size, expected.size(),
+                    times[0] / iterations, times[1] / iterations, times[2] / iterations);
+
+            std::string error;
+            if (!compare(serial, expected, hierarchy, error)) {
+                printf("  serial differs: %s\n", error.c_str());
+                ++failures;
+            }
+            if (!compare(striped, expected, hierarchy, error)) {
+                printf("  %d stripes differ: %s\n", stripes, error.c_str());
+                ++failures;
+            }
+        }
+    }
+
+    printf("%s\n", 0 == failures ? "All contours match." : "Contours differ.");
+    return 0 == failures ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Local functions
+
+// Shapes touching the borders, nested rings, one pixel lines and noise, and a page sized image
+// for the timings.
+static void generateSamples(std::vector<Sample> &samples)
+{
+    cv::RNG rng(0x1ee7);
+
+    cv::Mat noise(240, 320, CV_8UC1);
+    rng.fill(noise, cv::RNG::UNIFORM, 0, 256);
+    cv::threshold(noise, noise, 127, 255, cv::THRESH_BINARY);
+    samples.push_back((Sample){"noise", noise});
+
+    cv::Mat blobs(480, 640, CV_8UC1);
+    rng.fill(blobs, cv::RNG::UNIFORM, 0, 256);
+    cv::GaussianBlur(blobs, blobs, cv::Size(9, 9), 0);
+    cv::threshold(blobs, blobs, 128, 255, cv::THRESH_BINARY);
+    samples.push_back((Sample){"blobs", blobs});
+
+    cv::Mat rings = cv::Mat::zeros(400, 400, CV_8UC1);
+    for (int r = 190; 0 < r; r -= 12) {
+        cv::circle(rings, cv::Point(200, 200), r, cv::Scalar(255), 0 == r % 24 ? -1 : 3);
+    }
+    samples.push_back((Sample){"rings", rings});
+
+    cv::Mat lines = cv::Mat::zeros(300, 300, CV_8UC1);
+    for (int i = 0; i < 60; ++i) {
+        cv::Point p1(rng.uniform(-20, 320), rng.uniform(-20, 320));
+        cv::Point p2(rng.uniform(-20, 320), rng.uniform(-20, 320));
+        cv::line(lines, p1, p2, cv::Scalar(255), 1 + i % 3);
+    }
+    samples.push_back((Sample){"lines", lines});
+
+    cv::Mat border(64, 64, CV_8UC1, cv::Scalar(255));
+    cv::rectangle(border, cv::Rect(8, 8, 48, 48), cv::Scalar(0), -1);
+    border.at<uchar>(32, 32) = 255;
+    samples.push_back((Sample){"border", border});
+
+    cv::Mat column(200, 1, CV_8UC1);
+    rng.fill(column, cv::RNG::UNIFORM, 0, 2);
+    column *= 255;
+    samples.push_back((Sample){"column", column});
+
+    cv::Mat page = cv::Mat::zeros(3508, 2480, CV_8UC1);
+    for (int i = 0; i < 3000; ++i) {
+        cv::Point center(rng.uniform(0, page.cols), rng.uniform(0, page.rows));
+        cv::circle(page, center, rng.uniform(2, 60), cv::Scalar(255), rng.uniform(-1, 4));
+    }
+    samples.push_back((Sample){"page", page});
+}
+
+static bool compare(const FlatContours<cv::Point> &contours, const std::vector<std::vector<cv::Point>> &expected, const std::vector<cv::Vec4i> &hierarchy, std::string &error)
+{
+    if (contours.size() != expected.size()) {
+        error = std::to_string(contours.size()) + " contours, expected " + std::to_string(expected.size());
+        return false;
+    }
+
+    for (int i = 0; i < expected.size(); ++i) {
+        auto contour = contours[i];
+        if (contour.size() != expected[i].size() || !std::equal(expected[i].begin(), expected[i].end(), contour.begin())) {
+            error = "points of contour " + std::to_string(i);
+            return false;
+        }
+
+        if (contours.hierarchy[i] != hierarchy[i]) {
+            error = "hierarchy of contour " + std::to_string(i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static double milliseconds(Clock::time_point from, Clock::time_point to)
+{
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
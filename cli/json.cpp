@@ -0,0 +1,364 @@
+#include "JSON.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+#define MAXIMUM_DEPTH 64
+
+using namespace illustrace;
+
+class Parser {
+public:
+    Parser(const std::string &text) : p(text.c_str()), end(text.c_str() + text.size()) {}
+
+    bool parse(JSON &value)
+    {
+        return parseValue(value, 0) && (skip(), p == end);
+    }
+
+private:
+    const char *p;
+    const char *end;
+
+    void skip()
+    {
+        while (p < end && (' ' == *p || '\t' == *p || '\n' == *p || '\r' == *p)) {
+            ++p;
+        }
+    }
+
+    bool literal(const char *word)
+    {
+        size_t length = strlen(word);
+        if (end - p < length || 0 != strncmp(p, word, length)) {
+            return false;
+        }
+        p += length;
+        return true;
+    }
+
+    bool parseValue(JSON &value, int depth)
+    {
+        skip();
+        if (p == end || MAXIMUM_DEPTH < depth) {
+            return false;
+        }
+
+        switch (*p) {
+        case '{':
+            return parseObject(value, depth);
+        case '[':
+            return parseArray(value, depth);
+        case '"':
+            value.type = JSON::Type::String;
+            return parseString(value.string);
+        case 't':
+            value.type = JSON::Type::Boolean;
+            value.boolean = true;
+            return literal("true");
+        case 'f':
+            value.type = JSON::Type::Boolean;
+            value.boolean = false;
+            return literal("false");
+        case 'n':
+            value.type = JSON::Type::Null;
+            return literal("null");
+        default:
+            return parseNumber(value);
+        }
+    }
+
+    bool parseObject(JSON &value, int depth)
+    {
+        value.type = JSON::Type::Object;
+        ++p;
+
+        skip();
+        if (p < end && '}' == *p) {
+            ++p;
+            return true;
+        }
+
+        while (true) {
+            std::pair<std::string, JSON> member;
+
+            skip();
+            if (p == end || '"' != *p || !parseString(member.first)) {
+                return false;
+            }
+
+            skip();
+            if (p == end || ':' != *p++) {
+                return false;
+            }
+
+            if (!parseValue(member.second, depth + 1)) {
+                return false;
+            }
+            value.object.push_back(std::move(member));
+
+            skip();
+            if (p == end) {
+                return false;
+            }
+            if ('}' == *p) {
+                ++p;
+                return true;
+            }
+            if (',' != *p++) {
+                return false;
+            }
+        }
+    }
+
+    bool parseArray(JSON &value, int depth)
+    {
+        value.type = JSON::Type::Array;
+        ++p;
+
+        skip();
+        if (p < end && ']' == *p) {
+            ++p;
+            return true;
+        }
+
+        while (true) {
+            value.array.emplace_back();
+            if (!parseValue(value.array.back(), depth + 1)) {
+                return false;
+            }
+
+            skip();
+            if (p == end) {
+                return false;
+            }
+            if (']' == *p) {
+                ++p;
+                return true;
+            }
+            if (',' != *p++) {
+                return false;
+            }
+        }
+    }
+
+    bool parseHex(unsigned &code)
+    {
+        if (end - p < 4) {
+            return false;
+        }
+
+        code = 0;
+        for (int i = 0; i < 4; ++i, ++p) {
+            char c = *p;
+            code <<= 4;
+            if ('0' <= c && c <= '9') {
+                code |= c - '0';
+            }
+            else if ('a' <= c && c <= 'f') {
+                code |= c - 'a' + 10;
+            }
+            else if ('A' <= c && c <= 'F') {
+                code |= c - 'A' + 10;
+            }
+            else {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool parseString(std::string &string)
+    {
+        ++p;
+
+        while (p < end && '"' != *p) {
+            char c = *p++;
+            if ('\\' != c) {
+                string += c;
+                continue;
+            }
+
+            if (p == end) {
+                return false;
+            }
+
+            switch (*p++) {
+            case '"': string += '"'; break;
+            case '\\': string += '\\'; break;
+            case '/': string += '/'; break;
+            case 'b': string += '\b'; break;
+            case 'f': string += '\f'; break;
+            case 'n': string += '\n'; break;
+            case 'r': string += '\r'; break;
+            case 't': string += '\t'; break;
+            case 'u':
+                {
+                    unsigned code;
+                    if (!parseHex(code)) {
+                        return false;
+                    }
+
+                    if (0xD800 <= code && code < 0xDC00) {
+                        unsigned low;
+                        if (!literal("\\u") || !parseHex(low) || low < 0xDC00 || 0xE000 <= low) {
+                            return false;
+                        }
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    }
+
+                    if (code < 0x80) {
+                        string += (char)code;
+                    }
+                    else if (code < 0x800) {
+                        string += (char)(0xC0 | (code >> 6));
+                        string += (char)(0x80 | (code & 0x3F));
+                    }
+                    else if (code < 0x10000) {
+                        string += (char)(0xE0 | (code >> 12));
+                        string += (char)(0x80 | ((code >> 6) & 0x3F));
+                        string += (char)(0x80 | (code & 0x3F));
+                    }
+                    else {
+                        string += (char)(0xF0 | (code >> 18));
+                        string += (char)(0x80 | ((code >> 12) & 0x3F));
+                        string += (char)(0x80 | ((code >> 6) & 0x3F));
+                        string += (char)(0x80 | (code & 0x3F));
+                    }
+                }
+                break;
+            default:
+                return false;
+            }
+        }
+
+        if (p == end) {
+            return false;
+        }
+
+        ++p;
+        return true;
+    }
+
+    bool parseNumber(JSON &value)
+    {
+        const char *from = p;
+
+        if (p < end && '-' == *p) {
+            ++p;
+        }
+        while (p < end && (isdigit(*p) || '.' == *p || 'e' == *p || 'E' == *p || '+' == *p || '-' == *p)) {
+            ++p;
+        }
+
+        if (from == p || (1 == p - from && '-' == *from)) {
+            return false;
+        }
+
+        std::string number(from, p);
+        char *last;
+        value.type = JSON::Type::Number;
+        value.number = strtod(number.c_str(), &last);
+        return '\0' == *last;
+    }
+};
+
+JSON::JSON() : type(Type::Null), boolean(false), number(0.0)
+{
+}
+
+bool JSON::parse(const std::string &text, JSON &value)
+{
+    value = JSON();
+    Parser parser(text);
+    return parser.parse(value);
+}
+
+std::string JSON::quote(const std::string &string)
+{
+    std::string result = "\"";
+
+    for (char c : string) {
+        switch (c) {
+        case '"': result += "\\\""; break;
+        case '\\': result += "\\\\"; break;
+        case '\b': result += "\\b"; break;
+        case '\f': result += "\\f"; break;
+        case '\n': result += "\\n"; break;
+        case '\r': result += "\\r"; break;
+        case '\t': result += "\\t"; break;
+        default:
+            if (0x20 > (unsigned char)c) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                result += escaped;
+            }
+            else {
+                result += c;
+            }
+            break;
+        }
+    }
+
+    return result + "\"";
+}
+
+std::string JSON::stringify() const
+{
+    switch (type) {
+    case Type::Null:
+        return "null";
+    case Type::Boolean:
+        return boolean ? "true" : "false";
+    case Type::Number:
+        {
+            if (!std::isfinite(number)) {
+                return "null";
+            }
+            char string[32];
+            snprintf(string, sizeof(string), "%.17g", number);
+            return string;
+        }
+    case Type::String:
+        return quote(string);
+    case Type::Array:
+        {
+            std::string result = "[";
+            for (const JSON &value : array) {
+                if (1 < result.size()) {
+                    result += ",";
+                }
+                result += value.stringify();
+            }
+            return result + "]";
+        }
+    case Type::Object:
+        {
+            std::string result = "{";
+            for (auto &member : object) {
+                if (1 < result.size()) {
+                    result += ",";
+                }
+                result += quote(member.first) + ":" + member.second.stringify();
+            }
+            return result + "}";
+        }
+    }
+
+    return "null";
+}
+
+const JSON *JSON::find(const char *key) const
+{
+    for (auto &member : object) {
+        if (member.first == key) {
+            return &member.second;
+        }
+    }
+
+    return nullptr;
+}
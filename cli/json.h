@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace illustrace {
+
+class JSON {
+public:
+    enum class Type : int {
+        Null,
+        Boolean,
+        Number,
+        String,
+        Array,
+        Object,
+    };
+
+    JSON();
+
+    static bool parse(const std::string &text, JSON &value);
+    static std::string quote(const std::string &string);
+
+    std::string stringify() const;
+    const JSON *find(const char *key) const;
+
+    Type type;
+    bool boolean;
+    double number;
+    std::string string;
+    std::vector<JSON> array;
+    std::vector<std::pair<std::string, JSON>> object;
+};
+
+} // namespace illustrace
@@ -0,0 +1,526 @@
+#include "Server.h"
+#include "CLI.h"
+#include "SVGWriter.h"
+#include "ProjectWriter.h"
+
+#include <cstring>
+#include <algorithm>
+#include <csignal>
+#include <cerrno>
+#include <cmath>
+#include <climits>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "opencv2/highgui.hpp"
+
+#define READ_CHUNK_SIZE 65536
+#define MAXIMUM_LINE_LENGTH (256 * 1024 * 1024)
+
+using namespace illustrace;
+
+typedef std::chrono::steady_clock Clock;
+
+struct Server::Connection {
+    Connection(int input, int output) : input(input), output(output) {}
+
+    ~Connection()
+    {
+        if (STDIN_FILENO != input) {
+            close(input);
+        }
+    }
+
+    bool readLine(std::string &line)
+    {
+        size_t searched = 0;
+
+        while (true) {
+            size_t newline = buffer.find('\n', searched);
+            if (std::string::npos != newline) {
+                line.assign(buffer, 0, newline);
+                buffer.erase(0, newline + 1);
+                return true;
+            }
+
+            searched = buffer.size();
+            if (MAXIMUM_LINE_LENGTH < searched) {
+                return false;
+            }
+
+            char chunk[READ_CHUNK_SIZE];
+            ssize_t length = ::read(input, chunk, sizeof(chunk));
+            if (0 > length && EINTR == errno) {
+                continue;
+            }
+            if (0 >= length) {
+                line.swap(buffer);
+                buffer.clear();
+                return !line.empty();
+            }
+
+            buffer.append(chunk, length);
+        }
+    }
+
+    bool write(const std::string &line)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        std::string data = line + "\n";
+        const char *p = data.c_str();
+        size_t remaining = data.size();
+
+        while (0 < remaining) {
+            ssize_t length = ::write(output, p, remaining);
+            if (0 > length && EINTR == errno) {
+                continue;
+            }
+            if (0 >= length) {
+                return false;
+            }
+            p += length;
+            remaining -= length;
+        }
+
+        return true;
+    }
+
+    int input;
+    int output;
+    std::string buffer;
+    std::mutex mutex;
+};
+
+struct Server::Job {
+    std::shared_ptr<Connection> connection;
+    JSON request;
+    Clock::time_point received;
+};
+
+static std::string errorResponse(const JSON *id, const std::string &message);
+static bool applyParameters(const JSON *parameters, Document *document, cv::Rect &clippingRect, bool &clip, std::string &error);
+static bool parseColor(const JSON *value, cv::Scalar &color);
+static bool decodeBase64(const std::string &string, std::vector<uchar> &data);
+static double milliseconds(Clock::time_point from, Clock::time_point to);
+
+Server::Server(int workers, int queueSize, TraceCache *cache) : cache(cache), queueSize(MAX(1, queueSize)), readers(0), terminated(false)
+{
+    for (int i = 0; i < MAX(1, workers); ++i) {
+        this->workers.push_back(std::thread(&Server::work, this));
+    }
+}
+
+// Queued jobs are finished before the workers exit.
+Server::~Server()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        terminated = true;
+    }
+    notEmpty.notify_all();
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+bool Server::serve(const char *socketPath)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!socketPath) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++readers;
+        }
+        read(std::make_shared<Connection>(STDIN_FILENO, STDOUT_FILENO));
+        return true;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (sizeof(address.sun_path) <= strlen(socketPath)) {
+        return false;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (0 > fd) {
+        return false;
+    }
+
+    unlink(socketPath);
+    if (0 != bind(fd, (struct sockaddr *)&address, sizeof(address)) || 0 != listen(fd, SOMAXCONN)) {
+        close(fd);
+        return false;
+    }
+
+    std::vector<std::weak_ptr<Connection>> connections;
+
+    while (true) {
+        int client = accept(fd, nullptr, nullptr);
+        if (0 > client) {
+            if (EINTR == errno || ECONNABORTED == errno) {
+                continue;
+            }
+            break;
+        }
+
+        auto connection = std::make_shared<Connection>(client, client);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++readers;
+            connections.erase(std::remove_if(connections.begin(), connections.end(), [](std::weak_ptr<Connection> &c) {
+                return c.expired();
+            }), connections.end());
+            connections.push_back(connection);
+        }
+
+        std::thread(&Server::read, this, connection).detach();
+    }
+
+    close(fd);
+    unlink(socketPath);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    for (auto &c : connections) {
+        auto connection = c.lock();
+        if (connection) {
+            shutdown(connection->input, SHUT_RD);
+        }
+    }
+    notFull.wait(lock, [this] {
+        return 0 == readers;
+    });
+
+    return false;
+}
+
+void Server::read(std::shared_ptr<Connection> connection)
+{
+    std::string line;
+
+    while (connection->readLine(line)) {
+        if (std::string::npos == line.find_first_not_of(" \t\r")) {
+            continue;
+        }
+
+        Job *job = new Job();
+        job->connection = connection;
+        job->received = Clock::now();
+
+        if (!JSON::parse(line, job->request) || JSON::Type::Object != job->request.type) {
+            respond(job, errorResponse(nullptr, "Request is not a JSON object."));
+            delete job;
+            continue;
+        }
+
+        enqueue(job);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        --readers;
+    }
+    notFull.notify_all();
+}
+
+void Server::enqueue(Job *job)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this] {
+        return queue.size() < queueSize;
+    });
+
+    queue.push_back(job);
+    lock.unlock();
+
+    notEmpty.notify_one();
+}
+
+// Every worker keeps its own Illustrace for the lifetime of the daemon. The cache is shared.
+// A job failing with an exception is answered with an error, so one bad request can not stop the daemon.
+void Server::work()
+{
+    Illustrace illustrace;
+    illustrace.cache(cache);
+
+    while (true) {
+        Job *job;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            notEmpty.wait(lock, [this] {
+                return !queue.empty() || terminated;
+            });
+
+            if (queue.empty()) {
+                break;
+            }
+
+            job = queue.front();
+            queue.pop_front();
+        }
+        notFull.notify_all();
+
+        try {
+            execute(job, illustrace);
+        } catch (const std::exception &e) {
+            respond(job, errorResponse(job->request.find("id"), std::string("Could not trace: ") + e.what()));
+        }
+        delete job;
+    }
+}
+
+void Server::execute(Job *job, Illustrace &illustrace)
+{
+    Clock::time_point started = Clock::now();
+    const JSON *id = job->request.find("id");
+    const JSON *input = job->request.find("input");
+    const JSON *image = job->request.find("image");
+    const JSON *output = job->request.find("output");
+
+    if (output && (JSON::Type::String != output->type || output->string.empty())) {
+        respond(job, errorResponse(id, "Output is not a file path."));
+        return;
+    }
+
+    Document document;
+    cv::Rect clippingRect;
+    bool clip = false;
+    std::string error;
+
+    if (!applyParameters(job->request.find("params"), &document, clippingRect, clip, error)) {
+        respond(job, errorResponse(id, error));
+        return;
+    }
+
+    cv::Mat sourceImage;
+
+    if (input && JSON::Type::String == input->type) {
+        sourceImage = cv::imread(input->string, cv::IMREAD_GRAYSCALE);
+    }
+    else if (image && JSON::Type::String == image->type) {
+        std::vector<uchar> data;
+        if (decodeBase64(image->string, data)) {
+            sourceImage = cv::imdecode(data, cv::IMREAD_GRAYSCALE);
+        }
+    }
+    else {
+        respond(job, errorResponse(id, "Input is not specified."));
+        return;
+    }
+
+    if (!sourceImage.data) {
+        respond(job, errorResponse(id, "Could not load source image."));
+        return;
+    }
+
+    Clock::time_point decoded = Clock::now();
+
+    illustrace.traceFromImage(sourceImage, &document, clip ? &clippingRect : nullptr);
+
+    Clock::time_point traced = Clock::now();
+
+    std::string comment = "Generator: illusTrace CLI " + CLI::VERSION;
+    std::vector<char> svg;
+    bool written;
+
+    if (!output) {
+        written = SVGWriter::write(svg, &document, comment.c_str(), clip);
+    }
+    else if (CLI::isProjectFile(output->string.c_str())) {
+        written = ProjectWriter::write(output->string.c_str(), &document);
+    }
+    else {
+        written = SVGWriter::write(output->string.c_str(), &document, comment.c_str(), clip);
+    }
+
+    if (!written) {
+        respond(job, errorResponse(id, "Could not write output."));
+        return;
+    }
+
+    Clock::time_point finished = Clock::now();
+
+    char timings[256];
+    snprintf(timings, sizeof(timings),
+            "{\"queue\":%.3f,\"decode\":%.3f,\"trace\":%.3f,\"write\":%.3f,\"total\":%.3f}",
+            milliseconds(job->received, started),
+            milliseconds(started, decoded),
+            milliseconds(decoded, traced),
+            milliseconds(traced, finished),
+            milliseconds(job->received, finished));
+
+    respond(job, "{\"id\":" + (id ? id->stringify() : "null")
+            + ",\"status\":\"ok\","
+            + (output ? "\"output\":" + JSON::quote(output->string) : "\"svg\":" + JSON::quote(std::string(svg.begin(), svg.end())))
+            + ",\"paths\":" + std::to_string(document.paths()->size())
+            + ",\"specks\":" + std::to_string(document.specks())
+            + ",\"timings\":" + timings + "}");
+}
+
+void Server::respond(Job *job, const std::string &response)
+{
+    job->connection->write(response);
+}
+
+// Local functions
+
+static std::string errorResponse(const JSON *id, const std::string &message)
+{
+    return "{\"id\":" + (id ? id->stringify() : "null") + ",\"status\":\"error\",\"error\":" + JSON::quote(message) + "}";
+}
+
+static bool applyParameters(const JSON *parameters, Document *document, cv::Rect &clippingRect, bool &clip, std::string &error)
+{
+    if (!parameters) {
+        return true;
+    }
+
+    if (JSON::Type::Object != parameters->type) {
+        error = "Params is not an object.";
+        return false;
+    }
+
+    for (auto &member : parameters->object) {
+        const std::string &name = member.first;
+        const JSON &value = member.second;
+
+        if ("color" == name || "backgroundColor" == name) {
+            cv::Scalar color;
+            if (!parseColor(&value, color)) {
+                error = "Color format is invalid.";
+                return false;
+            }
+
+            if ("color" == name) {
+                document->color(color);
+            }
+            else {
+                document->backgroundColor(color);
+                document->backgroundEnable(true);
+            }
+        }
+        else if ("clip" == name) {
+            if (JSON::Type::Array != value.type || 4 != value.array.size()
+                    || JSON::Type::Number != value.array[0].type || JSON::Type::Number != value.array[1].type
+                    || JSON::Type::Number != value.array[2].type || JSON::Type::Number != value.array[3].type
+                    || 0.0 >= value.array[2].number || 0.0 >= value.array[3].number
+                    || !std::all_of(value.array.begin(), value.array.end(), [](const JSON &n) { return fabs(n.number) <= INT_MAX / 2; })) {
+                error = "Clipping rect format is invalid.";
+                return false;
+            }
+            clippingRect = cv::Rect(value.array[0].number, value.array[1].number, value.array[2].number, value.array[3].number);
+            clip = true;
+        }
+        else if ("fitting" == name) {
+            Document::FittingMode fitting;
+            if (JSON::Type::String != value.type || !CLI::parseFitting(value.string.c_str(), fitting)) {
+                error = "Fitting mode is invalid.";
+                return false;
+            }
+            document->fitting(fitting);
+        }
+        else if ("negative" == name) {
+            if (JSON::Type::Boolean != value.type) {
+                error = "Negative is not a boolean.";
+                return false;
+            }
+            document->negative(value.boolean);
+        }
+        else {
+            struct {
+                const char *name;
+                void (Document::*setter)(double);
+            } table[] = {
+                {"brightness", &Document::brightness},
+                {"blur", &Document::blur},
+                {"despeckle", &Document::despeckle},
+                {"detail", &Document::detail},
+                {"thickness", &Document::thickness},
+                {"smoothing", &Document::smoothing},
+            };
+
+            bool found = false;
+
+            for (int i = 0; i < sizeof(table) / sizeof(table[0]); ++i) {
+                if (name == table[i].name) {
+                    if (JSON::Type::Number != value.type) {
+                        error = name + " is not a number.";
+                        return false;
+                    }
+                    if (!CLI::checkParameter(name, value.number, error)) {
+                        return false;
+                    }
+                    (document->*table[i].setter)(value.number);
+                    found = true;
+                }
+            }
+
+            if (!found) {
+                error = "Unknown parameter " + name + ".";
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool parseColor(const JSON *value, cv::Scalar &color)
+{
+    if (JSON::Type::String != value->type || 6 != value->string.size()
+            || std::string::npos != value->string.find_first_not_of("0123456789abcdefABCDEF")) {
+        return false;
+    }
+
+    long hex = std::stol(value->string, nullptr, 16);
+    color = cv::Scalar((hex >> 16) & 0xFF, (hex >> 8) & 0xFF, hex & 0XFF, 255);
+    return true;
+}
+
+static bool decodeBase64(const std::string &string, std::vector<uchar> &data)
+{
+    static const char Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    static const std::vector<int> table = [] {
+        std::vector<int> table(256, 0);
+        for (int i = 0; i < sizeof(Alphabet) - 1; ++i) {
+            table[(uchar)Alphabet[i]] = i + 1;
+        }
+        return table;
+    }();
+
+    unsigned bits = 0;
+    int count = 0;
+
+    data.reserve(string.size() * 3 / 4);
+
+    for (char c : string) {
+        if ('=' == c) {
+            break;
+        }
+
+        int index = table[(uchar)c];
+        if (!index) {
+            return false;
+        }
+
+        bits = (bits << 6) | (index - 1);
+        count += 6;
+        if (8 <= count) {
+            count -= 8;
+            data.push_back((bits >> count) & 0xFF);
+        }
+    }
+
+    return !data.empty();
+}
+
+static double milliseconds(Clock::time_point from, Clock::time_point to)
+{
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "JSON.h"
+#include "Illustrace.h"
+
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+namespace illustrace {
+
+// Trace daemon reading one JSON job per line from stdin or from clients of a Unix domain socket.
+// Jobs are queued up to queueSize; when the queue is full the reader stops reading, so the
+// pipe or socket buffer fills and the client blocks instead of the daemon growing unbounded.
+class Server {
+public:
+    Server(int workers, int queueSize, TraceCache *cache = nullptr);
+    ~Server();
+
+    bool serve(const char *socketPath = nullptr);
+
+private:
+    struct Connection;
+    struct Job;
+
+    void read(std::shared_ptr<Connection> connection);
+    void enqueue(Job *job);
+    void work();
+    void execute(Job *job, Illustrace &illustrace);
+    void respond(Job *job, const std::string &response);
+
+    TraceCache *cache;
+    std::vector<std::thread> workers;
+    std::deque<Job *> queue;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    int queueSize;
+    int readers;
+    bool terminated;
+};
+
+} // namespace illustrace
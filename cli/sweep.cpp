@@ -0,0 +1,345 @@
+#include "Sweep.h"
+#include "CLI.h"
+#include "SVGWriter.h"
+#include "ProjectWriter.h"
+#include "TaskScheduler.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <sstream>
+#include <sys/stat.h>
+#include "opencv2/highgui.hpp"
+
+using namespace illustrace;
+
+typedef std::chrono::steady_clock Clock;
+
+struct Sweep::Result {
+    double brightness;
+    double blur;
+    double despeckle;
+    double detail;
+    double smoothing;
+    double thickness;
+    Document::FittingMode fitting;
+    int specks;
+    double binarize;
+    double contours;
+    double approximate;
+    double bezier;
+    double paintMask;
+    double write;
+    size_t paths;
+    size_t segments;
+    size_t bytes;
+    std::string filepath;
+    bool written;
+};
+
+static bool parseValues(const std::string &string, std::vector<double> &values);
+static void copyParameters(Document *from, Document *to);
+static double milliseconds(Clock::time_point from, Clock::time_point to);
+static size_t countSegments(const std::vector<Path *> &paths);
+
+Sweep::Sweep(Document *document) : document(document)
+{
+}
+
+// spec: name=value[,value...][;name=value[,value...]...]
+bool Sweep::parse(const char *spec)
+{
+    struct {
+        const char *name;
+        std::vector<double> *values;
+    } table[] = {
+        {"brightness", &brightness},
+        {"blur", &blur},
+        {"despeckle", &despeckle},
+        {"detail", &detail},
+        {"smoothing", &smoothing},
+        {"thickness", &thickness},
+    };
+    std::string error;
+
+    std::stringstream ss(spec);
+    std::string item;
+
+    while (std::getline(ss, item, ';')) {
+        size_t equal = item.find('=');
+        if (std::string::npos == equal) {
+            return false;
+        }
+
+        std::string name = item.substr(0, equal);
+        bool found = false;
+
+        if (0 == strcasecmp(name.c_str(), "fitting")) {
+            std::stringstream values(item.substr(equal + 1));
+            std::string value;
+
+            fitting.clear();
+            while (std::getline(values, value, ',')) {
+                Document::FittingMode mode;
+                if (!CLI::parseFitting(value.c_str(), mode)) {
+                    return false;
+                }
+                fitting.push_back(mode);
+            }
+
+            if (fitting.empty()) {
+                return false;
+            }
+            continue;
+        }
+
+        for (int i = 0; i < sizeof(table) / sizeof(table[0]); ++i) {
+            if (0 == strcasecmp(name.c_str(), table[i].name)) {
+                std::vector<double> &values = *table[i].values;
+                values.clear();
+
+                if (!parseValues(item.substr(equal + 1), values)) {
+                    return false;
+                }
+
+                for (double value : values) {
+                    if (!CLI::checkParameter(table[i].name, value, error)) {
+                        return false;
+                    }
+                }
+
+                found = true;
+            }
+        }
+
+        if (!found) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Sweep::execute(const char *inputFilepath, const char *outputFilepath, const cv::Rect *clippingRect)
+{
+    struct {
+        std::vector<double> *values;
+        double value;
+    } defaults[] = {
+        {&brightness, document->brightness()},
+        {&blur, document->blur()},
+        {&despeckle, document->despeckle()},
+        {&detail, document->detail()},
+        {&smoothing, document->smoothing()},
+        {&thickness, document->thickness()},
+    };
+
+    for (auto &d : defaults) {
+        if (d.values->empty()) {
+            d.values->push_back(d.value);
+        }
+    }
+
+    if (fitting.empty()) {
+        fitting.push_back(document->fitting());
+    }
+
+    cv::Mat sourceImage = cv::imread(inputFilepath, cv::IMREAD_GRAYSCALE);
+    if (!sourceImage.data) {
+        return false;
+    }
+
+    TaskScheduler::LaneScope scope(TaskScheduler::Lane::Background);
+
+    int downstreamCount = detail.size() * smoothing.size() * thickness.size() * fitting.size();
+    std::vector<Result> results(brightness.size() * blur.size() * despeckle.size() * downstreamCount);
+    Illustrace illustrace;
+
+    Clock::time_point started = Clock::now();
+
+    for (int i = 0; i < brightness.size(); ++i) {
+        for (int j = 0; j < blur.size(); ++j) {
+            Document upstream;
+            copyParameters(document, &upstream);
+            upstream.brightness(brightness[i]);
+            upstream.blur(blur[j]);
+            upstream.despeckle(0.0);
+
+            Clock::time_point t0 = Clock::now();
+            illustrace.layout(sourceImage, &upstream, clippingRect);
+            illustrace.binarize(sourceImage, &upstream);
+            Clock::time_point t1 = Clock::now();
+            illustrace.buildLines(&upstream);
+            Clock::time_point t2 = Clock::now();
+
+            for (int l = 0; l < despeckle.size(); ++l) {
+                FlatContours<cv::Point> contours = *upstream.outlineContours();
+                Clock::time_point t3 = Clock::now();
+                int specks = ContourBuilder::despeckle(contours, despeckle[l]);
+                Clock::time_point t4 = Clock::now();
+
+                Result *upstreamResults = &results[((i * blur.size() + j) * despeckle.size() + l) * downstreamCount];
+
+                TaskScheduler::shared().parallelFor(downstreamCount, [&](int k) {
+                    Result &result = upstreamResults[k];
+                    result.binarize = milliseconds(t0, t1);
+                    result.contours = milliseconds(t1, t2) + milliseconds(t3, t4);
+                    result.despeckle = despeckle[l];
+                    result.specks = specks;
+
+                    trace(&upstream, contours,
+                            detail[k / (smoothing.size() * thickness.size() * fitting.size())],
+                            smoothing[k / (thickness.size() * fitting.size()) % smoothing.size()],
+                            thickness[k / fitting.size() % thickness.size()],
+                            fitting[k % fitting.size()],
+                            outputFilepath, nullptr != clippingRect, result);
+                });
+            }
+        }
+    }
+
+    Clock::time_point finished = Clock::now();
+
+    bool ret = true;
+
+    printf("%10s %10s %10s %8s %10s %10s %10s %12s %8s %10s %10s %10s %10s %10s %10s %10s %10s  %s\n",
+            "brightness", "blur", "despeckle", "specks", "detail", "smoothing", "thickness", "fitting", "paths", "segments", "bytes",
+            "binarize", "contours", "approx", "bezier", "mask", "write", "file");
+
+    for (Result &result : results) {
+        printf("%10g %10g %10g %8d %10g %10g %10g %12s %8zu %10zu %10zu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f  %s%s\n",
+                result.brightness, result.blur, result.despeckle, result.specks, result.detail, result.smoothing, result.thickness,
+                Document::FittingMode2CString(result.fitting), result.paths, result.segments, result.bytes,
+                result.binarize, result.contours, result.approximate, result.bezier, result.paintMask, result.write,
+                result.filepath.c_str(), result.written ? "" : " (failed)");
+        ret = ret && result.written;
+    }
+
+    printf("%zu combinations in %.3f ms\n", results.size(), milliseconds(started, finished));
+
+    return ret;
+}
+
+// The upstream images are shared, the stages after contours never write to them.
+void Sweep::trace(Document *upstream, const FlatContours<cv::Point> &contours, double detail, double smoothing, double thickness, Document::FittingMode fitting, const char *outputFilepath, bool clip, Result &result)
+{
+    Document downstream;
+    copyParameters(upstream, &downstream);
+    downstream.despeckle(result.despeckle);
+    downstream.detail(detail);
+    downstream.smoothing(smoothing);
+    downstream.thickness(thickness);
+    downstream.fitting(fitting);
+
+    downstream.contentRect(upstream->contentRect());
+    downstream.clippingRect(upstream->clippingRect());
+    downstream.traceRect(upstream->traceRect());
+    downstream.boundingRect(upstream->boundingRect());
+    downstream.binarizedImage(upstream->binarizedImage());
+    downstream.negativeImage(upstream->negativeImage());
+    downstream.preprocessedImage(upstream->preprocessedImage());
+    downstream.paintLayer(upstream->paintLayer());
+    downstream.outlineContours(new FlatContours<cv::Point>(contours));
+
+    bool project = CLI::isProjectFile(outputFilepath);
+    Illustrace illustrace;
+
+    Clock::time_point t0 = Clock::now();
+    illustrace.approximateLines(&downstream);
+    Clock::time_point t1 = Clock::now();
+    illustrace.buildPaths(&downstream);
+    Clock::time_point t2 = Clock::now();
+    if (project) {
+        illustrace.buildPaintMask(&downstream);
+    }
+    Clock::time_point t3 = Clock::now();
+
+    const char *extension = strrchr(outputFilepath, '.');
+    const char *separator = strrchr(outputFilepath, '/');
+    if (!extension || (separator && extension < separator)) {
+        extension = outputFilepath + strlen(outputFilepath);
+    }
+
+    char suffix[256];
+    snprintf(suffix, sizeof(suffix), "_b%g_B%g_d%g_s%g_t%g", downstream.brightness(), downstream.blur(), detail, smoothing, thickness);
+    result.filepath = std::string(outputFilepath, extension) + suffix;
+    if (1 < this->despeckle.size()) {
+        snprintf(suffix, sizeof(suffix), "_D%g", result.despeckle);
+        result.filepath += suffix;
+    }
+    if (1 < this->fitting.size()) {
+        result.filepath += std::string("_") + Document::FittingMode2CString(fitting);
+    }
+    result.filepath += extension;
+
+    result.written = project
+        ? ProjectWriter::write(result.filepath.c_str(), &downstream)
+        : SVGWriter::write(result.filepath.c_str(), &downstream, ("Generator: illusTrace CLI " + CLI::VERSION).c_str(), clip);
+    Clock::time_point t4 = Clock::now();
+
+    struct stat st;
+    result.bytes = result.written && 0 == stat(result.filepath.c_str(), &st) ? st.st_size : 0;
+
+    result.brightness = downstream.brightness();
+    result.blur = downstream.blur();
+    result.detail = detail;
+    result.smoothing = smoothing;
+    result.thickness = thickness;
+    result.fitting = fitting;
+    result.paths = downstream.paths()->size();
+    result.segments = countSegments(*downstream.paths());
+    result.approximate = milliseconds(t0, t1);
+    result.bezier = milliseconds(t1, t2);
+    result.paintMask = milliseconds(t2, t3);
+    result.write = milliseconds(t3, t4);
+}
+
+// Local functions
+
+static bool parseValues(const std::string &string, std::vector<double> &values)
+{
+    std::stringstream ss(string);
+    std::string item;
+
+    while (std::getline(ss, item, ',')) {
+        char *end;
+        double value = strtod(item.c_str(), &end);
+        if (item.empty() || '\0' != *end) {
+            return false;
+        }
+        values.push_back(value);
+    }
+
+    return !values.empty();
+}
+
+static void copyParameters(Document *from, Document *to)
+{
+    to->brightness(from->brightness());
+    to->negative(from->negative());
+    to->blur(from->blur());
+    to->despeckle(from->despeckle());
+    to->detail(from->detail());
+    to->smoothing(from->smoothing());
+    to->fitting(from->fitting());
+    to->thickness(from->thickness());
+    to->rotation(from->rotation());
+    to->color(from->color());
+    to->backgroundColor(from->backgroundColor());
+    to->backgroundEnable(from->backgroundEnable());
+}
+
+static double milliseconds(Clock::time_point from, Clock::time_point to)
+{
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+static size_t countSegments(const std::vector<Path *> &paths)
+{
+    size_t count = 0;
+    for (Path *path : paths) {
+        count += path->segments.size() + countSegments(path->children);
+    }
+    return count;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "Illustrace.h"
+
+#include <vector>
+
+namespace illustrace {
+
+// Traces one image with every combination of the swept parameters. Binarize and contours run once
+// per brightness and blur pair, approximation, bezier fitting and writing fan out over the rest.
+// Sweeping the fitting mode compares segment counts and output sizes of the modes, sweeping
+// despeckle the specks dropped from the same contours and the bytes saved.
+class Sweep {
+public:
+    Sweep(Document *document);
+
+    bool parse(const char *spec);
+    bool execute(const char *inputFilepath, const char *outputFilepath, const cv::Rect *clippingRect = nullptr);
+
+private:
+    struct Result;
+
+    void trace(Document *upstream, const FlatContours<cv::Point> &contours, double detail, double smoothing, double thickness, Document::FittingMode fitting, const char *outputFilepath, bool clip, Result &result);
+
+    Document *document;
+    std::vector<double> brightness;
+    std::vector<double> blur;
+    std::vector<double> despeckle;
+    std::vector<double> detail;
+    std::vector<double> smoothing;
+    std::vector<double> thickness;
+    std::vector<Document::FittingMode> fitting;
+};
+
+} // namespace illustrace
@@ -2,12 +2,15 @@
 #include "Log.h"
 
 #include <iostream>
+#include <cmath>
 
 using namespace illustrace;
 
 static const char WindowName[] = "illustrace CLI";
 
-View::View() : wait(-1), step(false), plot(false)
+static double distanceToChord(const cv::Point2f &p, const cv::Point2f &from, const cv::Point2f &to);
+
+View::View() : wait(-1), step(false), plot(false), zoom(1.0), surface(nullptr), cr(nullptr)
 {
     cv::namedWindow(WindowName, cv::WINDOW_AUTOSIZE);
 }
@@ -15,8 +18,10 @@ View::View() : wait(-1), step(false), plot(false)
 View::~View()
 {
     cv::destroyWindow(WindowName);
-    cairo_destroy(cr);
-    cairo_surface_destroy(surface);
+    if (cr) {
+        cairo_destroy(cr);
+        cairo_surface_destroy(surface);
+    }
 }
 
 void View::waitKey()
@@ -48,33 +53,30 @@ void View::notify(Illustrace *sender, va_list argList)
     case Illustrace::Event::SourceImageLoaded:
         {
             cv::Mat *sourceImage = va_arg(argList, cv::Mat *);
-            preview = cv::Mat(sourceImage->rows, sourceImage->cols, CV_8UC4);
-            surface = cairo_image_surface_create_for_data(preview.data, CAIRO_FORMAT_ARGB32,
-                    preview.cols, preview.rows, cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, preview.cols));
-            cr = cairo_create(surface);
-            imshow(WindowName, *sourceImage);
+            createPreview(*sourceImage);
+            showImage(*sourceImage);
             waitKeyIfNeeded();
         }
         break;
     case Illustrace::Event::BrightnessFilterApplied:
-        imshow(WindowName, *va_arg(argList, cv::Mat *));
+        showImage(*va_arg(argList, cv::Mat *));
         waitKeyIfNeeded();
         break;
     case Illustrace::Event::BlurFilterApplied:
-        imshow(WindowName, *va_arg(argList, cv::Mat *));
+        showImage(*va_arg(argList, cv::Mat *));
         waitKeyIfNeeded();
         break;
     case Illustrace::Event::Binarized:
-        imshow(WindowName, *va_arg(argList, cv::Mat *));
+        showImage(*va_arg(argList, cv::Mat *));
         waitKeyIfNeeded();
         break;
     case Illustrace::Event::NegativeFilterApplied:
-        imshow(WindowName, *va_arg(argList, cv::Mat *));
+        showImage(*va_arg(argList, cv::Mat *));
         waitKeyIfNeeded();
         break;
     case Illustrace::Event::OutlineBuilt:
         {
-            auto *outlineContours = va_arg(argList, std::vector<std::vector<cv::Point>> *);
+            auto *outlineContours = va_arg(argList, FlatContours<cv::Point> *);
             clearPreview();
             drawLines(*outlineContours, 1, true);
             waitKeyIfNeeded();
@@ -86,7 +88,7 @@ void View::notify(Illustrace *sender, va_list argList)
         break;
     case Illustrace::Event::OutlineApproximated:
         {
-            auto *approximatedOutlineContours = va_arg(argList, std::vector<std::vector<cv::Point2f>> *);
+            auto *approximatedOutlineContours = va_arg(argList, FlatContours<cv::Point2f> *);
             clearPreview();
             drawLines(*approximatedOutlineContours, 1, true);
             waitKeyIfNeeded();
@@ -117,14 +119,15 @@ void View::notify(Illustrace *sender, va_list argList)
         }
         break;
     case Illustrace::Event::PaintMaskBuilt:
-        imshow(WindowName, *va_arg(argList, cv::Mat *));
+        showImage(*va_arg(argList, cv::Mat *));
         waitKeyIfNeeded();
         break;
     case Illustrace::Event::PaintLayerUpdated:
         {
-            cv::Mat bgra;
-            cv::cvtColor(*va_arg(argList, cv::Mat *), bgra, CV_RGBA2BGRA);
-            imshow(WindowName, bgra);
+            TiledLayer *paintLayer = va_arg(argList, TiledLayer *);
+            cv::Rect *dirtyRect = va_arg(argList, cv::Rect *);
+            copyFrom(*paintLayer, document->paintPalette(), dirtyRect, CV_RGBA2BGRA);
+            show();
             waitKeyIfNeeded();
         }
         break;
@@ -136,12 +139,17 @@ void View::notify(Illustrace *sender, va_list argList)
             clearPreview();
         }
         drawPaths(va_arg(argList, std::vector<Path *> *), 0, document->color(), document->color());
-        drawPaths(document->paths(), document->thickness(), document->color(), document->color());
+        drawPaths(document->pathIndex(), document->thickness(), document->color(), document->color());
         waitKeyIfNeeded();
         break;
     case Illustrace::Event::PreprocessedImageUpdated:
-        imshow(WindowName, *va_arg(argList, cv::Mat *));
-        waitKeyIfNeeded();
+        {
+            cv::Mat *preprocessedImage = va_arg(argList, cv::Mat *);
+            cv::Rect *dirtyRect = va_arg(argList, cv::Rect *);
+            copyFrom(*preprocessedImage, dirtyRect);
+            show();
+            waitKeyIfNeeded();
+        }
         break;
     }
 }
@@ -219,6 +227,9 @@ void View::notify(Editor *sender, va_list argList)
             printf("Editor::Save:\n");
         }
         break;
+    case Editor::Event::PaletteFull:
+        printf("Editor::PaletteFull: no room for %d,%d,%d\n", (int)sender->paintColor()[0], (int)sender->paintColor()[1], (int)sender->paintColor()[2]);
+        break;
     }
 }
 
@@ -239,72 +250,198 @@ void View::notify(Document *sender, va_list argList)
     case Document::Event::BackgroundEnable:
     case Document::Event::Paths:
     case Document::Event::PaintPaths:
-        if (sender->backgroundEnable()) {
-            fillBackground(sender->backgroundColor());
-        }
-        else {
-            clearPreview();
-        }
-        drawPaths(sender->paintPaths(), 0, sender->color(), sender->color());
-        drawPaths(sender->paths(), sender->thickness(), sender->color(), sender->color());
+        redraw(sender);
         waitKeyIfNeeded();
         break;
     case Document::Event::PaintLayer:
         if (plot) {
-            copyFrom(sender->paintLayer());
-            drawPaths(sender->paths(), sender->thickness(), sender->color(), sender->color());
+            redrawPaintLayer(sender, va_arg(argList, cv::Rect *));
             waitKeyIfNeeded();
         }
         break;
+    case Document::Event::PreprocessedImage:
+        redrawPreprocessedImage(sender, va_arg(argList, cv::Rect *));
+        waitKeyIfNeeded();
+        break;
     default:
         break;
     }
 }
 
+void View::createPreview(cv::Mat &sourceImage)
+{
+    cv::Rect imageRect(0, 0, sourceImage.cols, sourceImage.rows);
+    viewport &= imageRect;
+    if (0 >= viewport.area()) {
+        viewport = imageRect;
+    }
+    visibleRect = viewport;
+
+    if (cr) {
+        cairo_destroy(cr);
+        cairo_surface_destroy(surface);
+    }
+
+    preview = cv::Mat(ceil(viewport.height * zoom), ceil(viewport.width * zoom), CV_8UC4);
+    surface = cairo_image_surface_create_for_data(preview.data, CAIRO_FORMAT_ARGB32,
+            preview.cols, preview.rows, cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, preview.cols));
+    cr = cairo_create(surface);
+
+    cairo_scale(cr, zoom, zoom);
+    cairo_translate(cr, -viewport.x, -viewport.y);
+}
+
+void View::show()
+{
+    imshow(WindowName, preview);
+}
+
+void View::showImage(cv::Mat &image)
+{
+    if (viewport.size() == image.size() && 1.0 == zoom) {
+        imshow(WindowName, image);
+        return;
+    }
+
+    cv::Mat resized;
+    cv::resize(image(viewport), resized, preview.size(), 0, 0, 1.0 < zoom ? cv::INTER_NEAREST : cv::INTER_AREA);
+    imshow(WindowName, resized);
+}
+
+cv::Rect View::deviceRect(const cv::Rect &rect)
+{
+    int x0 = floor((rect.x - viewport.x) * zoom);
+    int y0 = floor((rect.y - viewport.y) * zoom);
+    int x1 = ceil((rect.x + rect.width - viewport.x) * zoom);
+    int y1 = ceil((rect.y + rect.height - viewport.y) * zoom);
+    return cv::Rect(x0, y0, x1 - x0, y1 - y0) & cv::Rect(0, 0, preview.cols, preview.rows);
+}
+
+void View::redraw(Document *document)
+{
+    if (document->backgroundEnable()) {
+        fillBackground(document->backgroundColor());
+    }
+    else {
+        clearPreview();
+    }
+    drawPaths(document->paintPathIndex(), 0, document->color(), document->color());
+    drawPaths(document->pathIndex(), document->thickness(), document->color(), document->color());
+}
+
+void View::redrawPaintLayer(Document *document, cv::Rect *dirtyRect)
+{
+    // The editor swaps in an unchanged canvas without a dirty rect
+    if (!dirtyRect) {
+        return;
+    }
+
+    cv::Rect rect = *dirtyRect & viewport;
+    if (0 >= rect.area()) {
+        return;
+    }
+
+    copyFrom(document->paintLayer(), document->paintPalette(), &rect);
+    redrawPaths(document, rect);
+}
+
+void View::redrawPreprocessedImage(Document *document, cv::Rect *dirtyRect)
+{
+    // The editor swaps in an unchanged canvas without a dirty rect
+    if (!dirtyRect) {
+        return;
+    }
+
+    cv::Rect rect = *dirtyRect & viewport;
+    if (0 >= rect.area()) {
+        return;
+    }
+
+    copyFrom(document->preprocessedImage(), &rect);
+    redrawPaths(document, rect);
+}
+
+// The paths over a rect just copied into the preview, clipped to it.
+void View::redrawPaths(Document *document, const cv::Rect &rect)
+{
+    cairo_save(cr);
+    cairo_rectangle(cr, rect.x, rect.y, rect.width, rect.height);
+    cairo_clip(cr);
+    visibleRect = rect;
+
+    drawPaths(document->pathIndex(), document->thickness(), document->color(), document->color());
+
+    visibleRect = viewport;
+    cairo_restore(cr);
+}
+
 void View::clearPreview()
 {
     cairo_set_source_rgb(cr, 1, 1, 1);
-    cairo_rectangle(cr, 0, 0, preview.cols - 1, preview.rows - 1);
+    cairo_rectangle(cr, visibleRect.x, visibleRect.y, visibleRect.width, visibleRect.height);
     cairo_fill(cr);
-    imshow(WindowName, preview);
+    show();
 }
 
 void View::fillBackground(cv::Scalar &color)
 {
     cairo_set_source_rgb(cr, color[0] / 255.0, color[1] / 255.0, color[2] / 255.0);
-    cairo_rectangle(cr, 0, 0, preview.cols - 1, preview.rows - 1);
+    cairo_rectangle(cr, visibleRect.x, visibleRect.y, visibleRect.width, visibleRect.height);
     cairo_fill(cr);
-    imshow(WindowName, preview);
+    show();
 }
 
-void View::copyFrom(cv::Mat &image)
+void View::copyFrom(cv::Mat &image, cv::Rect *dirtyRect, int code)
 {
-    int srcChannel = image.channels();
-    int dstChannel = preview.channels();
-
-    for (int y = 0; y < preview.rows; ++y) {
-        int yOffsetSrc = y * preview.cols * srcChannel;
-        int yOffsetDst = y * preview.cols * dstChannel;
-        for (int x = 0; x < preview.cols; ++x) {
-            uchar *src = &image.data[yOffsetSrc + (x * srcChannel)];
-            uchar *dst = &preview.data[yOffsetDst + (x * dstChannel)];
-            if (1 == srcChannel) {
-                dst[0] = src[0];
-                dst[1] = src[0];
-                dst[2] = src[0];
-            }
-            else {
-                dst[0] = src[0];
-                dst[1] = src[1];
-                dst[2] = src[2];
-            }
-        }
+    cv::Rect rect = dirtyRect ? *dirtyRect & viewport : viewport;
+    cv::Rect dstRect = deviceRect(rect);
+    if (0 >= rect.area() || 0 >= dstRect.area()) {
+        return;
     }
-    imshow(WindowName, preview);
+
+    cv::Mat src = image(rect);
+    cv::Mat bgra;
+
+    if (1 == image.channels()) {
+        cv::cvtColor(src, bgra, CV_GRAY2BGRA);
+    }
+    else if (-1 != code) {
+        cv::cvtColor(src, bgra, code);
+    }
+    else {
+        bgra = src;
+    }
+
+    cv::Mat dst = preview(dstRect);
+    cv::resize(bgra, dst, dst.size(), 0, 0, cv::INTER_NEAREST);
+}
+
+// Only the visible part of the dirty rect is made dense.
+void View::copyFrom(TiledLayer &layer, Palette &palette, cv::Rect *dirtyRect, int code)
+{
+    cv::Rect rect = dirtyRect ? *dirtyRect & viewport : viewport;
+    cv::Rect dstRect = deviceRect(rect);
+    if (0 >= rect.area() || 0 >= dstRect.area()) {
+        return;
+    }
+
+    cv::Mat src;
+    cv::Mat bgra;
+    layer.copyTo(src, rect, palette);
+
+    if (-1 != code) {
+        cv::cvtColor(src, bgra, code);
+    }
+    else {
+        bgra = src;
+    }
+
+    cv::Mat dst = preview(dstRect);
+    cv::resize(bgra, dst, dst.size(), 0, 0, cv::INTER_NEAREST);
 }
 
 template <class T>
-void View::drawLines(std::vector<std::vector<T>> &lines, double thickness, bool closePath)
+void View::drawLines(const FlatContours<T> &lines, double thickness, bool closePath)
 {
     cairo_set_line_width(cr, thickness);
     cairo_set_source_rgb(cr, 0, 0, 0);
@@ -331,12 +468,12 @@ void View::drawLines(std::vector<std::vector<T>> &lines, double thickness, bool
         cairo_stroke(cr);
 
         if (step) {
-            imshow(WindowName, preview);
+            show();
             waitKeyIfNeeded();
         }
     }
 
-    imshow(WindowName, preview);
+    show();
 }
 
 void View::drawPaths(std::vector<Path *> *paths, double thickness, cv::Scalar &stroke, cv::Scalar &fill)
@@ -345,11 +482,38 @@ void View::drawPaths(std::vector<Path *> *paths, double thickness, cv::Scalar &s
         return;
     }
 
+    double margin = thickness / 2.0;
+    cv::Rect2f rect(visibleRect.x - margin, visibleRect.y - margin, visibleRect.width + margin * 2, visibleRect.height + margin * 2);
+
+    std::vector<Path *> visiblePaths;
+    for (auto *path : *paths) {
+        cv::Rect2f &b = path->bounds;
+        if (rect.x <= b.x + b.width && b.x <= rect.x + rect.width && rect.y <= b.y + b.height && b.y <= rect.y + rect.height) {
+            visiblePaths.push_back(path);
+        }
+    }
+
+    drawVisiblePaths(visiblePaths, thickness, stroke, fill);
+}
+
+void View::drawPaths(PathIndex &pathIndex, double thickness, cv::Scalar &stroke, cv::Scalar &fill)
+{
+    double margin = thickness / 2.0;
+    cv::Rect2f rect(visibleRect.x - margin, visibleRect.y - margin, visibleRect.width + margin * 2, visibleRect.height + margin * 2);
+
+    std::vector<Path *> visiblePaths;
+    pathIndex.query(rect, visiblePaths);
+
+    drawVisiblePaths(visiblePaths, thickness, stroke, fill);
+}
+
+void View::drawVisiblePaths(std::vector<Path *> &paths, double thickness, cv::Scalar &stroke, cv::Scalar &fill)
+{
     cairo_set_line_width(cr, thickness);
     cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
     cairo_set_fill_rule(cr, CAIRO_FILL_RULE_EVEN_ODD);
 
-    for (auto *path : *paths) {
+    for (auto *path : paths) {
         drawPath(path, thickness);
 
         if (path->closed) {
@@ -374,28 +538,68 @@ void View::drawPaths(std::vector<Path *> *paths, double thickness, cv::Scalar &s
         cairo_stroke(cr);
 
         if (step) {
-            imshow(WindowName, preview);
+            show();
             waitKeyIfNeeded();
         }
     }
 
-    imshow(WindowName, preview);
+    show();
 }
 
-void View::drawPath(Path *path, double thickness)
+// Segments under half a device pixel are merged and flat curves become lines,
+// so zoomed out documents do not pay for detail that can not be seen.
+template <class P>
+void View::drawPath(P *path, double thickness)
 {
+    double tolerance = 0.5 / zoom;
+
+    // Holes are children, so those of an empty path are still drawn
+    if (path->segments.empty()) {
+        for (auto *child : path->children) {
+            drawPath(child, thickness);
+        }
+        return;
+    }
+
     cairo_new_sub_path(cr);
 
-    for (Segment &s : path->segments) {
+    if (path->bounds.width < tolerance && path->bounds.height < tolerance) {
+        cv::Point2f p = (*path->segments.begin())[2];
+        cairo_move_to(cr, p.x, p.y);
+        cairo_line_to(cr, p.x, p.y);
+        return;
+    }
+
+    cv::Point2f current;
+    int length = path->segments.size();
+    int i = 0;
+
+    for (const auto &s : path->segments) {
+        bool last = length == ++i;
+
         switch (s.type) {
         case Segment::Type::Move:
             cairo_move_to(cr, s[2].x, s[2].y);
+            current = s[2];
             break;
         case Segment::Type::Line:
-            cairo_line_to(cr, s[2].x, s[2].y);
-            break;
         case Segment::Type::Curve:
-            cairo_curve_to(cr, s[0].x, s[0].y, s[1].x, s[1].y, s[2].x, s[2].y); 
+            {
+                bool flat = Segment::Type::Line == s.type
+                    || (distanceToChord(s[0], current, s[2]) < tolerance && distanceToChord(s[1], current, s[2]) < tolerance);
+
+                if (flat && !last && cv::norm(s[2] - current) < tolerance) {
+                    break;
+                }
+
+                if (flat) {
+                    cairo_line_to(cr, s[2].x, s[2].y);
+                }
+                else {
+                    cairo_curve_to(cr, s[0].x, s[0].y, s[1].x, s[1].y, s[2].x, s[2].y); 
+                }
+                current = s[2];
+            }
             break;
         }
     }
@@ -404,30 +608,24 @@ void View::drawPath(Path *path, double thickness)
         cairo_close_path(cr);
     }
 
-    for (Path *child : path->children) {
+    for (auto *child : path->children) {
         drawPath(child, thickness);
     }
 }
 
 template <class T>
-void View::plotPoints(std::vector<T> &points)
+void View::plotPoints(const FlatContours<T> &lines)
 {
     cairo_set_line_width(cr, 1);
     cairo_set_source_rgb(cr, 1, 0, 0);
 
-    for (auto point : points) {
-        cairo_arc(cr, point.x, point.y, 2, 0, 2 * M_PI);
-        cairo_stroke(cr);
-    }
-
-    imshow(WindowName, preview);
-}
-
-template <class T>
-void View::plotPoints(std::vector<std::vector<T>> &lines)
-{
     for (auto line : lines) {
-        plotPoints(line);
+        for (auto point : line) {
+            cairo_arc(cr, point.x, point.y, 2, 0, 2 * M_PI);
+            cairo_stroke(cr);
+        }
+
+        show();
     }
 }
 
@@ -440,20 +638,18 @@ void View::plotPathsHandle(std::vector<Path *> *paths)
         plotPathHandle(path);
     }
 
-    imshow(WindowName, preview);
+    show();
 }
 
-void View::plotPathHandle(Path *path)
+template <class P>
+void View::plotPathHandle(P *path)
 {
-    int length = path->segments.size();
-    for (int i = 0; i < length; ++i) {
-        Segment &s = path->segments[i];
+    cv::Point2f previous;
 
+    for (const auto &s : path->segments) {
         if (Segment::Type::Curve == s.type) {
-            Segment &prev = path->segments[i - 1];
-
             cairo_set_source_rgba(cr, 0, 0, 1, 0.5);
-            cairo_move_to(cr, prev[2].x, prev[2].y);
+            cairo_move_to(cr, previous.x, previous.y);
             cairo_line_to(cr, s[0].x, s[0].y);
             cairo_stroke(cr);
 
@@ -470,9 +666,21 @@ void View::plotPathHandle(Path *path)
         cairo_set_source_rgba(cr, 1, 0, 0, 0.5);
         cairo_arc(cr, s[2].x, s[2].y, 2, 0, 2 * M_PI);
         cairo_fill(cr);
+
+        previous = s[2];
     }
 
     for (auto *child : path->children) {
         plotPathHandle(child);
     }
 }
+
+static double distanceToChord(const cv::Point2f &p, const cv::Point2f &from, const cv::Point2f &to)
+{
+    cv::Point2f chord = to - from;
+    double length = cv::norm(chord);
+    if (0.0 == length) {
+        return cv::norm(p - from);
+    }
+    return fabs(chord.cross(p - from)) / length;
+}
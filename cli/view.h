@@ -17,6 +17,8 @@ public:
     int wait;
     bool step;
     bool plot;
+    cv::Rect viewport;
+    double zoom;
 
     void waitKey();
     void waitKeyIfNeeded();
@@ -25,24 +27,37 @@ private:
     cv::Mat preview;
     cairo_surface_t *surface;
     cairo_t *cr;
+    cv::Rect visibleRect;
 
     void notify(Illustrace *sender, va_list argList);
     void notify(Editor *sender, va_list argList);
     void notify(Document *sender, va_list argList);
 
+    void createPreview(cv::Mat &sourceImage);
+    void show();
+    void showImage(cv::Mat &image);
+    cv::Rect deviceRect(const cv::Rect &rect);
+    void redraw(Document *document);
+    void redrawPaintLayer(Document *document, cv::Rect *dirtyRect);
+    void redrawPreprocessedImage(Document *document, cv::Rect *dirtyRect);
+    void redrawPaths(Document *document, const cv::Rect &rect);
+
     void clearPreview();
     void fillBackground(cv::Scalar &color);
-    void copyFrom(cv::Mat &image);
+    void copyFrom(cv::Mat &image, cv::Rect *dirtyRect = nullptr, int code = -1);
+    void copyFrom(TiledLayer &layer, Palette &palette, cv::Rect *dirtyRect = nullptr, int code = -1);
     template <class T>
-    void drawLines(std::vector<std::vector<T>> &lines, double thickness, bool closePath = false);
+    void drawLines(const FlatContours<T> &lines, double thickness, bool closePath = false);
     void drawPaths(std::vector<Path *> *paths, double thickness, cv::Scalar &stroke, cv::Scalar &fill);
-    void drawPath(Path *path, double thickness);
-    template <class T>
-    void plotPoints(std::vector<T> &points);
+    void drawPaths(PathIndex &pathIndex, double thickness, cv::Scalar &stroke, cv::Scalar &fill);
+    void drawVisiblePaths(std::vector<Path *> &paths, double thickness, cv::Scalar &stroke, cv::Scalar &fill);
+    template <class P>
+    void drawPath(P *path, double thickness);
     template <class T>
-    void plotPoints(std::vector<std::vector<T>> &lines);
+    void plotPoints(const FlatContours<T> &lines);
     void plotPathsHandle(std::vector<Path *> *paths);
-    void plotPathHandle(Path *path);
+    template <class P>
+    void plotPathHandle(P *path);
 };
 
 } // namespace illustrace
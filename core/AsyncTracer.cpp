@@ -0,0 +1,293 @@
+#include "AsyncTracer.h"
+#include "TaskScheduler.h"
+
+using namespace illustrace;
+
+// Requests are traced on a worker thread into a private document holding a snapshot of
+// the inputs. A new request raises the cancellation flag of the one in flight, and only
+// the result of the latest request is kept. Events are notified on the worker thread;
+// the result is moved into the target document by publish() on the owner's thread,
+// and observers must not wait() from them.
+
+struct AsyncTracer::Request {
+    unsigned generation;
+    Stage from;
+    Document *document;
+    Document work;
+    cv::Mat sourceImage;
+    bool clip;
+    cv::Rect clippingRect;
+};
+
+AsyncTracer::AsyncTracer() :
+    canceled(false),
+    pending(nullptr),
+    running(nullptr),
+    result(nullptr),
+    generation(0),
+    terminated(false)
+{
+    illustrace.cancellation(&canceled);
+    illustrace.addObserver(this);
+    worker = std::thread(&AsyncTracer::run, this);
+}
+
+AsyncTracer::~AsyncTracer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        terminated = true;
+        canceled = true;
+    }
+
+    condition.notify_all();
+    worker.join();
+
+    delete pending;
+    delete result;
+}
+
+void AsyncTracer::trace(cv::Mat &sourceImage, Document *document, const cv::Rect *clippingRect)
+{
+    Request *request = new Request();
+    request->from = Stage::Binarize;
+    request->document = document;
+    request->sourceImage = sourceImage.clone();
+    request->clip = nullptr != clippingRect;
+    if (clippingRect) {
+        request->clippingRect = *clippingRect;
+    }
+
+    Document &work = request->work;
+    work.brightness(document->brightness());
+    work.negative(document->negative());
+    work.blur(document->blur());
+    work.despeckle(document->despeckle());
+    work.detail(document->detail());
+    work.smoothing(document->smoothing());
+    work.fitting(document->fitting());
+    work.thickness(document->thickness());
+
+    this->request(request);
+}
+
+// Binarize needs the source image, so only trace() can start from it.
+void AsyncTracer::retrace(Document *document, Stage from)
+{
+    CV_Assert(Stage::Binarize != from);
+
+    Request *request = new Request();
+    request->from = from;
+    request->document = document;
+    request->clip = false;
+
+    Document &work = request->work;
+    work.brightness(document->brightness());
+    work.negative(document->negative());
+    work.blur(document->blur());
+    work.despeckle(document->despeckle());
+    work.detail(document->detail());
+    work.smoothing(document->smoothing());
+    work.fitting(document->fitting());
+    work.thickness(document->thickness());
+    work.contentRect(document->contentRect());
+    work.clippingRect(document->clippingRect());
+    work.traceRect(document->traceRect());
+    work.boundingRect(document->boundingRect());
+
+    switch (from) {
+    case Stage::BuildLines:
+        {
+            cv::Mat preprocessedImage = document->preprocessedImage().clone();
+            work.preprocessedImage(preprocessedImage);
+        }
+        break;
+    case Stage::ApproximateLines:
+        work.outlineContours(new FlatContours<cv::Point>(*document->outlineContours()));
+        break;
+    default:
+        work.approximatedOutlineContours(new FlatContours<cv::Point2f>(*document->approximatedOutlineContours()));
+        break;
+    }
+
+    this->request(request);
+}
+
+void AsyncTracer::cancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++generation;
+        canceled = true;
+        delete pending;
+        pending = nullptr;
+        delete result;
+        result = nullptr;
+    }
+
+    condition.notify_all();
+}
+
+void AsyncTracer::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [this] { return !pending && !running; });
+}
+
+bool AsyncTracer::publish()
+{
+    Request *request;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        request = result;
+        result = nullptr;
+    }
+
+    if (!request) {
+        return false;
+    }
+
+    apply(request);
+    delete request;
+    return true;
+}
+
+void AsyncTracer::notify(Illustrace *sender, va_list argList)
+{
+    Illustrace::Event event = static_cast<Illustrace::Event>(va_arg(argList, int));
+    Stage stage;
+
+    switch (event) {
+    case Illustrace::Event::Binarized:
+        stage = Stage::Binarize;
+        break;
+    case Illustrace::Event::OutlineBuilt:
+        stage = Stage::BuildLines;
+        break;
+    case Illustrace::Event::OutlineApproximated:
+        stage = Stage::ApproximateLines;
+        break;
+    case Illustrace::Event::OutlineBezierized:
+        stage = Stage::BuildPaths;
+        break;
+    default:
+        return;
+    }
+
+    double progress = (double)((int)stage - (int)running->from + 1) / ((int)Stage::BuildPaths - (int)running->from + 1);
+    Observable<AsyncTracer>::notify(this, Event::Progress, stage, progress);
+}
+
+void AsyncTracer::request(Request *request)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        request->generation = ++generation;
+        canceled = true;
+        delete pending;
+        pending = request;
+    }
+
+    condition.notify_all();
+}
+
+void AsyncTracer::run()
+{
+    TaskScheduler::LaneScope scope(TaskScheduler::Lane::Background);
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this] { return terminated || pending; });
+            if (terminated) {
+                break;
+            }
+
+            running = pending;
+            pending = nullptr;
+            canceled = false;
+        }
+
+        bool completed = execute(running);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            completed = completed && running->generation == generation;
+            if (completed) {
+                delete result;
+                result = running;
+            }
+        }
+
+        Observable<AsyncTracer>::notify(this, completed ? Event::Completed : Event::Canceled);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!completed) {
+                delete running;
+            }
+            running = nullptr;
+        }
+
+        condition.notify_all();
+    }
+}
+
+bool AsyncTracer::execute(Request *request)
+{
+    Document *work = &request->work;
+
+    if (Stage::Binarize == request->from) {
+        illustrace.traceFromImage(request->sourceImage, work, request->clip ? &request->clippingRect : nullptr);
+        return !canceled;
+    }
+
+    if (Stage::BuildLines >= request->from && !canceled) {
+        illustrace.buildLines(work);
+    }
+    if (Stage::ApproximateLines >= request->from && !canceled) {
+        illustrace.approximateLines(work);
+    }
+    if (!canceled) {
+        illustrace.buildPaths(work);
+    }
+
+    return !canceled;
+}
+
+// The results are swapped out of the private document, so publishing costs no copies.
+void AsyncTracer::apply(Request *request)
+{
+    Document *document = request->document;
+    Document &work = request->work;
+
+    if (Stage::Binarize == request->from) {
+        document->contentRect(work.contentRect());
+        document->clippingRect(work.clippingRect());
+        document->traceRect(work.traceRect());
+        document->binarizedImage(work.binarizedImage());
+        document->negativeImage(work.negativeImage());
+        document->preprocessedImage(work.preprocessedImage());
+        document->paintLayer(work.paintLayer());
+    }
+
+    if (Stage::BuildLines >= request->from) {
+        document->boundingRect(work.boundingRect());
+
+        auto *outlineContours = new FlatContours<cv::Point>();
+        outlineContours->swap(*work.outlineContours());
+        document->outlineContours(outlineContours);
+        document->specks(work.specks());
+    }
+
+    if (Stage::ApproximateLines >= request->from) {
+        auto *approximatedOutlineContours = new FlatContours<cv::Point2f>();
+        approximatedOutlineContours->swap(*work.approximatedOutlineContours());
+        document->approximatedOutlineContours(approximatedOutlineContours);
+    }
+
+    auto *paths = new std::vector<Path *>();
+    paths->swap(*work.paths());
+    document->paths(paths);
+}
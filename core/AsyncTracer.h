@@ -0,0 +1,82 @@
+#pragma once
+
+#include "Illustrace.h"
+#include "Observable.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+namespace illustrace {
+
+class AsyncTracer : public Observable<AsyncTracer>, public Observer<Illustrace> {
+public:
+    enum class Event : int {
+        Progress,
+        Completed,
+        Canceled,
+    };
+
+    static inline const char *Event2CString(Event event)
+    {
+#define CASE(event) case Event::event: return #event
+        switch (event) {
+        CASE(Progress);
+        CASE(Completed);
+        CASE(Canceled);
+        }
+#undef CASE
+    }
+
+    enum class Stage : int {
+        Binarize,
+        BuildLines,
+        ApproximateLines,
+        BuildPaths,
+    };
+
+    static inline const char *Stage2CString(Stage stage)
+    {
+#define CASE(stage) case Stage::stage: return #stage
+        switch (stage) {
+        CASE(Binarize);
+        CASE(BuildLines);
+        CASE(ApproximateLines);
+        CASE(BuildPaths);
+        }
+#undef CASE
+    }
+
+    AsyncTracer();
+    ~AsyncTracer();
+
+    void trace(cv::Mat &sourceImage, Document *document, const cv::Rect *clippingRect = nullptr);
+    void retrace(Document *document, Stage from);
+    void cancel();
+    void wait();
+    bool publish();
+
+    void notify(Illustrace *sender, va_list argList);
+
+private:
+    struct Request;
+
+    void request(Request *request);
+    void run();
+    bool execute(Request *request);
+    void apply(Request *request);
+
+    Illustrace illustrace;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::atomic<bool> canceled;
+    Request *pending;
+    Request *running;
+    Request *result;
+    unsigned generation;
+    bool terminated;
+};
+
+} // namespace illustrace
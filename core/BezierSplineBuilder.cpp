@@ -1,25 +1,99 @@
 #include "BezierSplineBuilder.h"
 #include "Util.h"
 
+#define CORNER_RADIAN (M_PI * 0.4)
+#define MAX_REPARAMETERIZE 4
+
 using namespace illustrace;
 
+static inline cv::Point2d normalize(cv::Point2d v);
+static void fitCubic(const std::vector<cv::Point2d> &points, int first, int last, cv::Point2d tangent1, cv::Point2d tangent2, double tolerance, double cornerRadian, std::vector<Segment> &segments);
+
 void BezierSplineBuilder::build(std::vector<cv::Point2f> &line, Path *result, double smoothing, bool closePath, bool keepPoint)
+{
+    if (keepPoint) {
+        closePath
+            ? buildSpline<true, true>(line, result, smoothing)
+            : buildSpline<true, false>(line, result, smoothing);
+    }
+    else {
+        closePath
+            ? buildSpline<false, true>(line, result, smoothing)
+            : buildSpline<false, false>(line, result, smoothing);
+    }
+}
+
+// Closed smooth paths for lines[begin, end). Same as build() with closePath, but the lines are
+// read in place instead of being copied to merge the end point into the first one.
+void BezierSplineBuilder::build(const FlatContours<cv::Point2f> &lines, int begin, int end, std::vector<Path *> &results, double smoothing)
+{
+    double cpIntervalRate = 0.5 + 0.35 * smoothing;
+
+    for (int i = begin; i < end; ++i) {
+        const FlatContours<cv::Point2f>::Contour line = lines[i];
+        int length = line.size();
+
+        results[i] = new Path();
+
+        if (2 >= length) {
+            std::vector<cv::Point2f> copy(line.begin(), line.end());
+            buildSpline<false, true>(copy, results[i], smoothing);
+            continue;
+        }
+
+        cv::Point2f first = line[0];
+        double l = util::vectorLength(util::vector(line[0], line[length - 1]));
+        if (2.0 > l) {
+            first = util::interval(0.5, line[0], line[length - 1]);
+            --length;
+        }
+
+        Path *result = results[i];
+        result->segments.reserve(length + 1);
+        result->segments.push_back(Segment::M(util::interval(0.5, first, line[1])));
+
+        const cv::Point2f *p0 = &first;
+        const cv::Point2f *p1 = &line[1];
+
+        for (int j = 0; j < length; ++j) {
+            const cv::Point2f *p2 = j + 2 < length ? &line[j + 2] : j + 2 == length ? &first : &line[1];
+
+            result->segments.push_back(Segment::C(
+                        util::interval(cpIntervalRate, *p0, *p1),
+                        util::interval(cpIntervalRate, *p2, *p1),
+                        util::interval(0.5, *p1, *p2)));
+
+            p0 = p1;
+            p1 = p2;
+        }
+
+        result->closed = true;
+        calcBounds(result);
+    }
+}
+
+template<bool KeepPoint, bool ClosePath>
+void BezierSplineBuilder::buildSpline(std::vector<cv::Point2f> &line, Path *result, double smoothing)
 {
     auto length = line.size();
 
     if (1 == length) {
         result->segments.push_back(Segment::M(line[0]));
         result->closed = true;
+        calcBounds(result);
         return;
     }
 
     if (2 == length) {
         result->segments.push_back(Segment::M(line[0]));
         result->segments.push_back(Segment::L(line[1]));
+        calcBounds(result);
         return;
     }
 
-    if (keepPoint) {
+    if (KeepPoint) {
+        result->segments.reserve(length);
+
         auto prev = Segment::M(line[0]);
         result->segments.push_back(prev);
      
@@ -40,65 +114,147 @@ void BezierSplineBuilder::build(std::vector<cv::Point2f> &line, Path *result, do
             calcControlPoint(result->segments[length - 2], result->segments[length - 1], result->segments[1], smoothing);
         }
     }
+    else if (ClosePath) {
+        double cpIntervalRate = 0.5 + 0.35 * smoothing;
+
+        double l = util::vectorLength(util::vector(line[0], line[length-1]));
+        if (2.0 > l) {
+            line[0] = util::interval(0.5, line[0], line[length-1]);
+            line.pop_back();
+            --length;
+        }
+
+        result->segments.reserve(length + 1);
+        result->segments.push_back(Segment::M(util::interval(0.5, line[0], line[1])));
+
+        for (int i = 0; i < length; ++i) {
+            int j = util::modIndex(i + 1, length);
+            int k = util::modIndex(i + 2, length);
+
+            auto p1 = util::interval(cpIntervalRate, line[i], line[j]);
+            auto p2 = util::interval(cpIntervalRate, line[k], line[j]);
+            auto p3 = util::interval(0.5, line[j], line[k]);
+
+            result->segments.push_back(Segment::C(p1, p2, p3));
+        }
+    }
     else {
         double cpIntervalRate = 0.5 + 0.35 * smoothing;
 
-        if (closePath) {
-            double l = util::vectorLength(util::vector(line[0], line[length-1]));
-            if (2.0 > l) {
-                line[0] = util::interval(0.5, line[0], line[length-1]);
-                line.pop_back();
-                --length;
-            }
+        result->segments.reserve(length + 1);
+        result->segments.push_back(Segment::M(line[0]));
+        result->segments.push_back(Segment::L(util::interval(0.5, line[0], line[1])));
 
-            result->segments.push_back(Segment::M(util::interval(0.5, line[0], line[1])));
+        for (int i = 0; i < length - 2; ++i) {
+            int j = i + 1;
+            int k = i + 2;
 
-            for (int i = 0; i < length; ++i) {
-                int j = util::modIndex(i + 1, length);
-                int k = util::modIndex(i + 2, length);
+            auto p1 = util::interval(cpIntervalRate, line[i], line[j]);
+            auto p2 = util::interval(cpIntervalRate, line[k], line[j]);
+            auto p3 = util::interval(0.5, line[j], line[k]);
 
-                auto p1 = util::interval(cpIntervalRate, line[i], line[j]);
-                auto p2 = util::interval(cpIntervalRate, line[k], line[j]);
-                auto p3 = util::interval(0.5, line[j], line[k]);
+            result->segments.push_back(Segment::C(p1, p2, p3));
+        }
 
-                result->segments.push_back(Segment::C(p1, p2, p3));
-            }
+        result->segments.push_back(Segment::L(line[length - 1]));
+    }
+
+    result->closed = ClosePath;
+    calcBounds(result);
+}
+
+// Error-bounded least-squares fitting after Schneider, "An Algorithm for Automatically Fitting
+// Digitized Curves" (Graphics Gems, 1990). The closed line is split at corners sharper than
+// CORNER_RADIAN scaled by smoothing, and every run between corners is covered by as few cubics as
+// keep its vertices and edge midpoints within tolerance. Cubics flat within tolerance become lines.
+void BezierSplineBuilder::fit(const FlatContours<cv::Point2f>::Contour &line, Path *result, double tolerance, double smoothing)
+{
+    std::vector<cv::Point2d> vertices(line.begin(), line.end());
+    int length = vertices.size();
+
+    if (3 <= length && 2.0 > util::vectorLength(util::vector(vertices[0], vertices[length - 1]))) {
+        vertices[0] = util::interval(0.5, vertices[0], vertices[length - 1]);
+        vertices.pop_back();
+        --length;
+    }
+
+    if (3 > length) {
+        std::vector<cv::Point2f> copy(line.begin(), line.end());
+        buildSpline<false, true>(copy, result, smoothing);
+        return;
+    }
+
+    double cornerRadian = MIN(M_PI, CORNER_RADIAN * smoothing);
+
+    std::vector<int> corners;
+    for (int i = 0; i < length; ++i) {
+        const cv::Point2d &prev = vertices[util::modIndex(i + length - 1, length)];
+        const cv::Point2d &next = vertices[util::modIndex(i + 1, length)];
+        if (cornerRadian < util::cornerRadian(prev, vertices[i], next)) {
+            corners.push_back(i);
         }
-        else {
-            result->segments.push_back(Segment::M(line[0]));
-            result->segments.push_back(Segment::L(util::interval(0.5, line[0], line[1])));
+    }
+
+    bool smooth = corners.empty();
+    if (smooth) {
+        corners.push_back(0);
+    }
 
-            for (int i = 0; i < length - 2; ++i) {
-                int j = i + 1;
-                int k = i + 2;
+    result->segments.push_back(Segment::M(cv::Point2f(vertices[corners[0]])));
 
-                auto p1 = util::interval(cpIntervalRate, line[i], line[j]);
-                auto p2 = util::interval(cpIntervalRate, line[k], line[j]);
-                auto p3 = util::interval(0.5, line[j], line[k]);
+    std::vector<cv::Point2d> points;
 
-                result->segments.push_back(Segment::C(p1, p2, p3));
-            }
+    for (int i = 0; i < corners.size(); ++i) {
+        int from = corners[i];
+        int to = i + 1 < corners.size() ? corners[i + 1] : corners[0] + length;
 
-            result->segments.push_back(Segment::L(line[length - 1]));
+        points.clear();
+        for (int j = from; j < to; ++j) {
+            const cv::Point2d &p1 = vertices[util::modIndex(j, length)];
+            const cv::Point2d &p2 = vertices[util::modIndex(j + 1, length)];
+            points.push_back(p1);
+            points.push_back(util::interval(0.5, p1, p2));
         }
+        points.push_back(vertices[util::modIndex(to, length)]);
+
+        int last = points.size() - 1;
+        cv::Point2d tangent1, tangent2;
+
+        if (smooth) {
+            tangent1 = util::vector(points[last - 1], points[1]);
+            tangent2 = -tangent1;
+        }
+        else {
+            tangent1 = util::vector(points[0], points[1]);
+            tangent2 = util::vector(points[last], points[last - 1]);
+        }
+
+        fitCubic(points, 0, last, normalize(tangent1), normalize(tangent2), tolerance, cornerRadian / 2.0, result->segments);
     }
 
-    result->closed = closePath;
+    result->closed = true;
+    calcBounds(result);
 }
 
+// The control vector is v2 rotated by minus half of the turning angle from v1 to v2. Cosine and
+// sine of the half angle follow from the cosine of the full angle by the half-angle formulas.
 void BezierSplineBuilder::calcControlPoint(Segment &prev, Segment &current, Segment &next, double smoothing)
 {
     cv::Point2f v1 = util::vector(prev[2], current[2]);
     cv::Point2f v2 = util::vector(current[2], next[2]);
 
-    double t = -atan2(util::crossProduct(v1, v2), util::dotProduct(v1, v2));
+    double cross = util::crossProduct(v1, v2);
+    double dot = util::dotProduct(v1, v2);
+    double r = sqrt(cross * cross + dot * dot);
+    double cosine = 0.0 < r ? dot / r : 1.0;
 
-    t /= 2.0;
+    double cosT = sqrt(MAX(0.0, (1.0 + cosine) / 2.0));
+    double sinT = -copysign(sqrt(MAX(0.0, (1.0 - cosine) / 2.0)), cross);
 
     double ctlNextVX = v2.x / 4.0 * smoothing;
     double ctlNextVY = v2.y / 4.0 * smoothing;
-    ctlNextVX = ctlNextVX * cos(t) - ctlNextVY * sin(t);
-    ctlNextVY = ctlNextVX * sin(t) + ctlNextVY * cos(t);
+    ctlNextVX = ctlNextVX * cosT - ctlNextVY * sinT;
+    ctlNextVY = ctlNextVX * sinT + ctlNextVY * cosT;
 
     next[0].x = ctlNextVX + current[2].x;
     next[0].y = ctlNextVY + current[2].y;
@@ -107,3 +263,248 @@ void BezierSplineBuilder::calcControlPoint(Segment &prev, Segment &current, Segm
     current[1].x = current[2].x - (ctlNextVX * scale);
     current[1].y = current[2].y - (ctlNextVY * scale);
 }
+
+// Tight bounds: the end points plus the extrema of each cubic, where the derivative
+// a t^2 + b t + c of either coordinate vanishes.
+static void extendByCubicExtrema(double p0, double p1, double p2, double p3, double &min, double &max)
+{
+    double a = -p0 + 3.0 * p1 - 3.0 * p2 + p3;
+    double b = 2.0 * (p0 - 2.0 * p1 + p2);
+    double c = p1 - p0;
+
+    double roots[2];
+    int count = 0;
+
+    if (1e-12 > fabs(a)) {
+        if (1e-12 < fabs(b)) {
+            roots[count++] = -c / b;
+        }
+    }
+    else {
+        double d = b * b - 4.0 * a * c;
+        if (0.0 <= d) {
+            d = sqrt(d);
+            roots[count++] = (-b + d) / (2.0 * a);
+            roots[count++] = (-b - d) / (2.0 * a);
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        double t = roots[i];
+        if (0.0 < t && t < 1.0) {
+            double mt = 1.0 - t;
+            double v = mt * mt * mt * p0 + 3.0 * mt * mt * t * p1 + 3.0 * mt * t * t * p2 + t * t * t * p3;
+            min = MIN(min, v);
+            max = MAX(max, v);
+        }
+    }
+}
+
+void BezierSplineBuilder::calcBounds(Path *path)
+{
+    if (path->segments.empty()) {
+        return;
+    }
+
+    cv::Point2f &first = path->segments[0][2];
+    double minX = first.x, minY = first.y;
+    double maxX = first.x, maxY = first.y;
+    cv::Point2f current = first;
+
+    for (Segment &s : path->segments) {
+        if (Segment::Type::Curve == s.type) {
+            extendByCubicExtrema(current.x, s[0].x, s[1].x, s[2].x, minX, maxX);
+            extendByCubicExtrema(current.y, s[0].y, s[1].y, s[2].y, minY, maxY);
+        }
+
+        current = s[2];
+        minX = MIN(minX, current.x);
+        minY = MIN(minY, current.y);
+        maxX = MAX(maxX, current.x);
+        maxY = MAX(maxY, current.y);
+    }
+
+    path->bounds = cv::Rect2f(minX, minY, maxX - minX, maxY - minY);
+}
+
+// Local functions
+
+static inline cv::Point2d normalize(cv::Point2d v)
+{
+    double length = util::vectorLength(v);
+    return 0.0 < length ? v / length : v;
+}
+
+static inline double bernstein(int i, double u)
+{
+    double mu = 1.0 - u;
+    switch (i) {
+    case 0: return mu * mu * mu;
+    case 1: return 3.0 * u * mu * mu;
+    case 2: return 3.0 * u * u * mu;
+    default: return u * u * u;
+    }
+}
+
+static inline cv::Point2d evaluate(const cv::Point2d *bezier, double u)
+{
+    return bezier[0] * bernstein(0, u) + bezier[1] * bernstein(1, u) + bezier[2] * bernstein(2, u) + bezier[3] * bernstein(3, u);
+}
+
+static void chordLengthParameterize(const std::vector<cv::Point2d> &points, int first, int last, std::vector<double> &u)
+{
+    u.resize(last - first + 1);
+    u[0] = 0.0;
+    for (int i = first + 1; i <= last; ++i) {
+        u[i - first] = u[i - first - 1] + util::vectorLength(util::vector(points[i - 1], points[i]));
+    }
+
+    double total = u[last - first];
+    for (double &value : u) {
+        value = 0.0 < total ? value / total : 0.0;
+    }
+}
+
+// Control point distances along the end tangents minimizing the squared distance to the points.
+static void generateBezier(const std::vector<cv::Point2d> &points, int first, int last, const std::vector<double> &u, cv::Point2d tangent1, cv::Point2d tangent2, cv::Point2d *bezier)
+{
+    const cv::Point2d &p0 = points[first];
+    const cv::Point2d &p3 = points[last];
+
+    double c00 = 0.0, c01 = 0.0, c11 = 0.0;
+    double x0 = 0.0, x1 = 0.0;
+
+    for (int i = first; i <= last; ++i) {
+        double t = u[i - first];
+        cv::Point2d a0 = tangent1 * bernstein(1, t);
+        cv::Point2d a1 = tangent2 * bernstein(2, t);
+        cv::Point2d rest = points[i] - (p0 * (bernstein(0, t) + bernstein(1, t)) + p3 * (bernstein(2, t) + bernstein(3, t)));
+
+        c00 += a0.dot(a0);
+        c01 += a0.dot(a1);
+        c11 += a1.dot(a1);
+        x0 += a0.dot(rest);
+        x1 += a1.dot(rest);
+    }
+
+    double det = c00 * c11 - c01 * c01;
+    double alpha1 = 0.0, alpha2 = 0.0;
+    if (1e-12 < fabs(det)) {
+        alpha1 = (x0 * c11 - x1 * c01) / det;
+        alpha2 = (c00 * x1 - c01 * x0) / det;
+    }
+
+    double chord = util::vectorLength(util::vector(p0, p3));
+    double epsilon = 1e-6 * chord;
+    if (alpha1 < epsilon || alpha2 < epsilon) {
+        alpha1 = alpha2 = chord / 3.0;
+    }
+
+    bezier[0] = p0;
+    bezier[1] = p0 + tangent1 * alpha1;
+    bezier[2] = p3 + tangent2 * alpha2;
+    bezier[3] = p3;
+}
+
+static double maxError(const std::vector<cv::Point2d> &points, int first, int last, const cv::Point2d *bezier, const std::vector<double> &u, int &split)
+{
+    double max = 0.0;
+    split = (first + last) / 2;
+
+    for (int i = first + 1; i < last; ++i) {
+        cv::Point2d v = evaluate(bezier, u[i - first]) - points[i];
+        double distance = v.dot(v);
+        if (max <= distance) {
+            max = distance;
+            split = i;
+        }
+    }
+
+    return max;
+}
+
+// One Newton-Raphson step per point towards the nearest parameter on the curve.
+static void reparameterize(const std::vector<cv::Point2d> &points, int first, int last, const cv::Point2d *bezier, std::vector<double> &u)
+{
+    cv::Point2d d1[3] = {(bezier[1] - bezier[0]) * 3.0, (bezier[2] - bezier[1]) * 3.0, (bezier[3] - bezier[2]) * 3.0};
+    cv::Point2d d2[2] = {(d1[1] - d1[0]) * 2.0, (d1[2] - d1[1]) * 2.0};
+
+    for (int i = first; i <= last; ++i) {
+        double t = u[i - first];
+        double mt = 1.0 - t;
+
+        cv::Point2d q = evaluate(bezier, t) - points[i];
+        cv::Point2d q1 = d1[0] * (mt * mt) + d1[1] * (2.0 * mt * t) + d1[2] * (t * t);
+        cv::Point2d q2 = d2[0] * mt + d2[1] * t;
+
+        double denominator = q1.dot(q1) + q.dot(q2);
+        if (1e-12 < fabs(denominator)) {
+            u[i - first] = MAX(0.0, MIN(1.0, t - q.dot(q1) / denominator));
+        }
+    }
+}
+
+static void appendSegment(const cv::Point2d *bezier, double tolerance, std::vector<Segment> &segments)
+{
+    cv::Point2d chord = bezier[3] - bezier[0];
+    double length = util::vectorLength(chord);
+
+    bool flat = 0.0 < length;
+    for (int i = 1; flat && i <= 2; ++i) {
+        cv::Point2d v = bezier[i] - bezier[0];
+        double along = v.dot(chord) / length;
+        flat = fabs(util::crossProduct(chord, v)) / length <= tolerance && 0.0 <= along && along <= length;
+    }
+
+    if (flat) {
+        segments.push_back(Segment::L(cv::Point2f(bezier[3])));
+    }
+    else {
+        segments.push_back(Segment::C(cv::Point2f(bezier[1]), cv::Point2f(bezier[2]), cv::Point2f(bezier[3])));
+    }
+}
+
+static void fitCubic(const std::vector<cv::Point2d> &points, int first, int last, cv::Point2d tangent1, cv::Point2d tangent2, double tolerance, double cornerRadian, std::vector<Segment> &segments)
+{
+    cv::Point2d bezier[4];
+
+    if (1 == last - first) {
+        segments.push_back(Segment::L(cv::Point2f(points[last])));
+        return;
+    }
+
+    std::vector<double> u;
+    chordLengthParameterize(points, first, last, u);
+    generateBezier(points, first, last, u, tangent1, tangent2, bezier);
+
+    int split;
+    double error = tolerance * tolerance;
+    double max = maxError(points, first, last, bezier, u, split);
+
+    for (int i = 0; error < max && max < error * 4.0 && i < MAX_REPARAMETERIZE; ++i) {
+        reparameterize(points, first, last, bezier, u);
+        generateBezier(points, first, last, u, tangent1, tangent2, bezier);
+        max = maxError(points, first, last, bezier, u, split);
+    }
+
+    if (max <= error) {
+        appendSegment(bezier, tolerance, segments);
+        return;
+    }
+
+    // Splitting at a vertex turning less than a corner but still sharply, the pieces keep their
+    // own tangents instead of being joined smoothly.
+    cv::Point2d center1, center2;
+
+    if (cornerRadian < util::cornerRadian(points[split - 1], points[split], points[split + 1])) {
+        center1 = normalize(util::vector(points[split], points[split - 1]));
+        center2 = normalize(util::vector(points[split], points[split + 1]));
+    }
+    else {
+        center1 = normalize(util::vector(points[split + 1], points[split - 1]));
+        center2 = -center1;
+    }
+
+    fitCubic(points, first, split, tangent1, center1, tolerance, cornerRadian, segments);
+    fitCubic(points, split, last, center2, tangent2, tolerance, cornerRadian, segments);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Document.h"
+#include "FlatContours.h"
 
 #include "opencv2/opencv.hpp"
 #include <vector>
@@ -10,8 +11,13 @@ namespace illustrace {
 class BezierSplineBuilder {
 public:
     static void build(std::vector<cv::Point2f> &line, Path *result, double smoothing, bool closePath, bool keepPoint);
+    static void build(const FlatContours<cv::Point2f> &lines, int begin, int end, std::vector<Path *> &results, double smoothing);
+    static void fit(const FlatContours<cv::Point2f>::Contour &line, Path *result, double tolerance, double smoothing);
 private:
+    template<bool KeepPoint, bool ClosePath>
+    static void buildSpline(std::vector<cv::Point2f> &line, Path *result, double smoothing);
     static void calcControlPoint(Segment &prev, Segment &current, Segment &next, double smoothing);
+    static void calcBounds(Path *path);
 };
 
 } // namespace illustrace
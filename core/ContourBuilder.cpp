@@ -0,0 +1,524 @@
+#include "ContourBuilder.h"
+#include "TaskScheduler.h"
+
+#include <cstring>
+#include <algorithm>
+
+#define MINIMUM_STRIPE_ROWS 256
+#define SPECKS_GRAIN 256
+
+using namespace illustrace;
+
+// Border following of Suzuki & Abe, the same as cv::findContours with CV_CHAIN_APPROX_SIMPLE.
+// Outer borders can only start at the head of a foreground run and holes only at its tail,
+// so the raster scan visits run boundaries of the RLE rows instead of every pixel.
+// The outer/hole relation for CCOMP is resolved by union-find over the runs.
+//
+// The image is split into horizontal stripes that are encoded and labeled in parallel and
+// joined at the seams. Every component is then traced by the stripe holding its first run,
+// so no two threads touch the same pixels, and sorting by start position reproduces the
+// serial order exactly. Stripes trace into flat contours of their own, which are appended
+// in the order cv::findContours returns them.
+
+static const schar Visited = 2;
+static const schar VisitedRightEdge = -2;
+
+static const cv::Point CodeDeltas[8] = {
+    {1, 0}, {1, -1}, {0, -1}, {-1, -1}, {-1, 0}, {-1, 1}, {0, 1}, {1, 1},
+};
+
+struct RunTable {
+    std::vector<int> x0;
+    std::vector<int> x1;
+    std::vector<int> rowOffsets;
+    std::vector<int> parents;
+
+    int root(int run) {
+        while (parents[run] != run) {
+            parents[run] = parents[parents[run]];
+            run = parents[run];
+        }
+        return run;
+    }
+
+    void unite(int run1, int run2) {
+        run1 = root(run1);
+        run2 = root(run2);
+        if (run1 < run2) {
+            parents[run2] = run1;
+        }
+        else if (run2 < run1) {
+            parents[run1] = run2;
+        }
+    }
+};
+
+struct Stripe {
+    int y0;
+    int y1;
+    int scanEnd;
+
+    std::vector<int> x0;
+    std::vector<int> x1;
+    std::vector<int> rowCounts;
+
+    FlatContours<cv::Point> contours;
+    std::vector<int> parents;
+    std::vector<uint64_t> keys;
+};
+
+static void encodeRuns(const cv::Mat &image, schar *labels, int labelStep, Stripe &stripe);
+static void labelRuns(RunTable &runs, int y0, int y1);
+static void fetchContour(schar *i0, cv::Point pt, bool isHole, const int *deltas, FlatContours<cv::Point> &contours);
+static void linkHierarchy(std::vector<int> &parents, std::vector<cv::Vec4i> &hierarchy);
+static bool isSpeck(const FlatContours<cv::Point>::Contour &contour, double maximumArea, double maximumLength);
+
+void ContourBuilder::build(const cv::Mat &image, FlatContours<cv::Point> &contours, Mode mode, cv::Point offset, int stripeCount, const std::atomic<bool> *canceled)
+{
+    CV_Assert(CV_8UC1 == image.type());
+
+    contours.clear();
+
+    if (image.empty()) {
+        return;
+    }
+
+    if (0 >= stripeCount) {
+        stripeCount = MAX(1, MIN(TaskScheduler::shared().threads(), image.rows / MINIMUM_STRIPE_ROWS));
+    }
+    stripeCount = MIN(stripeCount, image.rows);
+
+    int labelStep = image.cols + 2;
+    std::vector<schar> labels((image.rows + 2) * labelStep, 0);
+
+    int deltas[16];
+    for (int i = 0; i < 8; ++i) {
+        deltas[i] = deltas[i + 8] = CodeDeltas[i].y * labelStep + CodeDeltas[i].x;
+    }
+
+    std::vector<Stripe> stripes(stripeCount);
+    std::vector<int> stripeOfRows(image.rows);
+    for (int i = 0; i < stripeCount; ++i) {
+        stripes[i].y0 = image.rows * i / stripeCount;
+        stripes[i].y1 = image.rows * (i + 1) / stripeCount;
+        stripes[i].scanEnd = stripes[i].y0;
+        std::fill(&stripeOfRows[stripes[i].y0], &stripeOfRows[0] + stripes[i].y1, i);
+    }
+
+    TaskScheduler::shared().parallelFor(stripeCount, [&](int i) {
+        encodeRuns(image, labels.data(), labelStep, stripes[i]);
+    });
+
+    RunTable runs;
+    runs.rowOffsets.reserve(image.rows + 1);
+    int runOffset = 0;
+    for (auto &stripe : stripes) {
+        for (int count : stripe.rowCounts) {
+            runs.rowOffsets.push_back(runOffset);
+            runOffset += count;
+        }
+        runs.x0.insert(runs.x0.end(), stripe.x0.begin(), stripe.x0.end());
+        runs.x1.insert(runs.x1.end(), stripe.x1.begin(), stripe.x1.end());
+        std::vector<int>().swap(stripe.x0);
+        std::vector<int>().swap(stripe.x1);
+    }
+    runs.rowOffsets.push_back(runs.x0.size());
+
+    bool ccomp = Mode::CComp == mode;
+    bool needsComponents = ccomp || 1 < stripeCount;
+
+    std::vector<int> components;
+    std::vector<int> owners;
+
+    if (needsComponents) {
+        runs.parents.resize(runs.x0.size());
+        for (int i = 0; i < runs.parents.size(); ++i) {
+            runs.parents[i] = i;
+        }
+
+        TaskScheduler::shared().parallelFor(stripeCount, [&](int i) {
+            labelRuns(runs, stripes[i].y0, stripes[i].y1);
+        });
+
+        for (int i = 1; i < stripeCount; ++i) {
+            labelRuns(runs, stripes[i].y0 - 1, stripes[i].y0 + 1);
+        }
+
+        components.resize(runs.x0.size());
+        owners.resize(runs.x0.size());
+
+        for (int y = 0; y < image.rows; ++y) {
+            for (int r = runs.rowOffsets[y]; r < runs.rowOffsets[y + 1]; ++r) {
+                int component = runs.root(r);
+                components[r] = component;
+                if (component == r) {
+                    owners[r] = stripeOfRows[y];
+                }
+
+                Stripe &owner = stripes[owners[component]];
+                owner.scanEnd = MAX(owner.scanEnd, y + 1);
+            }
+        }
+    }
+    else {
+        stripes[0].scanEnd = image.rows;
+    }
+
+    std::vector<int> outerContours(ccomp ? runs.x0.size() : 0, -1);
+
+    TaskScheduler::shared().parallelFor(stripeCount, [&](int i) {
+        Stripe &stripe = stripes[i];
+
+        for (int y = stripe.y0; y < stripe.scanEnd; ++y) {
+            if (canceled && *canceled) {
+                return;
+            }
+
+            schar *row = &labels[(y + 1) * labelStep + 1];
+
+            for (int r = runs.rowOffsets[y]; r < runs.rowOffsets[y + 1]; ++r) {
+                int component = needsComponents ? components[r] : 0;
+                if (1 < stripeCount && owners[component] != i) {
+                    continue;
+                }
+
+                int x0 = runs.x0[r];
+                int x1 = runs.x1[r];
+
+                if (1 == row[x0]) {
+                    fetchContour(&row[x0], cv::Point(x0, y) + offset, false, deltas, stripe.contours);
+                    stripe.parents.push_back(-1);
+                    stripe.keys.push_back((uint64_t)y << 32 | (uint64_t)x0 << 1);
+                    if (ccomp) {
+                        outerContours[component] = stripe.contours.size() - 1;
+                    }
+                }
+
+                if (1 <= row[x1 - 1]) {
+                    fetchContour(&row[x1 - 1], cv::Point(x1 - 1, y) + offset, true, deltas, stripe.contours);
+                    stripe.parents.push_back(ccomp ? outerContours[component] : -1);
+                    stripe.keys.push_back((uint64_t)y << 32 | (uint64_t)(x1 - 1) << 1 | 1);
+                }
+            }
+        }
+    });
+
+    if (canceled && *canceled) {
+        return;
+    }
+
+    // Contours in the order they were found, as (stripe, index in the stripe), and their parents
+    std::vector<std::pair<int, int>> found;
+    std::vector<int> parents;
+
+    if (1 == stripeCount) {
+        Stripe &stripe = stripes[0];
+        found.resize(stripe.parents.size());
+        for (int i = 0; i < found.size(); ++i) {
+            found[i] = std::make_pair(0, i);
+        }
+        parents.swap(stripe.parents);
+    }
+    else {
+        std::vector<std::pair<uint64_t, std::pair<int, int>>> order;
+        for (int i = 0; i < stripeCount; ++i) {
+            for (int j = 0; j < stripes[i].keys.size(); ++j) {
+                order.push_back(std::make_pair(stripes[i].keys[j], std::make_pair(i, j)));
+            }
+        }
+
+        std::sort(order.begin(), order.end());
+
+        std::vector<std::vector<int>> indices(stripeCount);
+        for (int i = 0; i < stripeCount; ++i) {
+            indices[i].resize(stripes[i].keys.size());
+        }
+        for (int i = 0; i < order.size(); ++i) {
+            indices[order[i].second.first][order[i].second.second] = i;
+        }
+
+        found.resize(order.size());
+        parents.resize(order.size());
+
+        for (int i = 0; i < order.size(); ++i) {
+            int parent = stripes[order[i].second.first].parents[order[i].second.second];
+            found[i] = order[i].second;
+            parents[i] = -1 == parent ? -1 : indices[order[i].second.first][parent];
+        }
+    }
+
+    // cv::findContours prepends every contour found to the list of its siblings and emits the
+    // tree depth first, so the roots come last found first, each followed by its holes likewise.
+    int length = found.size();
+    int firstRoot = -1;
+    std::vector<int> firstChildren(length, -1);
+    std::vector<int> nextSiblings(length, -1);
+
+    for (int i = 0; i < length; ++i) {
+        int &first = -1 == parents[i] ? firstRoot : firstChildren[parents[i]];
+        nextSiblings[i] = first;
+        first = i;
+    }
+
+    std::vector<int> emitted;
+    emitted.reserve(length);
+    for (int root = firstRoot; -1 != root; root = nextSiblings[root]) {
+        emitted.push_back(root);
+        for (int child = firstChildren[root]; -1 != child; child = nextSiblings[child]) {
+            emitted.push_back(child);
+        }
+    }
+
+    std::vector<int> emittedIndices(length);
+    for (int i = 0; i < length; ++i) {
+        emittedIndices[emitted[i]] = i;
+    }
+
+    size_t pointCount = 0;
+    for (auto &stripe : stripes) {
+        pointCount += stripe.contours.points.size();
+    }
+
+    contours.points.reserve(pointCount);
+    contours.offsets.reserve(length + 1);
+    std::vector<int> emittedParents(length);
+
+    for (int i = 0; i < length; ++i) {
+        int index = emitted[i];
+        contours.append(stripes[found[index].first].contours[found[index].second]);
+        emittedParents[i] = -1 == parents[index] ? -1 : emittedIndices[parents[index]];
+    }
+
+    linkHierarchy(emittedParents, contours.hierarchy);
+}
+
+// Drops specks, contours smaller than a size x size square in both area and perimeter, along with
+// the holes of dropped outer contours. Thin lines have little area but a long perimeter, so they
+// stay. Parents precede their children as build() emits them, and the points are packed in place.
+// Returns the number of contours dropped.
+int ContourBuilder::despeckle(FlatContours<cv::Point> &contours, double size)
+{
+    int count = contours.size();
+    if (0.0 >= size || 0 == count) {
+        return 0;
+    }
+
+    std::vector<char> specks(count);
+    TaskScheduler::shared().parallelFor(count, SPECKS_GRAIN, [&](int i) {
+        specks[i] = isSpeck(contours[i], size * size, size * 4.0);
+    });
+
+    std::vector<int> indices(count, -1);
+    std::vector<int> parents;
+    std::vector<cv::Point> &points = contours.points;
+    int kept = 0;
+    int offset = 0;
+
+    for (int i = 0; i < count; ++i) {
+        int parent = contours.hierarchy[i][3];
+        if (specks[i] || (-1 != parent && -1 == indices[parent])) {
+            continue;
+        }
+
+        int begin = contours.offsets[i];
+        int end = contours.offsets[i + 1];
+        std::copy(points.begin() + begin, points.begin() + end, points.begin() + offset);
+        contours.offsets[kept] = offset;
+        offset += end - begin;
+
+        indices[i] = kept++;
+        parents.push_back(-1 == parent ? -1 : indices[parent]);
+    }
+
+    contours.offsets.resize(kept + 1);
+    contours.offsets[kept] = offset;
+    points.resize(offset);
+    linkHierarchy(parents, contours.hierarchy);
+
+    return count - kept;
+}
+
+// Local functions
+
+static inline int firstNonZero(const uchar *data, int from, int to)
+{
+    int x = from;
+
+    for (; x < to && (x & 7); ++x) {
+        if (data[x]) {
+            return x;
+        }
+    }
+
+    for (; x + 8 <= to; x += 8) {
+        uint64_t word;
+        memcpy(&word, data + x, 8);
+        if (word) {
+            break;
+        }
+    }
+
+    for (; x < to; ++x) {
+        if (data[x]) {
+            return x;
+        }
+    }
+
+    return to;
+}
+
+static inline int firstZero(const uchar *data, int from, int to)
+{
+    const void *zero = memchr(data + from, 0, to - from);
+    return zero ? (int)((const uchar *)zero - data) : to;
+}
+
+static void encodeRuns(const cv::Mat &image, schar *labels, int labelStep, Stripe &stripe)
+{
+    for (int y = stripe.y0; y < stripe.y1; ++y) {
+        const uchar *data = image.ptr<uchar>(y);
+        schar *row = &labels[(y + 1) * labelStep + 1];
+        int count = 0;
+
+        int x = 0;
+        while ((x = firstNonZero(data, x, image.cols)) < image.cols) {
+            int x1 = firstZero(data, x, image.cols);
+            memset(&row[x], 1, x1 - x);
+            stripe.x0.push_back(x);
+            stripe.x1.push_back(x1);
+            ++count;
+            x = x1;
+        }
+
+        stripe.rowCounts.push_back(count);
+    }
+}
+
+static void labelRuns(RunTable &runs, int y0, int y1)
+{
+    for (int y = y0 + 1; y < y1; ++y) {
+        int above = runs.rowOffsets[y - 1];
+        int aboveEnd = runs.rowOffsets[y];
+        int current = runs.rowOffsets[y];
+        int currentEnd = runs.rowOffsets[y + 1];
+
+        // 8-connected when [x0 - 1, x1] of one run overlaps the other
+        while (above < aboveEnd && current < currentEnd) {
+            if (runs.x0[current] <= runs.x1[above] && runs.x0[above] <= runs.x1[current]) {
+                runs.unite(above, current);
+            }
+
+            if (runs.x1[above] < runs.x1[current]) {
+                ++above;
+            }
+            else {
+                ++current;
+            }
+        }
+    }
+}
+
+static void fetchContour(schar *i0, cv::Point pt, bool isHole, const int *deltas, FlatContours<cv::Point> &contours)
+{
+    std::vector<cv::Point> &points = contours.points;
+
+    int s = isHole ? 0 : 4;
+    int sEnd = s;
+    schar *i1;
+
+    do {
+        s = (s - 1) & 7;
+        i1 = i0 + deltas[s];
+    } while (0 == *i1 && s != sEnd);
+
+    if (s == sEnd) {
+        *i0 = VisitedRightEdge;
+        points.push_back(pt);
+        contours.close();
+        return;
+    }
+
+    schar *i3 = i0;
+    schar *i4;
+    int prevS = s ^ 4;
+
+    for (;;) {
+        sEnd = s;
+
+        do {
+            i4 = i3 + deltas[++s];
+        } while (0 == *i4);
+
+        s &= 7;
+
+        if ((unsigned)(s - 1) < (unsigned)sEnd) {
+            *i3 = VisitedRightEdge;
+        }
+        else if (1 == *i3) {
+            *i3 = Visited;
+        }
+
+        if (s != prevS) {
+            points.push_back(pt);
+            prevS = s;
+        }
+
+        pt += CodeDeltas[s];
+
+        if (i4 == i0 && i3 == i1) {
+            break;
+        }
+
+        i3 = i4;
+        s = (s + 4) & 7;
+    }
+
+    contours.close();
+}
+
+static void linkHierarchy(std::vector<int> &parents, std::vector<cv::Vec4i> &hierarchy)
+{
+    int length = parents.size();
+    hierarchy.assign(length, cv::Vec4i(-1, -1, -1, -1));
+
+    std::vector<int> lastChildren(length, -1);
+    int lastRoot = -1;
+
+    for (int i = 0; i < length; ++i) {
+        int parent = parents[i];
+        int &last = -1 == parent ? lastRoot : lastChildren[parent];
+
+        if (-1 != last) {
+            hierarchy[last][0] = i;
+            hierarchy[i][1] = last;
+        }
+        else if (-1 != parent) {
+            hierarchy[parent][2] = i;
+        }
+
+        hierarchy[i][3] = parent;
+        last = i;
+    }
+}
+
+// The perimeter is summed first, so contours of lines are rejected after a few edges.
+static bool isSpeck(const FlatContours<cv::Point>::Contour &contour, double maximumArea, double maximumLength)
+{
+    int length = contour.size();
+    double perimeter = 0.0;
+    int64_t area = 0;
+
+    for (int i = 0; i < length; ++i) {
+        const cv::Point &p0 = contour[i];
+        const cv::Point &p1 = contour[i + 1 < length ? i + 1 : 0];
+
+        perimeter += sqrt((double)(p1.x - p0.x) * (p1.x - p0.x) + (double)(p1.y - p0.y) * (p1.y - p0.y));
+        if (maximumLength <= perimeter) {
+            return false;
+        }
+
+        area += (int64_t)p0.x * p1.y - (int64_t)p1.x * p0.y;
+    }
+
+    return std::abs(area) < maximumArea * 2.0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "FlatContours.h"
+
+#include "opencv2/imgproc.hpp"
+#include <vector>
+#include <atomic>
+
+namespace illustrace {
+
+class ContourBuilder {
+public:
+    enum class Mode {
+        List,
+        CComp,
+    };
+
+    static void build(const cv::Mat &image, FlatContours<cv::Point> &contours, Mode mode, cv::Point offset = cv::Point(), int stripeCount = 0, const std::atomic<bool> *canceled = nullptr);
+    static int despeckle(FlatContours<cv::Point> &contours, double size);
+};
+
+} // namespace illustrace
@@ -6,24 +6,26 @@ Document::Document() :
     _brightness(0.0),
     _negative(false),
     _blur(1.0),
+    _despeckle(0.0),
     _detail(1.0),
     _smoothing(1.0),
+    _fitting(FittingMode::Spline),
     _thickness(1.0),
     _rotation(0.0),
     _color(cv::Scalar(0, 0, 0)),
     _backgroundColor(cv::Scalar(255, 255, 255)),
+    _paintMaskStale(true),
     _backgroundEnable(false),
     _paths(nullptr),
     _paintPaths(nullptr),
     _outlineContours(nullptr),
     _approximatedOutlineContours(nullptr),
-    _outlineHierarchy(nullptr)
+    _specks(0)
 {
     _paths = new std::vector<Path *>();
     _paintPaths = new std::vector<Path *>();
-    _outlineContours = new std::vector<std::vector<cv::Point>>();
-    _approximatedOutlineContours = new std::vector<std::vector<cv::Point2f>>();
-    _outlineHierarchy = new std::vector<cv::Vec4i>();
+    _outlineContours = new FlatContours<cv::Point>();
+    _approximatedOutlineContours = new FlatContours<cv::Point2f>();
 }
 
 Document::~Document()
@@ -49,10 +51,6 @@ Document::~Document()
     if (_approximatedOutlineContours) {
         delete _approximatedOutlineContours;
     }
-
-    if (_outlineHierarchy) {
-        delete _outlineHierarchy;
-    }
 }
 
 double Document::brightness()
@@ -70,6 +68,11 @@ double Document::blur()
     return _blur;
 }
 
+double Document::despeckle()
+{
+    return _despeckle;
+}
+
 double Document::detail()
 {
     return _detail;
@@ -80,6 +83,11 @@ double Document::smoothing()
     return _smoothing;
 }
 
+Document::FittingMode Document::fitting()
+{
+    return _fitting;
+}
+
 double Document::thickness()
 {
     return _thickness;
@@ -105,16 +113,36 @@ bool Document::backgroundEnable()
     return _backgroundEnable;
 }
 
-cv::Mat &Document::paintLayer()
+TiledLayer &Document::paintLayer()
 {
     return _paintLayer;
 }
 
+Palette &Document::paintPalette()
+{
+    return _paintPalette;
+}
+
 cv::Mat &Document::paintMask()
 {
     return _paintMask;
 }
 
+bool Document::paintMaskStale()
+{
+    return _paintMaskStale;
+}
+
+std::vector<cv::Rect2f> &Document::paintMaskDirtyRects()
+{
+    return _paintMaskDirtyRects;
+}
+
+RegionMap &Document::regionMap()
+{
+    return _regionMap;
+}
+
 cv::Rect &Document::contentRect()
 {
     return _contentRect;
@@ -130,6 +158,11 @@ cv::Rect &Document::boundingRect()
     return _boundingRect;
 }
 
+cv::Rect &Document::traceRect()
+{
+    return _traceRect;
+}
+
 std::vector<Path *> *Document::paths()
 {
     return _paths;
@@ -140,6 +173,16 @@ std::vector<Path *> *Document::paintPaths()
     return _paintPaths;
 }
 
+PathIndex &Document::pathIndex()
+{
+    return _pathIndex;
+}
+
+PathIndex &Document::paintPathIndex()
+{
+    return _paintPathIndex;
+}
+
 cv::Mat &Document::binarizedImage()
 {
     return _binarizedImage;
@@ -155,19 +198,19 @@ cv::Mat &Document::preprocessedImage()
     return _preprocessedImage;
 }
 
-std::vector<std::vector<cv::Point>> *Document::outlineContours()
+FlatContours<cv::Point> *Document::outlineContours()
 {
     return _outlineContours;
 }
 
-std::vector<std::vector<cv::Point2f>> *Document::approximatedOutlineContours()
+FlatContours<cv::Point2f> *Document::approximatedOutlineContours()
 {
     return _approximatedOutlineContours;
 }
 
-std::vector<cv::Vec4i> *Document::outlineHierarchy()
+int Document::specks()
 {
-    return _outlineHierarchy;
+    return _specks;
 }
 
 void Document::brightness(double brightness)
@@ -188,6 +231,12 @@ void Document::blur(double blur)
     notify(this, Document::Event::Blur);
 }
 
+void Document::despeckle(double despeckle)
+{
+    _despeckle = despeckle;
+    notify(this, Document::Event::Despeckle);
+}
+
 void Document::detail(double detail)
 {
     _detail = detail;
@@ -200,8 +249,17 @@ void Document::smoothing(double smoothing)
     notify(this, Document::Event::Smoothing);
 }
 
+void Document::fitting(FittingMode fitting)
+{
+    _fitting = fitting;
+    notify(this, Document::Event::Fitting);
+}
+
 void Document::thickness(double thickness)
 {
+    if (_thickness != thickness) {
+        _paintMaskStale = true;
+    }
     _thickness = thickness;
     notify(this, Document::Event::Thickness);
 }
@@ -230,21 +288,29 @@ void Document::backgroundEnable(bool backgroundEnable)
     notify(this, Document::Event::BackgroundEnable);
 }
 
-void Document::paintLayer(cv::Mat &paintLayer)
+void Document::paintLayer(TiledLayer &paintLayer)
 {
     _paintLayer = paintLayer;
     notify(this, Document::Event::PaintLayer, &_contentRect);
 }
 
-void Document::paintLayer(cv::Mat &paintLayer, cv::Rect *dirtyRect)
+void Document::paintLayer(TiledLayer &paintLayer, cv::Rect *dirtyRect)
 {
     _paintLayer = paintLayer;
     notify(this, Document::Event::PaintLayer, dirtyRect);
 }
 
+void Document::paintPalette(Palette &paintPalette)
+{
+    _paintPalette = paintPalette;
+    notify(this, Document::Event::PaintPalette);
+}
+
 void Document::paintMask(cv::Mat &paintMask)
 {
     _paintMask = paintMask;
+    _paintMaskStale = false;
+    _paintMaskDirtyRects.clear();
     notify(this, Document::Event::PaintMask);
 }
 
@@ -266,6 +332,12 @@ void Document::boundingRect(cv::Rect &rect)
     notify(this, Document::Event::BoundingRect);
 }
 
+void Document::traceRect(cv::Rect &rect)
+{
+    _traceRect = rect;
+    notify(this, Document::Event::TraceRect);
+}
+
 void Document::paths(std::vector<Path *> *paths)
 {
     if (_paths) {
@@ -275,6 +347,26 @@ void Document::paths(std::vector<Path *> *paths)
         delete _paths;
     }
     _paths = paths;
+    _pathIndex.build(*_paths);
+    _paintMaskStale = true;
+    notify(this, Document::Event::Paths);
+}
+
+// The paint mask stays as it is but for the dirty rects, which must cover the bounds of every
+// path added or removed. They are not kept while the whole mask is stale.
+void Document::paths(std::vector<Path *> *paths, const std::vector<cv::Rect2f> &dirtyRects)
+{
+    if (_paths) {
+        for (auto *path : *_paths) {
+            delete path;
+        }
+        delete _paths;
+    }
+    _paths = paths;
+    _pathIndex.build(*_paths);
+    if (!_paintMaskStale) {
+        _paintMaskDirtyRects.insert(_paintMaskDirtyRects.end(), dirtyRects.begin(), dirtyRects.end());
+    }
     notify(this, Document::Event::Paths);
 }
 
@@ -287,6 +379,7 @@ void Document::paintPaths(std::vector<Path *> *paintPaths)
         delete _paintPaths;
     }
     _paintPaths = paintPaths;
+    _paintPathIndex.build(*_paintPaths);
     notify(this, Document::Event::PaintPaths);
 }
 
@@ -314,7 +407,7 @@ void Document::preprocessedImage(cv::Mat &preprocessedImage, cv::Rect *dirtyRect
     notify(this, Document::Event::PreprocessedImage, dirtyRect);
 }
 
-void Document::outlineContours(std::vector<std::vector<cv::Point>> *outlineContours)
+void Document::outlineContours(FlatContours<cv::Point> *outlineContours)
 {
     if (_outlineContours) {
         delete _outlineContours;
@@ -323,7 +416,7 @@ void Document::outlineContours(std::vector<std::vector<cv::Point>> *outlineConto
     notify(this, Document::Event::OutlineContours);
 }
 
-void Document::approximatedOutlineContours(std::vector<std::vector<cv::Point2f>> *approximatedOutlineContours)
+void Document::approximatedOutlineContours(FlatContours<cv::Point2f> *approximatedOutlineContours)
 {
     if (_approximatedOutlineContours) {
         delete _approximatedOutlineContours;
@@ -332,13 +425,10 @@ void Document::approximatedOutlineContours(std::vector<std::vector<cv::Point2f>>
     notify(this, Document::Event::ApproximatedOutlineContours);
 }
 
-void Document::outlineHierarchy(std::vector<cv::Vec4i> *outlineHierarchy)
+void Document::specks(int specks)
 {
-    if (_outlineHierarchy) {
-        delete _outlineHierarchy;
-    }
-    _outlineHierarchy = outlineHierarchy;
-    notify(this, Document::Event::OutlineHierarchy);
+    _specks = specks;
+    notify(this, Document::Event::Specks);
 }
 
 namespace illustrace {
@@ -349,18 +439,23 @@ std::ostream &operator<<(std::ostream &os, Document const &self)
     os << "brightness: " << self._brightness << ", ";
     os << "negative: " << self._negative << ", ";
     os << "blur: " << self._blur << ", ";
+    os << "despeckle: " << self._despeckle << ", ";
     os << "detail: " << self._detail << ", ";
     os << "smoothing: " << self._smoothing << ", ";
+    os << "fitting: " << Document::FittingMode2CString(self._fitting) << ", ";
     os << "thickness: " << self._thickness << ", ";
     os << "rotation: " << self._rotation << ", ";
     os << "color: " << self._color << ", ";
     os << "backgroundColor: " << self._backgroundColor << ", ";
     os << "paintLayer: " << &self._paintLayer << ", ";
+    os << "paintPalette: " << self._paintPalette.size() << ", ";
     os << "paintMask: " << &self._paintMask << ", ";
+    os << "regionMap: " << &self._regionMap << ", ";
     os << "backgroundEnable: " << self._backgroundEnable << ", ";
     os << "contentRect: " << self._contentRect << ", ";
     os << "clippingRect: " << self._clippingRect << ", ";
     os << "boundingRect: " << self._boundingRect << ", ";
+    os << "traceRect: " << self._traceRect << ", ";
     os << "paths: " << self._paths << ", ";
     os << "paintPaths: " << self._paintPaths << ", ";
     os << "binarizedImage: " << &self._binarizedImage << ", ";
@@ -368,7 +463,7 @@ std::ostream &operator<<(std::ostream &os, Document const &self)
     os << "preprocessedImage: " << &self._preprocessedImage << ", ";
     os << "outlineContours: " << self._outlineContours << ", ";
     os << "approximatedOutlineContours: " << self._approximatedOutlineContours << ", ";
-    os << "outlineHierarchy: " << self._outlineHierarchy << "";
+    os << "specks: " << self._specks << "";
     os << ">";
     return os;
 }
@@ -1,6 +1,10 @@
 #pragma once
 
 #include "Observable.h"
+#include "RegionMap.h"
+#include "PathIndex.h"
+#include "FlatContours.h"
+#include "TiledLayer.h"
 
 #include "opencv2/opencv.hpp"
 #include <vector>
@@ -21,6 +25,10 @@ struct Segment {
         return p[index];
     }
 
+    const cv::Point2f& operator[] (const int index) const {
+        return p[index];
+    }
+
     static Segment M(cv::Point2f p) {
         return (Segment){
             Type::Move,
@@ -82,6 +90,7 @@ struct Path {
     bool closed;
     std::vector<Path *> children;
     cv::Scalar *color;
+    cv::Rect2f bounds;
 
     Path() : closed(false), color(nullptr) {};
     ~Path() {
@@ -93,22 +102,31 @@ struct Path {
 
 class Document : public Observable<Document> {
 public:
+    enum FittingMode : int {
+        Spline,
+        LeastSquares,
+    };
+
     enum Event : int {
         Brightness,
         Negative,
         Blur,
+        Despeckle,
         Detail,
         Smoothing,
+        Fitting,
         Thickness,
         Rotation,
         Color,
         BackgroundColor,
         BackgroundEnable,
         PaintLayer,
+        PaintPalette,
         PaintMask,
         ContentRect,
         ClippingRect,
         BoundingRect,
+        TraceRect,
         Paths,
         PaintPaths,
         BinarizedImage,
@@ -116,7 +134,7 @@ public:
         PreprocessedImage,
         OutlineContours,
         ApproximatedOutlineContours,
-        OutlineHierarchy,
+        Specks,
     };
 
     static inline const char *Event2CString(Event event) {
@@ -125,18 +143,22 @@ public:
         CASE(Brightness);
         CASE(Negative);
         CASE(Blur);
+        CASE(Despeckle);
         CASE(Detail);
         CASE(Smoothing);
+        CASE(Fitting);
         CASE(Thickness);
         CASE(Rotation);
         CASE(Color);
         CASE(BackgroundColor);
         CASE(BackgroundEnable);
         CASE(PaintLayer);
+        CASE(PaintPalette);
         CASE(PaintMask);
         CASE(ContentRect);
         CASE(ClippingRect);
         CASE(BoundingRect);
+        CASE(TraceRect);
         CASE(Paths);
         CASE(PaintPaths);
         CASE(BinarizedImage);
@@ -144,63 +166,85 @@ public:
         CASE(PreprocessedImage);
         CASE(OutlineContours);
         CASE(ApproximatedOutlineContours);
-        CASE(OutlineHierarchy);
+        CASE(Specks);
         }
 #undef CASE
     }
 
+    static inline const char *FittingMode2CString(FittingMode mode) {
+        switch (mode) {
+        case Spline: return "spline";
+        case LeastSquares: return "leastsquares";
+        }
+    }
+
     Document();
     ~Document();
 
     double brightness();
     bool negative();
     double blur();
+    double despeckle();
     double detail();
     double smoothing();
+    FittingMode fitting();
     double thickness();
     double rotation();
     cv::Scalar &color();
     cv::Scalar &backgroundColor();
     bool backgroundEnable();
-    cv::Mat &paintLayer();
+    TiledLayer &paintLayer();
+    Palette &paintPalette();
     cv::Mat &paintMask();
+    bool paintMaskStale();
+    std::vector<cv::Rect2f> &paintMaskDirtyRects();
+    RegionMap &regionMap();
     cv::Rect &contentRect();
     cv::Rect &clippingRect();
     cv::Rect &boundingRect();
+    cv::Rect &traceRect();
     std::vector<Path *> *paths();
     std::vector<Path *> *paintPaths();
+    PathIndex &pathIndex();
+    PathIndex &paintPathIndex();
     cv::Mat &binarizedImage();
     cv::Mat &negativeImage();
     cv::Mat &preprocessedImage();
-    std::vector<std::vector<cv::Point>> *outlineContours();
-    std::vector<std::vector<cv::Point2f>> *approximatedOutlineContours();
-    std::vector<cv::Vec4i> *outlineHierarchy();
+    FlatContours<cv::Point> *outlineContours();
+    FlatContours<cv::Point2f> *approximatedOutlineContours();
+    // Contours dropped by despeckle in the last trace, -1 when they were restored from the cache.
+    int specks();
 
     void brightness(double brightness);
     void negative(bool negative);
     void blur(double blur);
+    void despeckle(double despeckle);
     void detail(double detail);
     void smoothing(double smoothing);
+    void fitting(FittingMode fitting);
     void thickness(double thickness);
     void rotation(double rotation);
     void color(cv::Scalar &color);
     void backgroundColor(cv::Scalar &backgroundColor);
     void backgroundEnable(bool enable);
-    void paintLayer(cv::Mat &paintLayer);
-    void paintLayer(cv::Mat &paintLayer, cv::Rect *dirtyRect);
+    void paintLayer(TiledLayer &paintLayer);
+    void paintLayer(TiledLayer &paintLayer, cv::Rect *dirtyRect);
+    void paintPalette(Palette &paintPalette);
     void paintMask(cv::Mat &paintMask);
     void contentRect(cv::Rect &rect);
     void clippingRect(cv::Rect &rect);
     void boundingRect(cv::Rect &rect);
+    void traceRect(cv::Rect &rect);
     void paths(std::vector<Path *> *paths);
+    void paths(std::vector<Path *> *paths, const std::vector<cv::Rect2f> &dirtyRects);
     void paintPaths(std::vector<Path *> *paintPaths);
     void binarizedImage(cv::Mat &binarizedImage);
     void negativeImage(cv::Mat &negativeImage);
     void preprocessedImage(cv::Mat &preprocessedImage);
     void preprocessedImage(cv::Mat &preprocessedImage, cv::Rect *dirtyRect);
-    void outlineContours(std::vector<std::vector<cv::Point>> *outlineContours);
-    void approximatedOutlineContours(std::vector<std::vector<cv::Point2f>> *approximatedOutlineContours);
-    void outlineHierarchy(std::vector<cv::Vec4i> *outlineHierarchy);
+    void outlineContours(FlatContours<cv::Point> *outlineContours);
+    void approximatedOutlineContours(FlatContours<cv::Point2f> *approximatedOutlineContours);
+    void specks(int specks);
 
     friend std::ostream &operator<<(std::ostream &stream, Document const &self);
 
@@ -208,28 +252,37 @@ private:
     double _brightness;
     bool _negative;
     double _blur;
+    double _despeckle;
     double _detail;
     double _smoothing;
+    FittingMode _fitting;
     double _thickness;
     double _rotation;
     cv::Scalar _color;
     cv::Scalar _backgroundColor;
-    cv::Mat _paintLayer;
+    TiledLayer _paintLayer;
+    Palette _paintPalette;
     cv::Mat _paintMask;
+    bool _paintMaskStale;
+    std::vector<cv::Rect2f> _paintMaskDirtyRects;
+    RegionMap _regionMap;
     bool _backgroundEnable;
     cv::Rect _contentRect;
     cv::Rect _clippingRect;
     cv::Rect _boundingRect;
+    cv::Rect _traceRect;
     std::vector<Path *> *_paths;
     std::vector<Path *> *_paintPaths;
+    PathIndex _pathIndex;
+    PathIndex _paintPathIndex;
 
     cv::Mat _binarizedImage;
     cv::Mat _negativeImage;
     cv::Mat _preprocessedImage;
 
-    std::vector<std::vector<cv::Point>> *_outlineContours;
-    std::vector<std::vector<cv::Point2f>> *_approximatedOutlineContours;
-    std::vector<cv::Vec4i> *_outlineHierarchy;
+    FlatContours<cv::Point> *_outlineContours;
+    FlatContours<cv::Point2f> *_approximatedOutlineContours;
+    int _specks;
 };
 
 } // namespace illustrace
@@ -0,0 +1,182 @@
+#include "EditJournal.h"
+#include "ProjectWriter.h"
+#include "Util.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace illustrace;
+
+// The journal is a header naming its checkpoint generation followed by fixed size records.
+// Checkpoints are project files beside the journal. A new checkpoint is written and synced first
+// and then a fresh journal is renamed over the old one, so a crash or a power loss at any point
+// leaves a journal that matches its checkpoint. A torn record at the tail is dropped on read.
+
+struct JournalHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t generation;
+    uint32_t reserved;
+};
+
+static const char Magic[4] = {'I', 'L', 'T', 'J'};
+static const uint32_t Version = 1;
+
+static std::string checkpointFilepath(const std::string &filepath, uint32_t generation);
+static bool readHeader(int fd, JournalHeader &header);
+
+EditJournal::EditJournal() : fd(-1), generation(0), _recordCount(0)
+{
+}
+
+EditJournal::~EditJournal()
+{
+    close();
+}
+
+bool EditJournal::open(const char *filepath, Document *document)
+{
+    close();
+
+    this->filepath = filepath;
+    generation = 0;
+
+    int existing = ::open(filepath, O_RDONLY);
+    if (-1 != existing) {
+        JournalHeader header;
+        if (readHeader(existing, header)) {
+            generation = header.generation;
+        }
+        ::close(existing);
+    }
+
+    return checkpoint(document);
+}
+
+void EditJournal::close()
+{
+    if (-1 != fd) {
+        util::syncFile(fd);
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool EditJournal::append(Type type, int arg, double x, double y)
+{
+    if (-1 == fd) {
+        return false;
+    }
+
+    Record record = {type, arg, {x, y}};
+    if (sizeof(record) != ::write(fd, &record, sizeof(record))) {
+        return false;
+    }
+
+    ++_recordCount;
+    return true;
+}
+
+bool EditJournal::checkpoint(Document *document)
+{
+    uint32_t next = generation + 1;
+    std::string nextCheckpoint = checkpointFilepath(filepath, next);
+
+    if (!ProjectWriter::write(nextCheckpoint.c_str(), document)) {
+        return false;
+    }
+
+    std::string tmpFilepath = filepath + ".tmp";
+    int tmp = ::open(tmpFilepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (-1 == tmp) {
+        remove(nextCheckpoint.c_str());
+        return false;
+    }
+
+    JournalHeader header;
+    memcpy(header.magic, Magic, sizeof(header.magic));
+    header.version = Version;
+    header.generation = next;
+    header.reserved = 0;
+
+    bool ret = sizeof(header) == ::write(tmp, &header, sizeof(header)) && util::syncFile(tmp);
+    ::close(tmp);
+
+    if (!ret || 0 != rename(tmpFilepath.c_str(), filepath.c_str())) {
+        remove(tmpFilepath.c_str());
+        remove(nextCheckpoint.c_str());
+        return false;
+    }
+
+    close();
+    fd = ::open(filepath.c_str(), O_WRONLY | O_APPEND);
+
+    // The previous checkpoint is only dropped once the rename is durable. Otherwise it is left behind.
+    if (0 < generation && util::syncDirectory(filepath)) {
+        remove(checkpointFilepath(filepath, generation).c_str());
+    }
+
+    generation = next;
+    _recordCount = 0;
+    return -1 != fd;
+}
+
+void EditJournal::sync()
+{
+    if (-1 != fd) {
+        util::syncFile(fd);
+    }
+}
+
+int EditJournal::recordCount()
+{
+    return _recordCount;
+}
+
+bool EditJournal::read(const char *filepath, std::string &checkpointFilepath, std::vector<Record> &records)
+{
+    int fd = ::open(filepath, O_RDONLY);
+    if (-1 == fd) {
+        return false;
+    }
+
+    JournalHeader header;
+    if (!readHeader(fd, header)) {
+        ::close(fd);
+        return false;
+    }
+
+    checkpointFilepath = ::checkpointFilepath(filepath, header.generation);
+    records.clear();
+
+    Record buffer[256];
+    size_t length = 0;
+    ssize_t n;
+
+    while (0 < (n = ::read(fd, (char *)buffer + length, sizeof(buffer) - length))) {
+        length += n;
+        size_t count = length / sizeof(Record);
+        records.insert(records.end(), buffer, buffer + count);
+        length -= count * sizeof(Record);
+        memmove(buffer, (char *)buffer + count * sizeof(Record), length);
+    }
+
+    ::close(fd);
+    return 0 == n;
+}
+
+// Local functions
+
+static std::string checkpointFilepath(const std::string &filepath, uint32_t generation)
+{
+    return filepath + "." + std::to_string(generation) + ".illustrace";
+}
+
+static bool readHeader(int fd, JournalHeader &header)
+{
+    return sizeof(header) == read(fd, &header, sizeof(header))
+        && 0 == memcmp(header.magic, Magic, sizeof(header.magic))
+        && Version == header.version;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "Document.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace illustrace {
+
+class EditJournal {
+public:
+    enum class Type : uint32_t {
+        Mode = 1,
+        ShapeState,
+        PaintState,
+        ClipState,
+        PreprocessedImageThickness,
+        PaintLayerThickness,
+        PaintColor,
+        DrawThickness,
+        Detail,
+        Thickness,
+        Rotation,
+        BackgroundEnable,
+        Draw,
+        DrawFinish,
+        Reload,
+        Fill,
+        Color,
+        Trimming,
+        Undo,
+        Redo,
+        Save,
+    };
+
+    enum class Edge : int32_t {
+        TopLeft,
+        Top,
+        TopRight,
+        Right,
+        BottomRight,
+        Bottom,
+        BottomLeft,
+        Left,
+    };
+
+    struct Record {
+        Type type;
+        int32_t arg;
+        double values[2];
+    };
+
+    EditJournal();
+    ~EditJournal();
+
+    bool open(const char *filepath, Document *document);
+    void close();
+    bool append(Type type, int arg, double x, double y);
+    bool checkpoint(Document *document);
+    void sync();
+    int recordCount();
+
+    static bool read(const char *filepath, std::string &checkpointFilepath, std::vector<Record> &records);
+
+private:
+    std::string filepath;
+    int fd;
+    uint32_t generation;
+    int _recordCount;
+};
+
+} // namespace illustrace
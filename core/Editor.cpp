@@ -1,9 +1,13 @@
 #include "Editor.h"
+#include "ProjectWriter.h"
 
 #define MINIMUM_CLIPPING_SIDE 50
+#define JOURNAL_CHECKPOINT_INTERVAL 4096
 
 using namespace illustrace;
 
+static void retrace(Editor::Command *command, AsyncTracer::Stage from);
+
 class DetailCommand : public Editor::Command {
 public:
     DetailCommand(Editor *editor) : Command(editor) {}
@@ -11,18 +15,18 @@ public:
     double oldValue;
     double newValue;
 
+    void apply() {
+        retrace(this, AsyncTracer::Stage::ApproximateLines);
+    }
+
     void execute() {
         document->detail(newValue);
-        illustrace->approximateLines(document);
-        illustrace->buildPaths(document);
-        illustrace->buildPaintMask(document);
+        apply();
     }
 
     void undo() {
         document->detail(oldValue);
-        illustrace->approximateLines(document);
-        illustrace->buildPaths(document);
-        illustrace->buildPaintMask(document);
+        apply();
     }
 };
 
@@ -79,9 +83,6 @@ public:
     virtual ~DrawCommand() {}
     virtual void apply() = 0;
 
-    cv::Mat newCanvas;
-    cv::Mat oldCanvas;
-
     cv::Point prevPoint;
 };
 
@@ -89,14 +90,14 @@ class PreprocessedImageCommand : public DrawCommand {
 public:
     PreprocessedImageCommand(Editor *editor) : DrawCommand(editor) {}
 
+    cv::Mat newCanvas;
+    cv::Mat oldCanvas;
+
     void execute() {
     }
 
     void apply() {
-        illustrace->buildLines(document);
-        illustrace->approximateLines(document);
-        illustrace->buildPaths(document);
-        illustrace->buildPaintMask(document);
+        retrace(this, AsyncTracer::Stage::BuildLines);
     }
 
     void undo() {
@@ -110,10 +111,15 @@ public:
     }
 };
 
+// The canvases are clones sharing the tiles a stroke did not touch, so a command holds copies
+// of the painted tiles only.
 class PaintLayerCommand : public DrawCommand {
 public:
     PaintLayerCommand(Editor *editor) : DrawCommand(editor) {}
 
+    TiledLayer newCanvas;
+    TiledLayer oldCanvas;
+
     void execute() {
     }
 
@@ -140,10 +146,7 @@ public:
     cv::Mat oldCanvas;
 
     void apply() {
-        illustrace->buildLines(document);
-        illustrace->approximateLines(document);
-        illustrace->buildPaths(document);
-        illustrace->buildPaintMask(document);
+        retrace(this, AsyncTracer::Stage::BuildLines);
     }
 
     void execute() {
@@ -207,8 +210,8 @@ public:
 };
 
 
-Editor::Editor(Illustrace *illustrace, Document *document)
-    : illustrace(illustrace), document(document),
+Editor::Editor(Illustrace *illustrace, Document *document, AsyncTracer *tracer)
+    : illustrace(illustrace), document(document), tracer(tracer),
       _mode(Editor::Mode::Shape), _shapeState(Editor::ShapeState::Line),
       _paintState(Editor::PaintState::Brush),
       _clipState(Editor::ClipState::Trimming),
@@ -218,15 +221,19 @@ Editor::Editor(Illustrace *illustrace, Document *document)
       _clearColor(cv::Scalar(0, 0, 0, 0)),
       lastCommand(nullptr),
       currentPoint(0),
-      savedPoint(0)
+      savedPoint(0),
+      journal(nullptr),
+      journalGeneration(0)
 {
 }
 
 Editor::~Editor()
 {
+    delete journal;
+
     while (!undoStack.empty()) {
-        auto *command = undoStack.top();
-        undoStack.pop();
+        auto *command = undoStack.back();
+        undoStack.pop_back();
         delete command;
     }
 }
@@ -270,6 +277,7 @@ cv::Scalar &Editor::paintColor()
 
 void Editor::mode(Mode mode)
 {
+    record(EditJournal::Type::Mode, (int)mode);
     lastCommand = nullptr;
     _mode = mode;
     notify(this, Event::Mode);
@@ -277,6 +285,7 @@ void Editor::mode(Mode mode)
 
 void Editor::shapeState(ShapeState state)
 {
+    record(EditJournal::Type::ShapeState, (int)state);
     lastCommand = nullptr;
     _shapeState = state;
     notify(this, Event::ShapeState);
@@ -284,6 +293,7 @@ void Editor::shapeState(ShapeState state)
 
 void Editor::paintState(PaintState state)
 {
+    record(EditJournal::Type::PaintState, (int)state);
     lastCommand = nullptr;
     _paintState = state;
     notify(this, Event::PaintState);
@@ -291,6 +301,7 @@ void Editor::paintState(PaintState state)
 
 void Editor::clipState(ClipState state)
 {
+    record(EditJournal::Type::ClipState, (int)state);
     lastCommand = nullptr;
     _clipState = state;
     notify(this, Event::ClipState);
@@ -298,6 +309,8 @@ void Editor::clipState(ClipState state)
 
 void Editor::drawThickness(int drawThickness)
 {
+    record(EditJournal::Type::DrawThickness, drawThickness);
+
     switch (_mode) {
     case Mode::Shape:
         preprocessedImageThickness = drawThickness;
@@ -316,43 +329,98 @@ void Editor::execute(Command *command)
 {
     command->execute();
     if (lastCommand != command) {
-        undoStack.push(command);
+        command->generation = journalGeneration;
+        undoStack.push_back(command);
         ++currentPoint;
     }
     lastCommand = command;
 
     while (!redoStack.empty()) {
-        auto *command = redoStack.top();
-        redoStack.pop();
+        auto *command = redoStack.back();
+        redoStack.pop_back();
         delete command;
     }
 
     notify(this, Event::Execute, command);
 }
 
+// When the palette has no room for the paint color, the entries that neither the layer nor any
+// undo or redo snapshot refers to are reclaimed. Painting is refused while it is still full.
+bool Editor::reservePaintColor()
+{
+    Palette &palette = document->paintPalette();
+    uint8_t index;
+
+    if (palette.index(Palette::pack(_paintColor), index)) {
+        return true;
+    }
+
+    std::vector<bool> used(Palette::Size, false);
+    document->paintLayer().usedIndices(used);
+
+    for (auto *stack : {&undoStack, &redoStack}) {
+        for (Command *command : *stack) {
+            auto *paintLayerCommand = dynamic_cast<PaintLayerCommand *>(command);
+            if (paintLayerCommand) {
+                paintLayerCommand->oldCanvas.usedIndices(used);
+                paintLayerCommand->newCanvas.usedIndices(used);
+            }
+        }
+    }
+
+    palette.reclaim(used);
+
+    if (palette.index(Palette::pack(_paintColor), index)) {
+        return true;
+    }
+
+    notify(this, Event::PaletteFull);
+    return false;
+}
+
+// Commands that re-run trace stages do so asynchronously when a tracer is given. Anything that
+// reads or rebuilds the traced results waits for the latest one to land first.
+void Editor::settle()
+{
+    if (tracer) {
+        tracer->wait();
+        tracer->publish();
+    }
+}
+
 void Editor::undo()
 {
     if (canUndo()) {
-        auto *command = undoStack.top();
-        undoStack.pop();
+        settle();
+        record(EditJournal::Type::Undo);
+
+        auto *command = undoStack.back();
+        undoStack.pop_back();
         command->undo();
-        redoStack.push(command);
+        redoStack.push_back(command);
         lastCommand = nullptr;
         --currentPoint;
         notify(this, Event::Undo, command);
+
+        checkpointIfNeeded(command->generation != journalGeneration);
     }
 }
 
 void Editor::redo()
 {
     if (canRedo()) {
-        auto *command = redoStack.top();
-        redoStack.pop();
+        settle();
+        record(EditJournal::Type::Redo);
+
+        auto *command = redoStack.back();
+        redoStack.pop_back();
         command->redo();
-        undoStack.push(command);
+        undoStack.push_back(command);
         lastCommand = nullptr;
         ++currentPoint;
         notify(this, Event::Redo, command);
+
+        checkpointIfNeeded(command->generation != journalGeneration);
     }
 }
 
@@ -366,14 +434,19 @@ bool Editor::canRedo()
     return !redoStack.empty();
 }
 
-void Editor::save()
+bool Editor::save(const char *filepath)
 {
+    record(EditJournal::Type::Save);
     lastCommand = nullptr;
-    savedPoint = currentPoint;
+    settle();
 
-    // TODO
-    
+    if (!ProjectWriter::write(filepath, document)) {
+        return false;
+    }
+
+    savedPoint = currentPoint;
     notify(this, Event::Save);
+    return true;
 }
 
 bool Editor::hasChanged()
@@ -381,8 +454,66 @@ bool Editor::hasChanged()
     return savedPoint != currentPoint;
 }
 
+// Every operation is appended to the journal as it comes in, and a checkpoint of the document
+// is taken only between strokes. Replaying the records against the checkpoint through the same
+// operations reproduces the session, so autosave costs a record per operation.
+bool Editor::startJournal(const char *filepath)
+{
+    stopJournal();
+
+    lastCommand = nullptr;
+    ++journalGeneration;
+
+    journal = new EditJournal();
+    if (!journal->open(filepath, document)) {
+        stopJournal();
+        return false;
+    }
+
+    recordState();
+    return true;
+}
+
+void Editor::stopJournal()
+{
+    delete journal;
+    journal = nullptr;
+}
+
+bool Editor::recover(const char *filepath)
+{
+    std::string checkpointFilepath;
+    std::vector<EditJournal::Record> records;
+
+    if (!EditJournal::read(filepath, checkpointFilepath, records)) {
+        return false;
+    }
+
+    if (!illustrace->openProject(checkpointFilepath.c_str(), document)) {
+        return false;
+    }
+
+    EditJournal *_journal = journal;
+    journal = nullptr;
+    lastCommand = nullptr;
+
+    for (auto &record : records) {
+        replay(record);
+    }
+
+    // A stroke cut off by the crash is finished as it stands
+    drawFinish();
+    settle();
+
+    journal = _journal;
+    savedPoint = -1;
+    return true;
+}
+
 void Editor::detail(double detail)
 {
+    record(EditJournal::Type::Detail, 0, detail);
+
     DetailCommand *command;
 
     if (!(command = dynamic_cast<DetailCommand *>(lastCommand))) {
@@ -396,6 +527,8 @@ void Editor::detail(double detail)
 
 void Editor::thickness(double thickness)
 {
+    record(EditJournal::Type::Thickness, 0, thickness);
+
     ThicknessCommand *command;
 
     if (!(command = dynamic_cast<ThicknessCommand *>(lastCommand))) {
@@ -409,6 +542,8 @@ void Editor::thickness(double thickness)
 
 void Editor::rotation(double rotation)
 {
+    record(EditJournal::Type::Rotation, 0, rotation);
+
     RotationCommand *command;
 
     if (!(command = dynamic_cast<RotationCommand *>(lastCommand))) {
@@ -422,6 +557,8 @@ void Editor::rotation(double rotation)
 
 void Editor::backgroundEnable(bool enable)
 {
+    record(EditJournal::Type::BackgroundEnable, enable);
+
     BackgroundEnableCommand *command;
 
     if (!(command = dynamic_cast<BackgroundEnableCommand *>(lastCommand))) {
@@ -434,6 +571,13 @@ void Editor::backgroundEnable(bool enable)
 
 void Editor::draw(float x, float y)
 {
+    record(EditJournal::Type::Draw, 0, x, y);
+    settle();
+
+    if (Mode::Paint == _mode && PaintState::Brush == _paintState && !reservePaintColor()) {
+        return;
+    }
+
     cv::Point point = cv::Point(x, y);
     cv::Point *prevPoint = nullptr;
 
@@ -442,16 +586,22 @@ void Editor::draw(float x, float y)
     if (!(command = dynamic_cast<DrawCommand *>(lastCommand))) {
         switch (_mode) {
         case Mode::Shape:
-            command = new PreprocessedImageCommand(this);
-            command->oldCanvas = document->preprocessedImage();
-            command->newCanvas = command->oldCanvas.clone();
-            document->preprocessedImage(command->newCanvas, nullptr);
+            {
+                auto *preprocessedImageCommand = new PreprocessedImageCommand(this);
+                preprocessedImageCommand->oldCanvas = document->preprocessedImage();
+                preprocessedImageCommand->newCanvas = preprocessedImageCommand->oldCanvas.clone();
+                document->preprocessedImage(preprocessedImageCommand->newCanvas, nullptr);
+                command = preprocessedImageCommand;
+            }
             break;
         case Mode::Paint:
-            command = new PaintLayerCommand(this);
-            command->oldCanvas = document->paintLayer();
-            command->newCanvas = command->oldCanvas.clone();
-            document->paintLayer(command->newCanvas, nullptr);
+            {
+                auto *paintLayerCommand = new PaintLayerCommand(this);
+                paintLayerCommand->oldCanvas = document->paintLayer();
+                paintLayerCommand->newCanvas = paintLayerCommand->oldCanvas.clone();
+                document->paintLayer(paintLayerCommand->newCanvas, nullptr);
+                command = paintLayerCommand;
+            }
             break;
         default:
             // Illegal operation
@@ -499,24 +649,38 @@ void Editor::drawFinish()
 {
     DrawCommand *command;
 
+    record(EditJournal::Type::DrawFinish);
+
     if ((command = dynamic_cast<DrawCommand *>(lastCommand))) {
         command->apply();
     }
 
     lastCommand = nullptr;
+    checkpointIfNeeded();
 }
 
 void Editor::reload()
 {
+    record(EditJournal::Type::Reload);
+    settle();
+
     ReloadCommand *command = new ReloadCommand(this);
     command->oldCanvas = document->preprocessedImage();
     command->newCanvas = document->negativeImage().clone();
     execute(command);
+    checkpointIfNeeded();
 }
 
 void Editor::fill(float x, float y)
 {
-    DrawCommand *command = new PaintLayerCommand(this);
+    record(EditJournal::Type::Fill, 0, x, y);
+    settle();
+
+    if (PaintState::Fill == _paintState && !reservePaintColor()) {
+        return;
+    }
+
+    PaintLayerCommand *command = new PaintLayerCommand(this);
     command->oldCanvas = document->paintLayer();
     command->newCanvas = command->oldCanvas.clone();
     document->paintLayer(command->newCanvas, nullptr);
@@ -541,6 +705,7 @@ void Editor::fill(float x, float y)
     command->apply();
 
     lastCommand = nullptr;
+    checkpointIfNeeded();
 }
 
 void Editor::R(double red)
@@ -560,6 +725,8 @@ void Editor::B(double blue)
 
 void Editor::color(int colorIndex, double value)
 {
+    record(EditJournal::Type::Color, colorIndex, value);
+
     if (Mode::Paint == _mode) {
         _paintColor[colorIndex] = cv::saturate_cast<uchar>(value * 255.0);
         notify(this, Event::PaintColor);
@@ -592,6 +759,8 @@ void Editor::color(int colorIndex, double value)
 
 void Editor::trimmingTopLeft(float x, float y)
 {
+    record(EditJournal::Type::Trimming, (int)EditJournal::Edge::TopLeft, x, y);
+
     trimming([=](cv::Rect &rect) {
         rect.x = MIN(x, rect.x + rect.width - 1 - MINIMUM_CLIPPING_SIDE);
         rect.y = MIN(y, rect.y + rect.height - 1 - MINIMUM_CLIPPING_SIDE);
@@ -600,6 +769,8 @@ void Editor::trimmingTopLeft(float x, float y)
 
 void Editor::trimmingTop(float y)
 {
+    record(EditJournal::Type::Trimming, (int)EditJournal::Edge::Top, 0.0, y);
+
     trimming([=](cv::Rect &rect) {
         rect.y = MIN(y, rect.y + rect.height - 1 - MINIMUM_CLIPPING_SIDE);
     });
@@ -607,6 +778,8 @@ void Editor::trimmingTop(float y)
 
 void Editor::trimmingTopRight(float x, float y)
 {
+    record(EditJournal::Type::Trimming, (int)EditJournal::Edge::TopRight, x, y);
+
     trimming([=](cv::Rect &rect) {
         rect.y = MIN(y, rect.y + rect.height - 1 - MINIMUM_CLIPPING_SIDE);
         rect.width = MAX(x - rect.x + 1, rect.x + MINIMUM_CLIPPING_SIDE - 1);
@@ -615,6 +788,8 @@ void Editor::trimmingTopRight(float x, float y)
 
 void Editor::trimmingRight(float x)
 {
+    record(EditJournal::Type::Trimming, (int)EditJournal::Edge::Right, x);
+
     trimming([=](cv::Rect &rect) {
         rect.width = MAX(x - rect.x + 1, rect.x + MINIMUM_CLIPPING_SIDE - 1);
     });
@@ -622,6 +797,8 @@ void Editor::trimmingRight(float x)
 
 void Editor::trimmingBottomRight(float x, float y)
 {
+    record(EditJournal::Type::Trimming, (int)EditJournal::Edge::BottomRight, x, y);
+
     trimming([=](cv::Rect &rect) {
         rect.width = MAX(x - rect.x + 1, rect.x + MINIMUM_CLIPPING_SIDE - 1);
         rect.height = MAX(y - rect.y + 1, rect.y + MINIMUM_CLIPPING_SIDE - 1);
@@ -630,6 +807,8 @@ void Editor::trimmingBottomRight(float x, float y)
 
 void Editor::trimmingBottom(float y)
 {
+    record(EditJournal::Type::Trimming, (int)EditJournal::Edge::Bottom, 0.0, y);
+
     trimming([=](cv::Rect &rect) {
         rect.height = MAX(y - rect.y + 1, rect.y + MINIMUM_CLIPPING_SIDE - 1);
     });
@@ -637,6 +816,8 @@ void Editor::trimmingBottom(float y)
 
 void Editor::trimmingBottomLeft(float x, float y)
 {
+    record(EditJournal::Type::Trimming, (int)EditJournal::Edge::BottomLeft, x, y);
+
     trimming([=](cv::Rect &rect) {
         rect.height = MAX(y - rect.y + 1, rect.y + MINIMUM_CLIPPING_SIDE - 1);
         rect.x = MIN(x, rect.x + rect.width - 1 - MINIMUM_CLIPPING_SIDE);
@@ -645,11 +826,157 @@ void Editor::trimmingBottomLeft(float x, float y)
 
 void Editor::trimmingLeft(float x)
 {
+    record(EditJournal::Type::Trimming, (int)EditJournal::Edge::Left, x);
+
     trimming([=](cv::Rect &rect) {
         rect.x = MIN(x, rect.x + rect.width - 1 - MINIMUM_CLIPPING_SIDE);
     });
 }
 
+void Editor::record(EditJournal::Type type, int arg, double x, double y)
+{
+    if (journal) {
+        journal->append(type, arg, x, y);
+    }
+}
+
+void Editor::recordState()
+{
+    record(EditJournal::Type::Mode, (int)_mode);
+    record(EditJournal::Type::ShapeState, (int)_shapeState);
+    record(EditJournal::Type::PaintState, (int)_paintState);
+    record(EditJournal::Type::ClipState, (int)_clipState);
+    record(EditJournal::Type::PreprocessedImageThickness, preprocessedImageThickness);
+    record(EditJournal::Type::PaintLayerThickness, paintLayerThickness);
+    for (int i = 0; i < 4; ++i) {
+        record(EditJournal::Type::PaintColor, i, _paintColor[i]);
+    }
+}
+
+// Undo and redo of a command older than the checkpoint cannot be replayed, since recovery
+// starts with empty stacks, so they force a new checkpoint.
+void Editor::checkpointIfNeeded(bool force)
+{
+    if (!journal) {
+        return;
+    }
+
+    if (force || JOURNAL_CHECKPOINT_INTERVAL <= journal->recordCount()) {
+        settle();
+        if (journal->checkpoint(document)) {
+            lastCommand = nullptr;
+            ++journalGeneration;
+            recordState();
+        }
+    }
+    else {
+        journal->sync();
+    }
+}
+
+void Editor::replay(const EditJournal::Record &record)
+{
+    int arg = record.arg;
+    float x = record.values[0];
+    float y = record.values[1];
+
+    switch (record.type) {
+    case EditJournal::Type::Mode:
+        mode((Mode)arg);
+        break;
+    case EditJournal::Type::ShapeState:
+        shapeState((ShapeState)arg);
+        break;
+    case EditJournal::Type::PaintState:
+        paintState((PaintState)arg);
+        break;
+    case EditJournal::Type::ClipState:
+        clipState((ClipState)arg);
+        break;
+    case EditJournal::Type::PreprocessedImageThickness:
+        preprocessedImageThickness = arg;
+        break;
+    case EditJournal::Type::PaintLayerThickness:
+        paintLayerThickness = arg;
+        break;
+    case EditJournal::Type::PaintColor:
+        if (0 <= arg && arg < 4) {
+            _paintColor[arg] = record.values[0];
+        }
+        break;
+    case EditJournal::Type::DrawThickness:
+        drawThickness(arg);
+        break;
+    case EditJournal::Type::Detail:
+        detail(record.values[0]);
+        break;
+    case EditJournal::Type::Thickness:
+        thickness(record.values[0]);
+        break;
+    case EditJournal::Type::Rotation:
+        rotation(record.values[0]);
+        break;
+    case EditJournal::Type::BackgroundEnable:
+        backgroundEnable(arg);
+        break;
+    case EditJournal::Type::Draw:
+        draw(x, y);
+        break;
+    case EditJournal::Type::DrawFinish:
+        drawFinish();
+        break;
+    case EditJournal::Type::Reload:
+        reload();
+        break;
+    case EditJournal::Type::Fill:
+        fill(x, y);
+        break;
+    case EditJournal::Type::Color:
+        if (0 <= arg && arg < 3) {
+            color(arg, record.values[0]);
+        }
+        break;
+    case EditJournal::Type::Trimming:
+        switch ((EditJournal::Edge)arg) {
+        case EditJournal::Edge::TopLeft:
+            trimmingTopLeft(x, y);
+            break;
+        case EditJournal::Edge::Top:
+            trimmingTop(y);
+            break;
+        case EditJournal::Edge::TopRight:
+            trimmingTopRight(x, y);
+            break;
+        case EditJournal::Edge::Right:
+            trimmingRight(x);
+            break;
+        case EditJournal::Edge::BottomRight:
+            trimmingBottomRight(x, y);
+            break;
+        case EditJournal::Edge::Bottom:
+            trimmingBottom(y);
+            break;
+        case EditJournal::Edge::BottomLeft:
+            trimmingBottomLeft(x, y);
+            break;
+        case EditJournal::Edge::Left:
+            trimmingLeft(x);
+            break;
+        }
+        break;
+    case EditJournal::Type::Undo:
+        undo();
+        break;
+    case EditJournal::Type::Redo:
+        redo();
+        break;
+    case EditJournal::Type::Save:
+        // Only the break of command merging matters for replay
+        lastCommand = nullptr;
+        break;
+    }
+}
+
 template<typename Func>
 void Editor::trimming(Func func)
 {
@@ -665,6 +992,26 @@ void Editor::trimming(Func func)
     execute(command);
 }
 
+// Local functions
+
+// On the tracer's thread when the editor has one, so that the caller, the UI thread of the app,
+// is not held up.
+static void retrace(Editor::Command *command, AsyncTracer::Stage from)
+{
+    if (command->tracer) {
+        command->tracer->retrace(command->document, from);
+        return;
+    }
+
+    if (AsyncTracer::Stage::BuildLines >= from) {
+        command->illustrace->buildLines(command->document);
+    }
+    if (AsyncTracer::Stage::ApproximateLines >= from) {
+        command->illustrace->approximateLines(command->document);
+    }
+    command->illustrace->buildPaths(command->document);
+}
+
 namespace illustrace {
 
 std::ostream &operator<<(std::ostream &os, Editor const &self)
@@ -2,8 +2,10 @@
 
 #include "Document.h"
 #include "Illustrace.h"
+#include "AsyncTracer.h"
+#include "EditJournal.h"
 #include "Observable.h"
-#include <stack>
+#include <vector>
 
 namespace illustrace {
 
@@ -11,7 +13,7 @@ class Editor : public Observable<Editor> {
 public:
     class Command {
     public:
-        Command(Editor *editor) : document(editor->document), illustrace(editor->illustrace) {};
+        Command(Editor *editor) : document(editor->document), illustrace(editor->illustrace), tracer(editor->tracer), generation(0) {};
         virtual ~Command() {}
         virtual void execute() = 0;
         virtual void undo() = 0;
@@ -19,6 +21,8 @@ public:
 
         Document *document;
         Illustrace *illustrace;
+        AsyncTracer *tracer;
+        unsigned generation;
     };
 
     enum class Event : int {
@@ -33,6 +37,7 @@ public:
         Undo,
         Redo,
         Save,
+        PaletteFull,
     };
 
     static inline const char *Event2CString(Event event)
@@ -50,6 +55,7 @@ public:
         CASE(Undo);
         CASE(Redo);
         CASE(Save);
+        CASE(PaletteFull);
         }
 #undef CASE
     }
@@ -122,7 +128,7 @@ public:
 #undef CASE
     }
 
-    Editor(Illustrace *illustrace, Document *document);
+    Editor(Illustrace *illustrace, Document *document, AsyncTracer *tracer = nullptr);
     ~Editor();
 
     void mode(Mode mode);
@@ -165,23 +171,36 @@ public:
 
     Illustrace *illustrace;
     Document *document;
+    AsyncTracer *tracer;
+
+    void settle();
 
     void undo();
     void redo();
     bool canUndo();
     bool canRedo();
 
-    void save();
+    bool save(const char *filepath);
     bool hasChanged();
 
+    bool startJournal(const char *filepath);
+    void stopJournal();
+    bool recover(const char *filepath);
+
     friend std::ostream &operator<<(std::ostream &os, Editor const &self);
 
 private:
     void execute(Command *command);
+    bool reservePaintColor();
     void color(int colorIndex, double value);
     template<typename Func>
     void trimming(Func func);
 
+    void record(EditJournal::Type type, int arg = 0, double x = 0.0, double y = 0.0);
+    void recordState();
+    void checkpointIfNeeded(bool force = false);
+    void replay(const EditJournal::Record &record);
+
     Mode _mode;
     ShapeState _shapeState;
     PaintState _paintState;
@@ -191,12 +210,15 @@ private:
     cv::Scalar _paintColor;
     cv::Scalar _clearColor;
 
-    std::stack<Command *> undoStack;
-    std::stack<Command *> redoStack;
+    std::vector<Command *> undoStack;
+    std::vector<Command *> redoStack;
     Command *lastCommand;
 
     int currentPoint;
     int savedPoint;
+
+    EditJournal *journal;
+    unsigned journalGeneration;
 };
 
 } // namespace illustrace
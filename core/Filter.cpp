@@ -1,61 +1,172 @@
 #include "Filter.h"
+#include "TaskScheduler.h"
+
+#include <cfloat>
+
+#define ROWS_GRAIN 32
+#define MINIMUM_STRIPE_ROWS 64
 
 using namespace illustrace;
 
+template<typename Func>
+static void forEachStripe(const cv::Mat &image, Func func);
+static int otsuThreshold(const cv::Mat &image);
+
 void Filter::brightness(cv::Mat &image, double brightness, double contrast)
 {
     brightness *= 255.0;
 
-    uchar *data = image.data;
-    size_t step = image.step[0];
+    int width = image.cols * image.channels();
     
-    for (int j = 0; j < image.rows; ++j) {
-        data += step;
+    TaskScheduler::shared().parallelFor(image.rows, ROWS_GRAIN, [&](int j) {
+        uchar *data = image.ptr<uchar>(j);
         
-        for (int i = 0; i < step; ++i) {
+        for (int i = 0; i < width; ++i) {
             data[i] = cv::saturate_cast<uchar>(contrast * data[i] + brightness);
         }
-    }
+    });
 }
 
 void Filter::brightnessBGRA(cv::Mat &image, double brightness, double contrast)
 {
     brightness *= 255.0;
 
-    uchar *data = image.data;
-    size_t step = image.step[0];
+    int width = image.cols * 4;
     
-    for (int j = 0; j < image.rows; ++j) {
-        data += step;
+    TaskScheduler::shared().parallelFor(image.rows, ROWS_GRAIN, [&](int j) {
+        uchar *data = image.ptr<uchar>(j);
         
-        for (int i = 0; i < step; i += 4) {
+        for (int i = 0; i < width; i += 4) {
             data[i+0] = cv::saturate_cast<uchar>(contrast * data[i+0] + brightness);
             data[i+1] = cv::saturate_cast<uchar>(contrast * data[i+1] + brightness);
             data[i+2] = cv::saturate_cast<uchar>(contrast * data[i+2] + brightness);
         }
-    }
+    });
 }
 
+// Stripes are blurred from a copy that keeps the pixels around the image within its parent,
+// so the result is the same as blurring the whole image in place.
 void Filter::blur(cv::Mat &image, int blur)
 {
-    cv::GaussianBlur(image, image, cv::Size(blur, blur), 0, 0);
+    if (image.empty()) {
+        return;
+    }
+
+    int radius = blur / 2;
+
+    cv::Mat expanded = image;
+    expanded.adjustROI(radius, radius, radius, radius);
+
+    cv::Size size;
+    cv::Point imageOffset, expandedOffset;
+    image.locateROI(size, imageOffset);
+    expanded.locateROI(size, expandedOffset);
+
+    cv::Mat source = expanded.clone();
+    cv::Point offset = imageOffset - expandedOffset;
+
+    forEachStripe(image, [&](int y0, int y1) {
+        cv::Mat dst = image(cv::Rect(0, y0, image.cols, y1 - y0));
+        cv::GaussianBlur(source(cv::Rect(offset.x, offset.y + y0, image.cols, y1 - y0)), dst, cv::Size(blur, blur), 0, 0);
+    });
 }
 
 void Filter::threshold(cv::Mat &image)
 {
-    cv::threshold(image, image, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+    if (image.empty()) {
+        return;
+    }
+
+    int threshold = otsuThreshold(image);
+
+    TaskScheduler::shared().parallelFor(image.rows, ROWS_GRAIN, [&](int j) {
+        uchar *data = image.ptr<uchar>(j);
+
+        for (int i = 0; i < image.cols; ++i) {
+            data[i] = threshold < data[i] ? 255 : 0;
+        }
+    });
 }
 
 void Filter::negative(cv::Mat &image)
 {
-    uchar *data = image.data;
-    size_t step = image.step[0];
+    int width = image.cols * image.channels();
     
-    for (int j = 0; j < image.rows; ++j) {
-        for (int i = 0; i < step; ++i) {
+    TaskScheduler::shared().parallelFor(image.rows, ROWS_GRAIN, [&](int j) {
+        uchar *data = image.ptr<uchar>(j);
+
+        for (int i = 0; i < width; ++i) {
             data[i] = 255 - data[i];
         }
+    });
+}
 
-        data += step;
+// Local functions
+
+template<typename Func>
+static void forEachStripe(const cv::Mat &image, Func func)
+{
+    int stripes = MAX(1, MIN(TaskScheduler::shared().threads(), image.rows / MINIMUM_STRIPE_ROWS));
+
+    TaskScheduler::shared().parallelFor(stripes, [&](int i) {
+        func(image.rows * i / stripes, image.rows * (i + 1) / stripes);
+    });
+}
+
+// Same as cv::threshold with THRESH_OTSU, with the histogram counted per stripe.
+static int otsuThreshold(const cv::Mat &image)
+{
+    CV_Assert(CV_8UC1 == image.type());
+
+    int stripes = MAX(1, MIN(TaskScheduler::shared().threads(), image.rows / MINIMUM_STRIPE_ROWS));
+    std::vector<int> histograms(stripes * 256, 0);
+
+    TaskScheduler::shared().parallelFor(stripes, [&](int i) {
+        int *h = &histograms[i * 256];
+        for (int y = image.rows * i / stripes; y < image.rows * (i + 1) / stripes; ++y) {
+            const uchar *data = image.ptr<uchar>(y);
+            for (int x = 0; x < image.cols; ++x) {
+                ++h[data[x]];
+            }
+        }
+    });
+
+    int h[256] = {0};
+    for (int i = 0; i < stripes; ++i) {
+        for (int j = 0; j < 256; ++j) {
+            h[j] += histograms[i * 256 + j];
+        }
     }
+
+    double mu = 0.0;
+    double scale = 1.0 / (image.cols * image.rows);
+    for (int i = 0; i < 256; ++i) {
+        mu += i * (double)h[i];
+    }
+    mu *= scale;
+
+    double mu1 = 0.0, q1 = 0.0;
+    double maxSigma = 0.0;
+    int threshold = 0;
+
+    for (int i = 0; i < 256; ++i) {
+        double p = h[i] * scale;
+        mu1 *= q1;
+        q1 += p;
+        double q2 = 1.0 - q1;
+
+        if (MIN(q1, q2) < FLT_EPSILON || MAX(q1, q2) > 1.0 - FLT_EPSILON) {
+            continue;
+        }
+
+        mu1 = (mu1 + i * p) / q1;
+        double mu2 = (mu - q1 * mu1) / q2;
+        double sigma = q1 * q2 * (mu1 - mu2) * (mu1 - mu2);
+        if (sigma > maxSigma) {
+            maxSigma = sigma;
+            threshold = i;
+        }
+    }
+
+    return threshold;
 }
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+#include <vector>
+#include <algorithm>
+
+namespace illustrace {
+
+// Contours in compressed sparse row form: the points of every contour in one array, contour i
+// spanning points[offsets[i], offsets[i + 1]), with the cv::findContours style hierarchy beside.
+// A whole contour set takes three allocations however many contours it holds.
+template <class T>
+class FlatContours {
+public:
+    class Contour {
+    public:
+        Contour(const T *first, const T *last) : first(first), last(last) {}
+
+        const T *begin() const { return first; }
+        const T *end() const { return last; }
+        const T *data() const { return first; }
+        size_t size() const { return last - first; }
+        bool empty() const { return first == last; }
+        const T &operator[](const int index) const { return first[index]; }
+
+        // Header over the points without copying, for OpenCV functions taking InputArray.
+        cv::Mat mat() const {
+            return cv::Mat((int)size(), 1, cv::DataType<T>::type, (void *)first);
+        }
+
+        bool operator==(const Contour &other) const {
+            return size() == other.size() && std::equal(first, last, other.first);
+        }
+
+    private:
+        const T *first;
+        const T *last;
+    };
+
+    class Iterator {
+    public:
+        Iterator(const FlatContours *contours, int index) : contours(contours), index(index) {}
+
+        Contour operator*() const { return (*contours)[index]; }
+        Iterator &operator++() { ++index; return *this; }
+        bool operator!=(const Iterator &other) const { return index != other.index; }
+
+    private:
+        const FlatContours *contours;
+        int index;
+    };
+
+    FlatContours() : offsets(1, 0) {}
+
+    size_t size() const { return offsets.size() - 1; }
+    bool empty() const { return 1 == offsets.size(); }
+
+    Contour operator[](const int index) const {
+        return Contour(points.data() + offsets[index], points.data() + offsets[index + 1]);
+    }
+
+    Iterator begin() const { return Iterator(this, 0); }
+    Iterator end() const { return Iterator(this, size()); }
+
+    void clear() {
+        points.clear();
+        offsets.assign(1, 0);
+        hierarchy.clear();
+    }
+
+    // Ends the contour made of the points pushed since the previous one.
+    void close() {
+        offsets.push_back(points.size());
+    }
+
+    void append(const Contour &contour) {
+        points.insert(points.end(), contour.begin(), contour.end());
+        close();
+    }
+
+    // Packs contours written in place at offsets[i], lengths[i] points each, to the front.
+    // Used when every contour has an upper bound of points known beforehand.
+    void pack(const std::vector<int> &lengths) {
+        int offset = 0;
+        for (int i = 0; i < lengths.size(); ++i) {
+            std::copy(points.begin() + offsets[i], points.begin() + offsets[i] + lengths[i], points.begin() + offset);
+            offsets[i] = offset;
+            offset += lengths[i];
+        }
+        offsets[lengths.size()] = offset;
+        points.resize(offset);
+    }
+
+    void swap(FlatContours &other) {
+        points.swap(other.points);
+        offsets.swap(other.offsets);
+        hierarchy.swap(other.hierarchy);
+    }
+
+    std::vector<T> points;
+    std::vector<int> offsets;
+    std::vector<cv::Vec4i> hierarchy;
+};
+
+} // namespace illustrace
@@ -1,11 +1,41 @@
 #include "Illustrace.h"
+#include "ProjectReader.h"
+#include "Rasterizer.h"
+#include "TaskScheduler.h"
+#include "Util.h"
 
-#include <unordered_map>
+#include <algorithm>
 #include <stack>
 
+#define TRACE_MARGIN 32
+#define CONTOURS_GRAIN 64
+#define PAINT_BLUR 5
+
 using namespace illustrace;
 
-void Illustrace::traceForPreview(cv::Mat &sourceImage, std::vector<std::vector<cv::Point>> &outlineContours, std::vector<cv::Vec4i> &outlineHierarchy, double brightness, bool negative)
+// With a cancellation flag, the stages check it between contours and tiles and return
+// early once it is raised, leaving the document in an unspecified state.
+
+Illustrace::Illustrace() : _canceled(nullptr), _cache(nullptr)
+{
+}
+
+void Illustrace::cancellation(const std::atomic<bool> *canceled)
+{
+    _canceled = canceled;
+}
+
+void Illustrace::cache(TraceCache *cache)
+{
+    _cache = cache;
+}
+
+bool Illustrace::canceled()
+{
+    return _canceled && *_canceled;
+}
+
+void Illustrace::traceForPreview(cv::Mat &sourceImage, FlatContours<cv::Point> &outlineContours, double brightness, bool negative)
 {
     double contrast = 0.0 < brightness ?  1.0 + brightness / 2.0 : 1.0;
     Filter::brightnessBGRA(sourceImage, brightness, contrast);
@@ -20,10 +50,10 @@ void Illustrace::traceForPreview(cv::Mat &sourceImage, std::vector<std::vector<c
         Filter::negative(image);
     }
 
-    cv::findContours(image, outlineContours, outlineHierarchy, CV_RETR_LIST, CV_CHAIN_APPROX_SIMPLE);
+    ContourBuilder::build(image, outlineContours, ContourBuilder::Mode::List);
 }
 
-bool Illustrace::traceFromFile(const char *filepath, Document *document)
+bool Illustrace::traceFromFile(const char *filepath, Document *document, const cv::Rect *clippingRect)
 {
     cv::Mat sourceImage = imread(filepath, cv::IMREAD_GRAYSCALE);
     if (!sourceImage.data) {
@@ -32,43 +62,174 @@ bool Illustrace::traceFromFile(const char *filepath, Document *document)
 
     notify(this, Illustrace::Event::SourceImageLoaded, document, &sourceImage);
 
-    traceFromImage(sourceImage, document);   
+    traceFromImage(sourceImage, document, clippingRect);   
+    return true;
+}
+
+bool Illustrace::traceFromMemory(const uchar *data, size_t size, Document *document, const cv::Rect *clippingRect)
+{
+    if (!data || 0 == size) {
+        return false;
+    }
+
+    cv::Mat encoded(1, size, CV_8UC1, (void *)data);
+    cv::Mat sourceImage = cv::imdecode(encoded, cv::IMREAD_GRAYSCALE);
+    if (!sourceImage.data) {
+        return false;
+    }
+
+    notify(this, Illustrace::Event::SourceImageLoaded, document, &sourceImage);
+
+    traceFromImage(sourceImage, document, clippingRect);
+    return true;
+}
+
+// Grayscale pixels are traced in place without a copy; tracing never writes to the source image.
+// 3 and 4 channel pixels are in BGR(A) order and are converted to grayscale first.
+bool Illustrace::traceFromPixels(const uchar *pixels, int width, int height, int channels, size_t stride, Document *document, const cv::Rect *clippingRect)
+{
+    if (!pixels || 0 >= width || 0 >= height || stride < width * channels) {
+        return false;
+    }
+
+    cv::Mat sourceImage;
+
+    switch (channels) {
+    case 1:
+        sourceImage = cv::Mat(height, width, CV_8UC1, (void *)pixels, stride);
+        break;
+    case 3:
+        cv::cvtColor(cv::Mat(height, width, CV_8UC3, (void *)pixels, stride), sourceImage, CV_BGR2GRAY);
+        break;
+    case 4:
+        cv::cvtColor(cv::Mat(height, width, CV_8UC4, (void *)pixels, stride), sourceImage, CV_BGRA2GRAY);
+        break;
+    default:
+        return false;
+    }
+
+    notify(this, Illustrace::Event::SourceImageLoaded, document, &sourceImage);
+
+    traceFromImage(sourceImage, document, clippingRect);
+    return true;
+}
+
+bool Illustrace::openProject(const char *filepath, Document *document)
+{
+    if (!ProjectReader::read(filepath, document)) {
+        return false;
+    }
+
+    notify(this, Illustrace::Event::SourceImageLoaded, document, &document->binarizedImage());
+    notify(this, Illustrace::Event::PaintPathsBuilt, document, document->paintPaths());
     return true;
 }
 
-void Illustrace::traceFromImage(cv::Mat &sourceImage, Document *document)
+// With a clipping rect, only the rect and a margin around it are binarized and traced.
+// Lines crossing the clipping rect are cut at the margin, outside of the exported area.
+void Illustrace::traceFromImage(cv::Mat &sourceImage, Document *document, const cv::Rect *clippingRect)
+{
+    TaskScheduler::LaneScope scope(TaskScheduler::Lane::Background);
+
+    layout(sourceImage, document, clippingRect);
+
+    TraceCache::Key key;
+    TraceCache::Level level = TraceCache::Level::Miss;
+
+    if (_cache) {
+        TraceCache::key(sourceImage, document, key);
+        level = _cache->load(key, document);
+        if (TraceCache::Level::Miss != level) {
+            document->specks(-1);
+        }
+        notifyRestored(document, level);
+    }
+
+    if (TraceCache::Level::Miss == level) {
+        binarize(sourceImage, document);
+        buildLines(document);
+        if (_cache && !canceled()) {
+            _cache->store(key, TraceCache::Level::Contours, document);
+        }
+    }
+
+    if (TraceCache::Level::Paths != level) {
+        approximateLines(document);
+        buildPaths(document);
+        if (_cache && !canceled()) {
+            _cache->store(key, TraceCache::Level::Paths, document);
+        }
+    }
+}
+
+void Illustrace::layout(cv::Mat &sourceImage, Document *document, const cv::Rect *clippingRect)
 {
     cv::Rect contentRect = cv::Rect(0, 0, sourceImage.cols, sourceImage.rows);
     document->contentRect(contentRect);
-    document->clippingRect(contentRect);
 
-    binarize(sourceImage, document);
-    buildLines(document);
-    approximateLines(document);
-    buildPaths(document);
-    buildPaintMask(document);
+    if (clippingRect && 0 < (*clippingRect & contentRect).area()) {
+        cv::Rect rect = *clippingRect & contentRect;
+        document->clippingRect(rect);
+
+        cv::Rect traceRect = cv::Rect(rect.x - TRACE_MARGIN, rect.y - TRACE_MARGIN, rect.width + TRACE_MARGIN * 2, rect.height + TRACE_MARGIN * 2) & contentRect;
+        document->traceRect(traceRect);
+    }
+    else {
+        document->clippingRect(contentRect);
+        document->traceRect(contentRect);
+    }
+}
+
+// Observers get the same events for stages restored from the cache as for traced ones.
+void Illustrace::notifyRestored(Document *document, TraceCache::Level level)
+{
+    if (TraceCache::Level::Miss == level) {
+        return;
+    }
+
+    notify(this, Illustrace::Event::Binarized, document, &document->binarizedImage());
+    notify(this, Illustrace::Event::NegativeFilterApplied, document, &document->negativeImage());
+    notify(this, Illustrace::Event::OutlineBuilt, document, document->outlineContours());
+
+    if (TraceCache::Level::Paths == level) {
+        notify(this, Illustrace::Event::OutlineApproximated, document, document->approximatedOutlineContours());
+        notify(this, Illustrace::Event::OutlineBezierized, document, document->paths());
+    }
 }
 
 void Illustrace::binarize(cv::Mat &sourceImage, Document *document)
 {
-    cv::Mat binarizedImage = sourceImage.clone();
+    cv::Rect &traceRect = document->traceRect();
+    cv::Mat binarizedImage;
 
-    Filter::brightness(binarizedImage, document->brightness());
+    if (traceRect.size() == sourceImage.size()) {
+        binarizedImage = sourceImage.clone();
+    }
+    else {
+        binarizedImage = cv::Mat(sourceImage.rows, sourceImage.cols, CV_8UC1, cv::Scalar(255));
+        sourceImage(traceRect).copyTo(binarizedImage(traceRect));
+    }
+
+    cv::Mat binarizedROI = binarizedImage(traceRect);
+
+    Filter::brightness(binarizedROI, document->brightness());
     notify(this, Illustrace::Event::BrightnessFilterApplied, document, &binarizedImage);
 
-    Filter::blur(binarizedImage, blur(sourceImage, document));
+    Filter::blur(binarizedROI, blur(sourceImage, document));
     notify(this, Illustrace::Event::BlurFilterApplied, document, &binarizedImage);
 
-    Filter::threshold(binarizedImage);
+    Filter::threshold(binarizedROI);
     if (document->negative()) {
-        Filter::negative(binarizedImage);
+        Filter::negative(binarizedROI);
     }
 
     notify(this, Illustrace::Event::Binarized, document, &binarizedImage);
     document->binarizedImage(binarizedImage);
 
-    cv::Mat negativeImage = binarizedImage.clone();
-    Filter::negative(negativeImage);
+    cv::Mat negativeImage = cv::Mat::zeros(sourceImage.rows, sourceImage.cols, CV_8UC1);
+    cv::Mat negativeROI = negativeImage(traceRect);
+    binarizedROI.copyTo(negativeROI);
+    Filter::negative(negativeROI);
 
     notify(this, Illustrace::Event::NegativeFilterApplied, document, &negativeImage);
     document->negativeImage(negativeImage);
@@ -76,54 +237,109 @@ void Illustrace::binarize(cv::Mat &sourceImage, Document *document)
     cv::Mat preprocessedImage = negativeImage.clone();
     document->preprocessedImage(preprocessedImage);
 
-    cv::Mat paintLayer = cv::Mat::zeros(sourceImage.rows, sourceImage.cols, CV_8UC4);
+    TiledLayer paintLayer(sourceImage.rows, sourceImage.cols);
     document->paintLayer(paintLayer);
 }
 
 void Illustrace::buildLines(Document *document)
 {
-    cv::Mat image = document->preprocessedImage().clone();
+    cv::Mat &image = document->preprocessedImage();
+
+    cv::Rect &traceRect = document->traceRect();
+    cv::Mat traceImage = image(traceRect);
 
-    cv::Rect boundingRect = cv::boundingRect(image);
+    cv::Rect boundingRect = cv::boundingRect(traceImage) + traceRect.tl();
     document->boundingRect(boundingRect);
 
-    auto *outlineContours = new std::vector<std::vector<cv::Point>>();
-    auto *outlineHierarchy = new std::vector<cv::Vec4i>();
-    cv::findContours(image, *outlineContours, *outlineHierarchy, CV_RETR_CCOMP, CV_CHAIN_APPROX_SIMPLE);
-    notify(this, Illustrace::Event::OutlineBuilt, document, outlineContours, outlineHierarchy);
+    auto *outlineContours = new FlatContours<cv::Point>();
+    ContourBuilder::build(traceImage, *outlineContours, ContourBuilder::Mode::CComp, traceRect.tl(), 0, _canceled);
+    if (canceled()) {
+        delete outlineContours;
+        return;
+    }
+
+    int specks = ContourBuilder::despeckle(*outlineContours, document->despeckle());
+
+    notify(this, Illustrace::Event::OutlineBuilt, document, outlineContours);
 
     document->outlineContours(outlineContours);
-    document->outlineHierarchy(outlineHierarchy);
+    document->specks(specks);
 }
 
 void Illustrace::approximateLines(Document *document)
 {
     double _epsilon = epsilon(document);
 
-    auto *approximatedOutlineContours = new std::vector<std::vector<cv::Point2f>>();
-    
-    for (auto line : *document->outlineContours()) {
-        std::vector<cv::Point2f> approx;
-        cv::approxPolyDP(cv::Mat(line), approx, _epsilon, false);
-        approximatedOutlineContours->push_back(approx);
+    auto &outlineContours = *document->outlineContours();
+    int count = outlineContours.size();
+    int chunks = (count + CONTOURS_GRAIN - 1) / CONTOURS_GRAIN;
+
+    // approxPolyDP keeps a subset of the points, so each contour is approximated into the range
+    // its outline takes and the results are packed afterwards.
+    auto *approximatedOutlineContours = new FlatContours<cv::Point2f>();
+    approximatedOutlineContours->points.resize(outlineContours.points.size());
+    approximatedOutlineContours->offsets = outlineContours.offsets;
+    approximatedOutlineContours->hierarchy = outlineContours.hierarchy;
+    std::vector<int> lengths(count);
+
+    TaskScheduler::shared().parallelFor(chunks, [&](int i) {
+        std::vector<cv::Point2f> approximated;
+        int end = MIN(count, (i + 1) * CONTOURS_GRAIN);
+
+        for (int j = i * CONTOURS_GRAIN; j < end && !canceled(); ++j) {
+            cv::approxPolyDP(outlineContours[j].mat(), approximated, _epsilon, false);
+            std::copy(approximated.begin(), approximated.end(), approximatedOutlineContours->points.begin() + approximatedOutlineContours->offsets[j]);
+            lengths[j] = approximated.size();
+        }
+    });
+
+    if (canceled()) {
+        delete approximatedOutlineContours;
+        return;
     }
 
+    approximatedOutlineContours->pack(lengths);
+
     notify(this, Illustrace::Event::OutlineApproximated, document, approximatedOutlineContours);
     document->approximatedOutlineContours(approximatedOutlineContours);
 }
 
 void Illustrace::buildPaths(Document *document)
 {
-    std::vector<Path *> paths;
-    for (auto line : *document->approximatedOutlineContours()) {
-        auto *path = new Path();
-        BezierSplineBuilder::build(line, path, document->smoothing(), true, false);
-        paths.push_back(path);
+    auto &lines = *document->approximatedOutlineContours();
+    std::vector<Path *> paths(lines.size(), nullptr);
+
+    if (Document::FittingMode::LeastSquares == document->fitting()) {
+        double tolerance = epsilon(document);
+
+        TaskScheduler::shared().parallelFor(lines.size(), CONTOURS_GRAIN, [&](int i) {
+            if (!canceled()) {
+                paths[i] = new Path();
+                BezierSplineBuilder::fit(lines[i], paths[i], tolerance, document->smoothing());
+            }
+        });
+    }
+    else {
+        int chunks = (lines.size() + CONTOURS_GRAIN - 1) / CONTOURS_GRAIN;
+
+        TaskScheduler::shared().parallelFor(chunks, [&](int i) {
+            if (!canceled()) {
+                int begin = i * CONTOURS_GRAIN;
+                int end = MIN((int)lines.size(), begin + CONTOURS_GRAIN);
+                BezierSplineBuilder::build(lines, begin, end, paths, document->smoothing());
+            }
+        });
+    }
+
+    if (canceled()) {
+        for (Path *path : paths) {
+            delete path;
+        }
+        return;
     }
 
-    auto &outlineHierarchy = *document->outlineHierarchy();
     auto *hierarchyPaths = new std::vector<Path *>();
-    buildPathsHierarchy(paths, nullptr, outlineHierarchy, 0, *hierarchyPaths);
+    buildPathsHierarchy(paths, nullptr, lines.hierarchy, 0, *hierarchyPaths);
 
     notify(this, Illustrace::Event::OutlineBezierized, document, hierarchyPaths);
     document->paths(hierarchyPaths);
@@ -148,6 +364,10 @@ void Illustrace::buildPathsHierarchy(std::vector<Path *> &paths, Path *parent, s
         if (-1 != childIndex) {
             buildPathsHierarchy(paths, path, hierarchy, childIndex, results);
         }
+
+        if (parent) {
+            util::unionRect(parent->bounds, path->bounds);
+        }
     }
 }
 
@@ -156,13 +376,48 @@ void Illustrace::buildPaintMask(Document *document)
     const cv::Mat &image = document->preprocessedImage();
     cv::Mat paintMask = cv::Mat::zeros(image.rows, image.cols, CV_8UC1);
 
-    PaintMaskBuilder::build(paintMask, document);
+    PaintMaskBuilder::build(paintMask, document, _canceled);
+    if (canceled()) {
+        return;
+    }
+
+    document->regionMap().build(paintMask);
 
     notify(this, Illustrace::Event::PaintMaskBuilt, document, &paintMask);
     document->paintMask(paintMask);
 }
 
-inline cv::Rect lineRect(cv::Point &point1, cv::Point &point2, int thickness, cv::Mat &canvas)
+// The paint mask is only needed for painting, so it is built on first use after the paths or the
+// thickness changed. After incremental path changes only its dirty tiles are rasterized again, and
+// only the region map tiles under them are labeled again.
+// Returns false when canceled; the dirty rects are kept then, as they cover every tile touched.
+bool Illustrace::updatePaintMask(Document *document)
+{
+    if (document->paintMaskStale()) {
+        buildPaintMask(document);
+        return !document->paintMaskStale();
+    }
+
+    if (document->paintMaskDirtyRects().empty()) {
+        return true;
+    }
+
+    cv::Mat paintMask = document->paintMask();
+    std::vector<cv::Rect> updatedTiles;
+
+    PaintMaskBuilder::update(paintMask, document->paintMaskDirtyRects(), document, updatedTiles, _canceled);
+    if (canceled()) {
+        return false;
+    }
+
+    document->regionMap().update(paintMask, updatedTiles);
+
+    notify(this, Illustrace::Event::PaintMaskBuilt, document, &paintMask);
+    document->paintMask(paintMask);
+    return true;
+}
+
+inline cv::Rect lineRect(cv::Point &point1, cv::Point &point2, int thickness, const cv::Size &canvas)
 {
     int radius = thickness / 2 + 1;
 
@@ -171,10 +426,10 @@ inline cv::Rect lineRect(cv::Point &point1, cv::Point &point2, int thickness, cv
     int maxX = MAX(point1.x, point2.x) + radius;
     int maxY = MAX(point1.y, point2.y) + radius;
 
-    minX = MAX(0, MIN(minX, canvas.cols - 1));
-    maxX = MAX(0, MIN(maxX, canvas.cols - 1));
-    minY = MAX(0, MIN(minY, canvas.rows - 1));
-    maxY = MAX(0, MIN(maxY, canvas.rows - 1));
+    minX = MAX(0, MIN(minX, canvas.width - 1));
+    maxX = MAX(0, MIN(maxX, canvas.width - 1));
+    minY = MAX(0, MIN(minY, canvas.height - 1));
+    maxY = MAX(0, MIN(maxY, canvas.height - 1));
 
     return cv::Rect(minX, minY, maxX - minX + 1, maxY - minY + 1);
 }
@@ -184,46 +439,44 @@ void Illustrace::drawLineOnPreprocessedImage(cv::Point &point1, cv::Point &point
     cv::Mat &preprocessedImage = document->preprocessedImage();
     cv::line(preprocessedImage, point1, point2, cv::Scalar(color), thickness);
 
-    auto dirtyRect = lineRect(point1, point2, thickness, preprocessedImage);
+    auto dirtyRect = lineRect(point1, point2, thickness, preprocessedImage.size());
     notify(this, Illustrace::Event::PreprocessedImageUpdated, document, &preprocessedImage, &dirtyRect);
     document->preprocessedImage(preprocessedImage, &dirtyRect);
 }
 
 void Illustrace::drawLineOnPaintLayer(cv::Point &point1, cv::Point &point2, int thickness, cv::Scalar &color, Document *document)
 {
+    if (!updatePaintMask(document)) {
+        return;
+    }
+
     bool changed = false;
 
-    cv::Mat &paintLayer = document->paintLayer();
-    uint32_t *data = (uint32_t *)paintLayer.data;
+    TiledLayer &paintLayer = document->paintLayer();
 
     cv::Mat &paintMask = document->paintMask();
-    uint8_t *paintMaskData = paintMask.data;
 
-    uint32_t newColor = (int)color[0] | (int)color[1] << 8 | (int)color[2] << 16 | (int)color[3] << 24;
-
-    cv::Rect rect = lineRect(point1, point2, thickness, paintLayer);
-    cv::Mat line = cv::Mat::zeros(rect.height, rect.width, CV_8UC1);
-
-    cv::line(line, cv::Point(point1.x - rect.x, point1.y - rect.y), cv::Point(point2.x - rect.x, point2.y - rect.y), cv::Scalar(255), thickness);
-
-    for (int y = 0; y < rect.height; ++y) {
-        int dstY = rect.y + y;
-        if (0 <= dstY && dstY < paintLayer.rows) {
-            int yOffset = rect.width * y;
-            int yDstOffset = dstY * paintLayer.cols;
-            for (int x = 0; x < rect.width; ++x) {
-                int dstX = rect.x + x;
-                if (0 <= dstX && dstX < paintLayer.cols) {
-                    if (0 != line.data[yOffset + x] && 255 != paintMaskData[yDstOffset + dstX]) {
-                        if (data[yDstOffset + dstX] != newColor) {
-                            data[yDstOffset + dstX] = newColor;
-                            changed = true;
-                        }
-                    }
-                }
+    uint8_t newIndex;
+    if (!document->paintPalette().index(Palette::pack(color), newIndex)) {
+        return;
+    }
+
+    cv::Rect rect = lineRect(point1, point2, thickness, paintLayer.size());
+
+    // The stroke is a capsule around the pixel centers, rasterized span by span straight into
+    // the layer with the mask test on the way, so a segment allocates nothing.
+    cv::Point2f p1(point1.x + 0.5, point1.y + 0.5);
+    cv::Point2f p2(point2.x + 0.5, point2.y + 0.5);
+
+    Rasterizer::capsuleSpans(rect, p1, p2, thickness / 2.0, [&](int y, int x0, int x1) {
+        const uint8_t *paintMaskRow = paintMask.ptr<uint8_t>(y);
+        for (int x = x0; x < x1; ++x) {
+            if (255 != paintMaskRow[x] && paintLayer.at(x, y) != newIndex) {
+                paintLayer.set(x, y, newIndex);
+                changed = true;
             }
         }
-    }
+    });
 
     if (changed) {
         notify(this, Illustrace::Event::PaintLayerUpdated, document, &paintLayer, &rect);
@@ -231,24 +484,13 @@ void Illustrace::drawLineOnPaintLayer(cv::Point &point1, cv::Point &point2, int
     }
 }
 
-void Illustrace::fillRegionOnPaintLayer(cv::Point &seed, cv::Scalar &color, Document *document)
+static cv::Rect floodFill(cv::Point &seed, uint8_t oldIndex, uint8_t newIndex, TiledLayer &paintLayer, cv::Mat &paintMask)
 {
     // Based on Scanline Floodfill Algorithm With Stack (floodFillScanlineStack)
     // http://lodev.org/cgtutor/floodfill.html
 
-    cv::Mat &paintLayer = document->paintLayer();
-    uint32_t *data = (uint32_t *)paintLayer.data;
-
-    cv::Mat &paintMask = document->paintMask();
     uint8_t *paintMaskData = paintMask.data;
 
-    uint32_t newColor = (int)color[0] | (int)color[1] << 8 | (int)color[2] << 16 | (int)color[3] << 24;
-    uint32_t oldColor = data[seed.y * paintLayer.cols + seed.x];
-
-    if (oldColor == newColor || 255 == paintMaskData[seed.y * paintLayer.cols + seed.x]) {
-        return;
-    }
-
     int minX = seed.x;
     int minY = seed.y;
     int maxX = seed.x;
@@ -266,10 +508,10 @@ void Illustrace::fillRegionOnPaintLayer(cv::Point &seed, cv::Scalar &color, Docu
         int yOffsetMinus1 = yOffset - paintLayer.cols;
         int yOffsetPlus1 = yOffset + paintLayer.cols;
 
-        minX = MIN(pt.y, minY);
+        minY = MIN(pt.y, minY);
         maxY = MAX(pt.y, maxY);
 
-        while (0 <= pt.x && data[yOffset + pt.x] == oldColor && 255 != paintMaskData[yOffset + pt.x]) {
+        while (0 <= pt.x && paintLayer.at(pt.x, pt.y) == oldIndex && 255 != paintMaskData[yOffset + pt.x]) {
             --pt.x;
         }
 
@@ -280,25 +522,25 @@ void Illustrace::fillRegionOnPaintLayer(cv::Point &seed, cv::Scalar &color, Docu
         bool spanAbove = false;
         bool spanBelow = false;
 
-        while (pt.x < paintLayer.cols && data[yOffset + pt.x] == oldColor && 255 != paintMaskData[yOffset + pt.x]) {
-            data[yOffset + pt.x] = newColor;
+        while (pt.x < paintLayer.cols && paintLayer.at(pt.x, pt.y) == oldIndex && 255 != paintMaskData[yOffset + pt.x]) {
+            paintLayer.set(pt.x, pt.y, newIndex);
 
             if (0 < pt.y) {
-                if (!spanAbove && data[yOffsetMinus1 + pt.x] == oldColor && 255 != paintMaskData[yOffsetMinus1 + pt.x]) {
+                if (!spanAbove && paintLayer.at(pt.x, pt.y - 1) == oldIndex && 255 != paintMaskData[yOffsetMinus1 + pt.x]) {
                     stack.push(cv::Point(pt.x, pt.y - 1));
                     spanAbove = true;
                 }
-                else if(spanAbove && (data[yOffsetMinus1 + pt.x] != oldColor || 255 == paintMaskData[yOffsetMinus1 + pt.x])) {
+                else if(spanAbove && (paintLayer.at(pt.x, pt.y - 1) != oldIndex || 255 == paintMaskData[yOffsetMinus1 + pt.x])) {
                     spanAbove = false;
                 }
             }
 
             if (pt.y < paintLayer.rows - 1) {
-                if (!spanBelow && data[yOffsetPlus1 + pt.x] == oldColor && 255 != paintMaskData[yOffsetPlus1 + pt.x]) {
+                if (!spanBelow && paintLayer.at(pt.x, pt.y + 1) == oldIndex && 255 != paintMaskData[yOffsetPlus1 + pt.x]) {
                     stack.push(cv::Point(pt.x, pt.y + 1));
                     spanBelow = true;
                 }
-                else if (spanBelow && (data[yOffsetPlus1 + pt.x] != oldColor || 255 == paintMaskData[yOffsetPlus1 + pt.x])) {
+                else if (spanBelow && (paintLayer.at(pt.x, pt.y + 1) != oldIndex || 255 == paintMaskData[yOffsetPlus1 + pt.x])) {
                     spanBelow = false;
                 }
             }
@@ -309,70 +551,129 @@ void Illustrace::fillRegionOnPaintLayer(cv::Point &seed, cv::Scalar &color, Docu
         maxX = MAX(pt.x, maxX);
     }
 
-    auto dirtyRect = cv::Rect(minX, minY, maxX - minX + 1, maxY - minY + 1);
+    minX = MAX(0, minX);
+    maxX = MIN(paintLayer.cols - 1, maxX);
+
+    return cv::Rect(minX, minY, maxX - minX + 1, maxY - minY + 1);
+}
+
+void Illustrace::fillRegionOnPaintLayer(cv::Point &seed, cv::Scalar &color, Document *document)
+{
+    if (!updatePaintMask(document)) {
+        return;
+    }
+
+    TiledLayer &paintLayer = document->paintLayer();
+
+    // The region map answers null for seeds off the image or under the paint mask.
+    Region *region = document->regionMap().region(seed.x, seed.y);
+    if (!region) {
+        return;
+    }
+
+    uint8_t newIndex;
+    if (!document->paintPalette().index(Palette::pack(color), newIndex)) {
+        return;
+    }
+
+    uint8_t oldIndex = paintLayer.at(seed.x, seed.y);
+    if (oldIndex == newIndex) {
+        return;
+    }
+
+    // The region is exactly the flood fill area as long as nothing has been painted into it partially.
+    bool uniform = true;
+    for (auto it = region->spans.begin(); uniform && it != region->spans.end(); ++it) {
+        uniform = paintLayer.filled(it->y, it->x0, it->x1, oldIndex);
+    }
+
+    cv::Rect dirtyRect;
+
+    if (uniform) {
+        for (auto &span : region->spans) {
+            paintLayer.fill(span.y, span.x0, span.x1, newIndex);
+        }
+        dirtyRect = region->boundingRect;
+    }
+    else {
+        dirtyRect = floodFill(seed, oldIndex, newIndex, paintLayer, document->paintMask());
+    }
+
     notify(this, Illustrace::Event::PaintLayerUpdated, document, &paintLayer, &dirtyRect);
     document->paintLayer(paintLayer, &dirtyRect);
 }
 
 void Illustrace::buildPaintPaths(Document *document)
 {
-    std::unordered_map<uint32_t, std::vector<cv::Point>> paintMap;
-
-    cv::Mat &paintLayer = document->paintLayer();
-    uint32_t *data = (uint32_t *)paintLayer.data;
-    for (int y = 0; y < paintLayer.rows; ++y) {
-        int yOffset = y * paintLayer.cols;
-        for (int x = 0; x < paintLayer.cols; ++x) {
-            uint32_t color = data[yOffset + x];
-            if (paintMap.find(color) == paintMap.end()) {
-                paintMap[color] = std::vector<cv::Point>();
+    TaskScheduler::LaneScope scope(TaskScheduler::Lane::Background);
+
+    std::vector<std::vector<cv::Point>> buckets(256);
+
+    // Only allocated tiles can hold painted pixels, which are bucketed by their palette index.
+    TiledLayer &paintLayer = document->paintLayer();
+    for (int row = 0; row < paintLayer.tileRows(); ++row) {
+        for (int col = 0; col < paintLayer.tileCols(); ++col) {
+            const uint8_t *data = paintLayer.tile(col, row);
+            if (!data) {
+                continue;
             }
 
-            if (((uint8_t *)&color)[3]) {
-                paintMap[color].push_back((cv::Point){x, y});
+            cv::Rect tileRect = paintLayer.tileRect(col, row);
+            for (int y = 0; y < tileRect.height; ++y) {
+                int yOffset = y * TiledLayer::TileSize;
+                for (int x = 0; x < tileRect.width; ++x) {
+                    uint8_t index = data[yOffset + x];
+                    if (index) {
+                        buckets[index].push_back((cv::Point){tileRect.x + x, tileRect.y + y});
+                    }
+                }
             }
         }
     }
 
-    cv::Mat negativeImage = cv::Mat(paintLayer.rows, paintLayer.cols, CV_8UC1);
-    auto *hierarchyPaths = new std::vector<Path *>();
+    std::vector<int> entries;
+    for (int i = 1; i < buckets.size(); ++i) {
+        if (!buckets[i].empty()) {
+            entries.push_back(i);
+        }
+    }
 
-    for (auto entry : paintMap) {
-        const uint8_t *color = (const uint8_t *)&entry.first;
-        std::vector<cv::Point> &paintedPixels = entry.second;
+    // Every color is traced on its own, each task with its own mask image covering the painted
+    // pixels and a margin wider than the blur, so that the contours are the same as over the whole layer.
+    std::vector<std::vector<Path *>> entryPaths(entries.size());
+    std::vector<std::vector<cv::Vec4i>> entryHierarchies(entries.size());
 
-        int length = negativeImage.rows * negativeImage.cols;
-        for (int i = 0; i < length; ++i) {
-            negativeImage.data[i] = 0;
-        }
+    TaskScheduler::shared().parallelFor(entries.size(), [&](int i) {
+        uint32_t packed = document->paintPalette().color(entries[i]);
+        const uint8_t *color = (const uint8_t *)&packed;
+        std::vector<cv::Point> &paintedPixels = buckets[entries[i]];
 
+        cv::Rect bounds = cv::boundingRect(paintedPixels);
+        cv::Rect rect = cv::Rect(bounds.x - PAINT_BLUR, bounds.y - PAINT_BLUR, bounds.width + PAINT_BLUR * 2, bounds.height + PAINT_BLUR * 2) & cv::Rect(0, 0, paintLayer.cols, paintLayer.rows);
+
+        cv::Mat negativeImage = cv::Mat(rect.height, rect.width, CV_8UC1, cv::Scalar(0));
         for (auto point : paintedPixels) {
-            negativeImage.data[point.y * negativeImage.cols + point.x] = 255;
+            negativeImage.data[(point.y - rect.y) * negativeImage.cols + point.x - rect.x] = 255;
         }
 
-        Filter::blur(negativeImage, 5);
+        Filter::blur(negativeImage, PAINT_BLUR);
         std::vector<std::vector<cv::Point>> contours;
-        std::vector<cv::Vec4i> hierarchy;
-        cv::findContours(negativeImage, contours, hierarchy, CV_RETR_CCOMP, CV_CHAIN_APPROX_SIMPLE);
-
-        std::vector<std::vector<cv::Point2f>> approximatedLines;
+        cv::findContours(negativeImage, contours, entryHierarchies[i], CV_RETR_CCOMP, CV_CHAIN_APPROX_SIMPLE, rect.tl());
 
         for (auto line : contours) {
             std::vector<cv::Point2f> approx;
             cv::approxPolyDP(cv::Mat(line), approx, 0.5, false);
-            approximatedLines.push_back(approx);
-        }
 
-        std::vector<Path *> paths;
-
-        for (auto line : approximatedLines) {
             auto *path = new Path();
             path->color = new cv::Scalar(color[0], color[1], color[2], color[3]);
-            BezierSplineBuilder::build(line, path, document->smoothing(), true, true);
-            paths.push_back(path);
+            BezierSplineBuilder::build(approx, path, document->smoothing(), true, true);
+            entryPaths[i].push_back(path);
         }
+    });
 
-        buildPathsHierarchy(paths, nullptr, hierarchy, 0, *hierarchyPaths);
+    auto *hierarchyPaths = new std::vector<Path *>();
+    for (int i = 0; i < entries.size(); ++i) {
+        buildPathsHierarchy(entryPaths[i], nullptr, entryHierarchies[i], 0, *hierarchyPaths);
     }
 
     notify(this, Illustrace::Event::PaintPathsBuilt, document, hierarchyPaths);
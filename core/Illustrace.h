@@ -3,10 +3,13 @@
 #include "Observable.h"
 #include "Filter.h"
 #include "BezierSplineBuilder.h"
+#include "ContourBuilder.h"
 #include "PaintMaskBuilder.h"
 #include "Document.h"
+#include "TraceCache.h"
 
 #include "opencv2/imgproc.hpp"
+#include <atomic>
 
 namespace illustrace {
 
@@ -27,18 +30,30 @@ public:
         PreprocessedImageUpdated,
     };
 
-    void traceForPreview(cv::Mat &sourceImage, std::vector<std::vector<cv::Point>> &outlineContours, std::vector<cv::Vec4i> &outlineHierarchy, double brightness, bool negative = false);
-    bool traceFromFile(const char *filepath, Document *document);
-    void traceFromImage(cv::Mat &sourceImage, Document *document);
+    Illustrace();
+
+    void cancellation(const std::atomic<bool> *canceled);
+    void cache(TraceCache *cache);
+
+    void traceForPreview(cv::Mat &sourceImage, FlatContours<cv::Point> &outlineContours, double brightness, bool negative = false);
+    bool traceFromFile(const char *filepath, Document *document, const cv::Rect *clippingRect = nullptr);
+    bool traceFromMemory(const uchar *data, size_t size, Document *document, const cv::Rect *clippingRect = nullptr);
+    bool traceFromPixels(const uchar *pixels, int width, int height, int channels, size_t stride, Document *document, const cv::Rect *clippingRect = nullptr);
+    void traceFromImage(cv::Mat &sourceImage, Document *document, const cv::Rect *clippingRect = nullptr);
+    bool openProject(const char *filepath, Document *document);
+    void layout(cv::Mat &sourceImage, Document *document, const cv::Rect *clippingRect = nullptr);
     void binarize(cv::Mat &sourceImage, Document *document);
     void buildLines(Document *document);
     void approximateLines(Document *document);
     void buildPaths(Document *document);
     void buildPaintMask(Document *document);
+    bool updatePaintMask(Document *document);
     void drawLineOnPreprocessedImage(cv::Point &point1, cv::Point &point2, int thickness, int color, Document *document);
     void drawLineOnPaintLayer(cv::Point &point, cv::Point &point2, int thickness, cv::Scalar &color, Document *document);
     void fillRegionOnPaintLayer(cv::Point &seed, cv::Scalar &color, Document *document);
     void buildPaintPaths(Document *document);
+    void buildPathsHierarchy(std::vector<Path *> &paths, Path *parent, std::vector<cv::Vec4i> &hierarchy, int index, std::vector<Path *> &results);
+    double epsilon(Document *document);
 
     static inline const char *Event2CString(Event event) {
 #define CASE(event) case event: return #event
@@ -61,9 +76,12 @@ public:
 
 
 private:
-    void buildPathsHierarchy(std::vector<Path *> &paths, Path *parent, std::vector<cv::Vec4i> &hierarchy, int index, std::vector<Path *> &results);
+    bool canceled();
+    void notifyRestored(Document *document, TraceCache::Level level);
     int blur(cv::Mat &sourceImage, Document *document);
-    double epsilon(Document *document);
+
+    const std::atomic<bool> *_canceled;
+    TraceCache *_cache;
 };
 
 } // namespace illustrace
@@ -0,0 +1,331 @@
+#include "PackedPath.h"
+
+#include <cmath>
+#include <cstring>
+
+using namespace illustrace;
+
+static const int PointCounts[] = {1, 1, 3};
+
+static bool offsetsFit(const Path *path, PackedPath::Encoding encoding);
+static uint16_t floatToHalf(float value);
+static float halfToFloat(uint16_t half);
+
+PackedPath::PackedPath(const Path *path, Encoding encoding) :
+    segments(this),
+    closed(path->closed),
+    bounds(path->bounds),
+    encoding(offsetsFit(path, encoding) ? encoding : Encoding::Float)
+{
+    size_t size = Encoding::Half == this->encoding ? sizeof(uint16_t) : sizeof(uint32_t);
+    size_t length = 0;
+    for (const Segment &s : path->segments) {
+        length += (Segment::Type::Move == s.type ? sizeof(float) : size) * PointCounts[s.type] * 2;
+    }
+
+    types.reserve(path->segments.size());
+    coordinates.reserve(length);
+
+    // Origins follow the decoded points, as the reader sees them.
+    cv::Point2f current;
+
+    for (const Segment &s : path->segments) {
+        types.push_back(s.type);
+
+        Encoding pointEncoding = Segment::Type::Move == s.type ? Encoding::Float : this->encoding;
+
+        for (int i = 3 - PointCounts[s.type]; i < 3; ++i) {
+            size_t offset = coordinates.size();
+            append(s[i].x, current.x, pointEncoding);
+            append(s[i].y, current.y, pointEncoding);
+
+            if (2 == i) {
+                current.x = read(offset, current.x, pointEncoding);
+                current.y = read(offset, current.y, pointEncoding);
+            }
+        }
+    }
+
+    // Each child falls back on its own.
+    for (Path *child : path->children) {
+        children.push_back(new PackedPath(child, encoding));
+    }
+}
+
+PackedPath::~PackedPath()
+{
+    for (PackedPath *child : children) {
+        delete child;
+    }
+}
+
+void PackedPath::unpack(Path *path) const
+{
+    path->segments.reserve(segments.size());
+
+    for (const SegmentView &s : segments) {
+        path->segments.push_back((Segment){s.type, {s[0], s[1], s[2]}});
+    }
+
+    path->closed = closed;
+    path->bounds = bounds;
+
+    for (PackedPath *child : children) {
+        Path *unpacked = new Path();
+        child->unpack(unpacked);
+        path->children.push_back(unpacked);
+    }
+}
+
+size_t PackedPath::bytes() const
+{
+    size_t bytes = sizeof(PackedPath) + types.capacity() + coordinates.capacity() + children.capacity() * sizeof(PackedPath *);
+    for (PackedPath *child : children) {
+        bytes += child->bytes();
+    }
+    return bytes;
+}
+
+void PackedPath::append(float value, float origin, Encoding encoding)
+{
+    switch (encoding) {
+    case Encoding::Float:
+        {
+            uint8_t bytes[sizeof(float)];
+            memcpy(bytes, &value, sizeof(float));
+            coordinates.insert(coordinates.end(), bytes, bytes + sizeof(float));
+        }
+        break;
+    case Encoding::Fixed:
+        {
+            int32_t fixed = (int32_t)lround((value - origin) * 65536.0);
+            uint8_t bytes[sizeof(int32_t)];
+            memcpy(bytes, &fixed, sizeof(int32_t));
+            coordinates.insert(coordinates.end(), bytes, bytes + sizeof(int32_t));
+        }
+        break;
+    case Encoding::Half:
+        {
+            uint16_t half = floatToHalf(value - origin);
+            uint8_t bytes[sizeof(uint16_t)];
+            memcpy(bytes, &half, sizeof(uint16_t));
+            coordinates.insert(coordinates.end(), bytes, bytes + sizeof(uint16_t));
+        }
+        break;
+    }
+}
+
+float PackedPath::read(size_t &offset, float origin, Encoding encoding) const
+{
+    const uint8_t *data = coordinates.data() + offset;
+
+    switch (encoding) {
+    case Encoding::Float:
+        {
+            float value;
+            memcpy(&value, data, sizeof(float));
+            offset += sizeof(float);
+            return value;
+        }
+    case Encoding::Fixed:
+        {
+            int32_t fixed;
+            memcpy(&fixed, data, sizeof(int32_t));
+            offset += sizeof(int32_t);
+            return origin + fixed / 65536.0f;
+        }
+    case Encoding::Half:
+        {
+            uint16_t half;
+            memcpy(&half, data, sizeof(uint16_t));
+            offset += sizeof(uint16_t);
+            return origin + halfToFloat(half);
+        }
+    }
+
+    return 0.0f;
+}
+
+PackedPath::Iterator::Iterator(const PackedPath *path, size_t index) :
+    path(path),
+    index(index),
+    offset(0)
+{
+    if (index < path->types.size()) {
+        decode();
+    }
+}
+
+const PackedPath::SegmentView &PackedPath::Iterator::operator*() const
+{
+    return segment;
+}
+
+const PackedPath::SegmentView *PackedPath::Iterator::operator->() const
+{
+    return &segment;
+}
+
+PackedPath::Iterator &PackedPath::Iterator::operator++()
+{
+    current = segment.p[2];
+    if (++index < path->types.size()) {
+        decode();
+    }
+    return *this;
+}
+
+bool PackedPath::Iterator::operator!=(const Iterator &other) const
+{
+    return index != other.index;
+}
+
+void PackedPath::Iterator::decode()
+{
+    segment.type = (Segment::Type)path->types[index];
+
+    Encoding encoding = Segment::Type::Move == segment.type ? Encoding::Float : path->encoding;
+
+    for (int i = 0; i < 3 - PointCounts[segment.type]; ++i) {
+        segment.p[i] = cv::Point2f();
+    }
+
+    for (int i = 3 - PointCounts[segment.type]; i < 3; ++i) {
+        segment.p[i].x = path->read(offset, current.x, encoding);
+        segment.p[i].y = path->read(offset, current.y, encoding);
+    }
+}
+
+PackedPath::Segments::Segments(const PackedPath *path) : path(path)
+{
+}
+
+PackedPath::Iterator PackedPath::Segments::begin() const
+{
+    return Iterator(path, 0);
+}
+
+PackedPath::Iterator PackedPath::Segments::end() const
+{
+    return Iterator(path, path->types.size());
+}
+
+size_t PackedPath::Segments::size() const
+{
+    return path->types.size();
+}
+
+bool PackedPath::Segments::empty() const
+{
+    return path->types.empty();
+}
+
+// Local functions
+
+// Offsets are checked against the source points with a pixel to spare, as the decoded origins
+// they are taken from differ by far less.
+static bool offsetsFit(const Path *path, PackedPath::Encoding encoding)
+{
+    float limit;
+
+    switch (encoding) {
+    case PackedPath::Encoding::Fixed:
+        limit = INT16_MAX;
+        break;
+    case PackedPath::Encoding::Half:
+        limit = 65504.0f - 1.0f;
+        break;
+    default:
+        return true;
+    }
+
+    cv::Point2f current;
+
+    for (const Segment &s : path->segments) {
+        if (Segment::Type::Move != s.type) {
+            for (int i = 3 - PointCounts[s.type]; i < 3; ++i) {
+                // Negated so that NaN fails as well
+                if (!(fabsf(s[i].x - current.x) <= limit && fabsf(s[i].y - current.y) <= limit)) {
+                    return false;
+                }
+            }
+        }
+        current = s[2];
+    }
+
+    return true;
+}
+
+// IEEE 754 binary16, rounding to nearest even. Offsets beyond the half range become infinity.
+static uint16_t floatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = ((bits >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    if (0xFF == ((bits >> 23) & 0xFF)) {
+        return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+    }
+
+    if (31 <= exponent) {
+        return sign | 0x7C00;
+    }
+
+    if (0 >= exponent) {
+        if (-10 > exponent) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t middle = 1u << (shift - 1);
+        if (middle < rest || (middle == rest && (half & 1))) {
+            ++half;
+        }
+        return sign | half;
+    }
+
+    uint32_t half = (exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1FFF;
+    if (0x1000 < rest || (0x1000 == rest && (half & 1))) {
+        ++half;
+    }
+    return sign | half;
+}
+
+static float halfToFloat(uint16_t half)
+{
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    int32_t exponent = (half >> 10) & 0x1F;
+    uint32_t mantissa = half & 0x3FF;
+    uint32_t bits;
+
+    if (0 == exponent) {
+        if (0 == mantissa) {
+            bits = sign;
+        }
+        else {
+            exponent = 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                --exponent;
+            }
+            mantissa &= 0x3FF;
+            bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+        }
+    }
+    else if (31 == exponent) {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    }
+    else {
+        bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+    }
+
+    float value;
+    memcpy(&value, &bits, sizeof(float));
+    return value;
+}
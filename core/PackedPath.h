@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Document.h"
+
+#include <cstdint>
+
+namespace illustrace {
+
+// Read-only compact form of a Path tree. Segments are a stream of type tags and a stream holding
+// only the points each type uses: one for Move and Line, three for Curve. Coordinates are floats,
+// or 16.16 fixed point or half precision offsets from the previous end point. Move points stay
+// absolute floats, and offsets are taken from the decoded previous point, so rounding does not
+// accumulate along the path. A path with an offset beyond the range of its encoding is kept in
+// floats.
+class PackedPath {
+public:
+    enum Encoding : uint8_t {
+        Float,
+        Fixed,
+        Half,
+    };
+
+    struct SegmentView {
+        Segment::Type type;
+        cv::Point2f p[3];
+
+        const cv::Point2f& operator[] (const int index) const {
+            return p[index];
+        }
+    };
+
+    class Iterator {
+    public:
+        Iterator(const PackedPath *path, size_t index);
+
+        const SegmentView &operator*() const;
+        const SegmentView *operator->() const;
+        Iterator &operator++();
+        bool operator!=(const Iterator &other) const;
+
+    private:
+        void decode();
+
+        const PackedPath *path;
+        size_t index;
+        size_t offset;
+        cv::Point2f current;
+        SegmentView segment;
+    };
+
+    // Range over the segments, so path->segments loops read the same as for Path.
+    class Segments {
+    public:
+        Segments(const PackedPath *path);
+
+        Iterator begin() const;
+        Iterator end() const;
+        size_t size() const;
+        bool empty() const;
+
+    private:
+        const PackedPath *path;
+    };
+
+    PackedPath(const Path *path, Encoding encoding = Encoding::Float);
+    ~PackedPath();
+
+    void unpack(Path *path) const;
+    size_t bytes() const;
+
+    Segments segments;
+    bool closed;
+    cv::Rect2f bounds;
+    std::vector<PackedPath *> children;
+
+private:
+    PackedPath(const PackedPath &) = delete;
+    PackedPath &operator=(const PackedPath &) = delete;
+
+    void append(float value, float origin, Encoding encoding);
+    float read(size_t &offset, float origin, Encoding encoding) const;
+
+    Encoding encoding;
+    std::vector<uint8_t> types;
+    std::vector<uint8_t> coordinates;
+};
+
+} // namespace illustrace
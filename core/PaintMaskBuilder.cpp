@@ -0,0 +1,90 @@
+#include "PaintMaskBuilder.h"
+#include "Rasterizer.h"
+#include "TaskScheduler.h"
+
+#define TILE_SIZE 256
+
+using namespace illustrace;
+
+// Every tile picks the paths whose bounds reach it from the document's path index
+// and is rasterized independently.
+
+static void rasterizeTile(cv::Mat &paintMask, const cv::Rect &tile, PathIndex &pathIndex, float width, float margin);
+
+void PaintMaskBuilder::build(cv::Mat &paintMask, Document *document, const std::atomic<bool> *canceled)
+{
+    PathIndex &pathIndex = document->pathIndex();
+    float width = document->thickness();
+    float margin = width / 2.0 + 1.0;
+
+    int tileCols = (paintMask.cols + TILE_SIZE - 1) / TILE_SIZE;
+    int tileRows = (paintMask.rows + TILE_SIZE - 1) / TILE_SIZE;
+    cv::Rect maskRect(0, 0, paintMask.cols, paintMask.rows);
+
+    TaskScheduler::shared().parallelFor(tileCols * tileRows, [&](int i) {
+        if (canceled && *canceled) {
+            return;
+        }
+
+        cv::Rect tile = cv::Rect(i % tileCols * TILE_SIZE, i / tileCols * TILE_SIZE, TILE_SIZE, TILE_SIZE) & maskRect;
+        rasterizeTile(paintMask, tile, pathIndex, width, margin);
+    });
+}
+
+// Updates the mask in place. Tiles which no dirty rect reaches within the stroke margin are left
+// as they are, and the others are returned in updatedTiles. The dirty rects must cover the bounds
+// of every path added or removed since the mask was built.
+void PaintMaskBuilder::update(cv::Mat &paintMask, const std::vector<cv::Rect2f> &dirtyRects, Document *document, std::vector<cv::Rect> &updatedTiles, const std::atomic<bool> *canceled)
+{
+    PathIndex &pathIndex = document->pathIndex();
+    float width = document->thickness();
+    float margin = width / 2.0 + 1.0;
+
+    int tileCols = (paintMask.cols + TILE_SIZE - 1) / TILE_SIZE;
+    int tileRows = (paintMask.rows + TILE_SIZE - 1) / TILE_SIZE;
+    cv::Rect maskRect(0, 0, paintMask.cols, paintMask.rows);
+    std::vector<cv::Rect> tiles(tileCols * tileRows);
+
+    TaskScheduler::shared().parallelFor(tileCols * tileRows, [&](int i) {
+        if (canceled && *canceled) {
+            return;
+        }
+
+        cv::Rect tile = cv::Rect(i % tileCols * TILE_SIZE, i / tileCols * TILE_SIZE, TILE_SIZE, TILE_SIZE) & maskRect;
+        cv::Rect2f reach(tile.x - margin, tile.y - margin, tile.width + margin * 2, tile.height + margin * 2);
+
+        for (const cv::Rect2f &rect : dirtyRects) {
+            if (rect.x <= reach.x + reach.width && reach.x <= rect.x + rect.width
+                    && rect.y <= reach.y + reach.height && reach.y <= rect.y + rect.height) {
+                paintMask(tile).setTo(cv::Scalar(0));
+                rasterizeTile(paintMask, tile, pathIndex, width, margin);
+                tiles[i] = tile;
+                return;
+            }
+        }
+    });
+
+    updatedTiles.clear();
+    for (const cv::Rect &tile : tiles) {
+        if (0 < tile.area()) {
+            updatedTiles.push_back(tile);
+        }
+    }
+}
+
+// Local functions
+
+static void rasterizeTile(cv::Mat &paintMask, const cv::Rect &tile, PathIndex &pathIndex, float width, float margin)
+{
+    std::vector<Path *> paths;
+    pathIndex.query(cv::Rect2f(tile.x - margin, tile.y - margin, tile.width + margin * 2, tile.height + margin * 2), paths);
+
+    std::vector<Rasterizer::Polyline> polylines;
+    for (Path *path : paths) {
+        Rasterizer::flatten(path, polylines);
+        if (path->closed) {
+            Rasterizer::fill(paintMask, tile, polylines);
+        }
+        Rasterizer::stroke(paintMask, tile, polylines, width);
+    }
+}
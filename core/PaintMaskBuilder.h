@@ -2,11 +2,14 @@
 
 #include "Document.h"
 
+#include <atomic>
+
 namespace illustrace {
 
 class PaintMaskBuilder {
 public:
-    static void build(cv::Mat &paintMask, Document *document);
+    static void build(cv::Mat &paintMask, Document *document, const std::atomic<bool> *canceled = nullptr);
+    static void update(cv::Mat &paintMask, const std::vector<cv::Rect2f> &dirtyRects, Document *document, std::vector<cv::Rect> &updatedTiles, const std::atomic<bool> *canceled = nullptr);
 };
 
 } // namespace illustrace
@@ -0,0 +1,64 @@
+#include "Palette.h"
+
+#include <algorithm>
+
+using namespace illustrace;
+
+Palette::Palette() : colors(1, 0)
+{
+}
+
+bool Palette::index(uint32_t color, uint8_t &index)
+{
+    if (0 == color >> 24) {
+        index = 0;
+        return true;
+    }
+
+    auto it = std::find(colors.begin() + 1, colors.end(), color);
+    if (colors.end() != it) {
+        index = it - colors.begin();
+        return true;
+    }
+
+    if (!freeIndices.empty()) {
+        index = freeIndices.back();
+        freeIndices.pop_back();
+        colors[index] = color;
+        return true;
+    }
+
+    if (Size > colors.size()) {
+        colors.push_back(color);
+        index = colors.size() - 1;
+        return true;
+    }
+
+    return false;
+}
+
+uint32_t Palette::color(uint8_t index) const
+{
+    return colors[index];
+}
+
+int Palette::size() const
+{
+    return colors.size() - freeIndices.size();
+}
+
+// A freed entry reads as transparent, which index() never matches, until it is taken again.
+void Palette::reclaim(const std::vector<bool> &used)
+{
+    for (int i = 1; i < colors.size(); ++i) {
+        if (!used[i] && 0 != colors[i]) {
+            colors[i] = 0;
+            freeIndices.push_back(i);
+        }
+    }
+}
+
+uint32_t Palette::pack(const cv::Scalar &color)
+{
+    return (int)color[0] | (int)color[1] << 8 | (int)color[2] << 16 | (uint32_t)color[3] << 24;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+
+#include <vector>
+#include <cstdint>
+
+namespace illustrace {
+
+// Colors of the paint layer by index, as RGBA packed in the layer's byte order. Index 0 is
+// transparent. An index keeps its color while anything refers to it, so that indices kept by undo
+// snapshots stay valid; once all 256 are taken, reclaim() frees the entries nothing refers to any
+// more, and index() fails for a new color while none is free.
+class Palette {
+public:
+    static const int Size = 256;
+
+    Palette();
+
+    bool index(uint32_t color, uint8_t &index);
+    uint32_t color(uint8_t index) const;
+    int size() const;
+
+    // Frees the entries not marked in used, which has a flag for each index.
+    void reclaim(const std::vector<bool> &used);
+
+    static uint32_t pack(const cv::Scalar &color);
+
+private:
+    std::vector<uint32_t> colors;
+    std::vector<uint8_t> freeIndices;
+};
+
+} // namespace illustrace
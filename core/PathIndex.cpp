@@ -0,0 +1,129 @@
+#include "PathIndex.h"
+#include "Document.h"
+#include "Util.h"
+
+#include <algorithm>
+
+#define MINIMUM_CELL_SIZE 16.0f
+
+using namespace illustrace;
+
+// Uniform grid over the bounds of top-level paths, bulk loaded into cell lists.
+// The cell size is chosen so that there are about as many cells as paths.
+
+static inline bool intersects(const cv::Rect2f &r1, const cv::Rect2f &r2)
+{
+    return r1.x <= r2.x + r2.width && r2.x <= r1.x + r1.width
+        && r1.y <= r2.y + r2.height && r2.y <= r1.y + r1.height;
+}
+
+PathIndex::PathIndex() :
+    cellSize(MINIMUM_CELL_SIZE),
+    cols(0),
+    rows(0)
+{
+}
+
+void PathIndex::build(const std::vector<Path *> &paths)
+{
+    clear();
+
+    if (paths.empty()) {
+        return;
+    }
+
+    this->paths = paths;
+
+    area = paths[0]->bounds;
+    for (Path *path : paths) {
+        util::unionRect(area, path->bounds);
+    }
+
+    cellSize = MAX(MINIMUM_CELL_SIZE, sqrt(area.width * area.height / paths.size()));
+    cols = (int)(area.width / cellSize) + 1;
+    rows = (int)(area.height / cellSize) + 1;
+
+    std::vector<int> counts(cols * rows + 1, 0);
+
+    for (Path *path : paths) {
+        int x0, y0, x1, y1;
+        cellRange(path->bounds, x0, y0, x1, y1);
+        for (int y = y0; y <= y1; ++y) {
+            for (int x = x0; x <= x1; ++x) {
+                ++counts[y * cols + x + 1];
+            }
+        }
+    }
+
+    cellOffsets.resize(cols * rows + 1);
+    cellOffsets[0] = 0;
+    for (int i = 1; i < counts.size(); ++i) {
+        cellOffsets[i] = cellOffsets[i - 1] + counts[i];
+    }
+
+    cellIndices.resize(cellOffsets.back());
+    std::vector<int> cursors(cellOffsets.begin(), cellOffsets.end() - 1);
+
+    for (int i = 0; i < paths.size(); ++i) {
+        int x0, y0, x1, y1;
+        cellRange(paths[i]->bounds, x0, y0, x1, y1);
+        for (int y = y0; y <= y1; ++y) {
+            for (int x = x0; x <= x1; ++x) {
+                cellIndices[cursors[y * cols + x]++] = i;
+            }
+        }
+    }
+}
+
+void PathIndex::clear()
+{
+    paths.clear();
+    cellOffsets.clear();
+    cellIndices.clear();
+    cols = rows = 0;
+}
+
+void PathIndex::query(const cv::Rect2f &rect, std::vector<Path *> &results) const
+{
+    results.clear();
+
+    if (paths.empty() || !intersects(rect, area)) {
+        return;
+    }
+
+    int x0, y0, x1, y1;
+    cellRange(rect, x0, y0, x1, y1);
+
+    std::vector<int> indices;
+    for (int y = y0; y <= y1; ++y) {
+        for (int x = x0; x <= x1; ++x) {
+            int cell = y * cols + x;
+            for (int i = cellOffsets[cell]; i < cellOffsets[cell + 1]; ++i) {
+                int index = cellIndices[i];
+                if (intersects(rect, paths[index]->bounds)) {
+                    indices.push_back(index);
+                }
+            }
+        }
+    }
+
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+    for (int index : indices) {
+        results.push_back(paths[index]);
+    }
+}
+
+void PathIndex::query(const cv::Point2f &point, std::vector<Path *> &results) const
+{
+    query(cv::Rect2f(point.x, point.y, 0, 0), results);
+}
+
+void PathIndex::cellRange(const cv::Rect2f &rect, int &x0, int &y0, int &x1, int &y1) const
+{
+    x0 = MAX(0, MIN(cols - 1, (int)floor((rect.x - area.x) / cellSize)));
+    y0 = MAX(0, MIN(rows - 1, (int)floor((rect.y - area.y) / cellSize)));
+    x1 = MAX(0, MIN(cols - 1, (int)floor((rect.x + rect.width - area.x) / cellSize)));
+    y1 = MAX(0, MIN(rows - 1, (int)floor((rect.y + rect.height - area.y) / cellSize)));
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+#include <vector>
+
+namespace illustrace {
+
+struct Path;
+
+class PathIndex {
+public:
+    PathIndex();
+
+    void build(const std::vector<Path *> &paths);
+    void clear();
+
+    void query(const cv::Rect2f &rect, std::vector<Path *> &results) const;
+    void query(const cv::Point2f &point, std::vector<Path *> &results) const;
+
+private:
+    std::vector<Path *> paths;
+    cv::Rect2f area;
+    float cellSize;
+    int cols;
+    int rows;
+    std::vector<int> cellOffsets;
+    std::vector<int> cellIndices;
+
+    void cellRange(const cv::Rect2f &rect, int &x0, int &y0, int &x1, int &y1) const;
+};
+
+} // namespace illustrace
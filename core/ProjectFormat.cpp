@@ -0,0 +1,505 @@
+#include "ProjectFormat.h"
+
+#include <cstring>
+#include <climits>
+
+using namespace illustrace;
+
+// Every section is a flat little-endian block so that it can be decoded straight out
+// of a mapped file. Images are run-length encoded as a count array followed by a value array.
+
+const char ProjectFormat::Magic[4] = {'I', 'L', 'T', 'R'};
+
+struct ImageHeader {
+    int32_t rows;
+    int32_t cols;
+    int32_t type;
+    uint32_t runCount;
+};
+
+struct PathRecord {
+    int32_t parent;
+    uint32_t segmentCount;
+    uint8_t closed;
+    uint8_t hasColor;
+    uint8_t reserved[6];
+    float bounds[4];
+    double color[4];
+};
+
+struct SegmentRecord {
+    int32_t type;
+    float p[6];
+};
+
+// The runs must fit in the section and can cover at most UINT32_MAX pixels each, so a header of
+// a broken file is rejected before anything is allocated. cv::Mat counts pixels in int.
+static bool validImageHeader(const ImageHeader &header, size_t size)
+{
+    uint64_t total = (uint64_t)header.rows * header.cols;
+    return INT_MAX >= total
+        && (size - sizeof(header)) / (sizeof(uint32_t) + CV_ELEM_SIZE(header.type)) >= header.runCount
+        && total <= (uint64_t)header.runCount * UINT32_MAX;
+}
+
+class Cursor {
+public:
+    Cursor(const uchar *data, size_t size) : data(data), size(size), position(0) {}
+
+    bool read(void *dst, size_t length) {
+        if (size - position < length) {
+            return false;
+        }
+        if (0 < length) {
+            memcpy(dst, data + position, length);
+        }
+        position += length;
+        return true;
+    }
+
+    const uchar *take(size_t length) {
+        if (size - position < length) {
+            return nullptr;
+        }
+        const uchar *p = data + position;
+        position += length;
+        return p;
+    }
+
+private:
+    const uchar *data;
+    size_t size;
+    size_t position;
+};
+
+static inline void append(std::vector<uchar> &buffer, const void *data, size_t length)
+{
+    const uchar *p = (const uchar *)data;
+    buffer.insert(buffer.end(), p, p + length);
+}
+
+template<typename T>
+static void encodeRuns(const cv::Mat &image, std::vector<uint32_t> &counts, std::vector<T> &values)
+{
+    for (int y = 0; y < image.rows; ++y) {
+        const T *row = image.ptr<T>(y);
+        int x = 0;
+
+        while (x < image.cols) {
+            T value = row[x];
+            int x0 = x;
+            for (; x < image.cols && row[x] == value; ++x);
+
+            if (!values.empty() && values.back() == value) {
+                counts.back() += x - x0;
+            }
+            else {
+                counts.push_back(x - x0);
+                values.push_back(value);
+            }
+        }
+    }
+}
+
+template<typename T>
+static bool decodeRuns(Cursor &cursor, uint32_t runCount, cv::Mat &image)
+{
+    const uchar *counts = cursor.take(runCount * sizeof(uint32_t));
+    const uchar *values = cursor.take(runCount * sizeof(T));
+    if (!counts || !values) {
+        return false;
+    }
+
+    T *data = (T *)image.data;
+    T *end = data + image.total();
+
+    for (uint32_t i = 0; i < runCount; ++i) {
+        uint32_t count;
+        T value;
+        memcpy(&count, counts + i * sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&value, values + i * sizeof(T), sizeof(T));
+
+        if (end - data < count) {
+            return false;
+        }
+        std::fill(data, data + count, value);
+        data += count;
+    }
+
+    return data == end;
+}
+
+void ProjectFormat::encodeParameters(Document *document, std::vector<uchar> &buffer)
+{
+    DocumentParameters parameters;
+    memset(&parameters, 0, sizeof(parameters));
+
+    parameters.brightness = document->brightness();
+    parameters.blur = document->blur();
+    parameters.detail = document->detail();
+    parameters.smoothing = document->smoothing();
+    parameters.thickness = document->thickness();
+    parameters.rotation = document->rotation();
+
+    for (int i = 0; i < 4; ++i) {
+        parameters.color[i] = document->color()[i];
+        parameters.backgroundColor[i] = document->backgroundColor()[i];
+    }
+
+    cv::Rect *rects[] = {&document->contentRect(), &document->clippingRect(), &document->boundingRect(), &document->traceRect()};
+    int32_t *dsts[] = {parameters.contentRect, parameters.clippingRect, parameters.boundingRect, parameters.traceRect};
+    for (int i = 0; i < 4; ++i) {
+        dsts[i][0] = rects[i]->x;
+        dsts[i][1] = rects[i]->y;
+        dsts[i][2] = rects[i]->width;
+        dsts[i][3] = rects[i]->height;
+    }
+
+    parameters.negative = document->negative();
+    parameters.backgroundEnable = document->backgroundEnable();
+    parameters.fitting = document->fitting();
+    parameters.despeckle = document->despeckle();
+
+    append(buffer, &parameters, sizeof(parameters));
+}
+
+bool ProjectFormat::decodeParameters(const uchar *data, size_t size, DocumentParameters &parameters)
+{
+    Cursor cursor(data, size);
+    return cursor.read(&parameters, sizeof(parameters));
+}
+
+void ProjectFormat::encodeImage(const cv::Mat &image, std::vector<uchar> &buffer)
+{
+    CV_Assert(1 == image.elemSize() || 4 == image.elemSize() || image.empty());
+
+    std::vector<uint32_t> counts;
+    std::vector<uchar> values;
+
+    if (1 == image.elemSize()) {
+        encodeRuns<uchar>(image, counts, values);
+    }
+    else if (4 == image.elemSize()) {
+        std::vector<uint32_t> words;
+        encodeRuns<uint32_t>(image, counts, words);
+        append(values, words.data(), words.size() * sizeof(uint32_t));
+    }
+
+    ImageHeader header = {image.rows, image.cols, image.type(), (uint32_t)counts.size()};
+    append(buffer, &header, sizeof(header));
+    append(buffer, counts.data(), counts.size() * sizeof(uint32_t));
+    append(buffer, values.data(), values.size());
+}
+
+bool ProjectFormat::decodeImage(const uchar *data, size_t size, cv::Mat &image)
+{
+    Cursor cursor(data, size);
+    ImageHeader header;
+
+    if (!cursor.read(&header, sizeof(header)) || 0 > header.rows || 0 > header.cols) {
+        return false;
+    }
+
+    if (0 == header.rows || 0 == header.cols) {
+        image = cv::Mat();
+        return 0 == header.runCount;
+    }
+
+    if ((CV_8UC1 != header.type && CV_8UC4 != header.type) || !validImageHeader(header, size)) {
+        return false;
+    }
+
+    image.create(header.rows, header.cols, header.type);
+
+    switch (image.elemSize()) {
+    case 1:
+        return decodeRuns<uchar>(cursor, header.runCount, image);
+    case 4:
+        return decodeRuns<uint32_t>(cursor, header.runCount, image);
+    default:
+        return false;
+    }
+}
+
+// Layers are written as a dense CV_8UC4 image in the colors of the palette, absent tiles as
+// transparent runs. When read, only the runs of other colors allocate tiles, and their colors
+// are entered into the palette; a layer of more colors than the palette holds is rejected.
+void ProjectFormat::encodeLayer(const TiledLayer &layer, const Palette &palette, std::vector<uchar> &buffer)
+{
+    std::vector<uint32_t> counts;
+    std::vector<uint32_t> values;
+
+    auto run = [&](uint32_t value, uint32_t count) {
+        if (!values.empty() && values.back() == value) {
+            counts.back() += count;
+        }
+        else {
+            counts.push_back(count);
+            values.push_back(value);
+        }
+    };
+
+    for (int y = 0; y < layer.rows; ++y) {
+        int row = y / TiledLayer::TileSize;
+        int yOffset = y % TiledLayer::TileSize * TiledLayer::TileSize;
+
+        for (int col = 0; col < layer.tileCols(); ++col) {
+            int width = layer.tileRect(col, row).width;
+            const uint8_t *data = layer.tile(col, row);
+
+            if (!data) {
+                run(0, width);
+                continue;
+            }
+
+            for (int x = 0; x < width; ++x) {
+                run(palette.color(data[yOffset + x]), 1);
+            }
+        }
+    }
+
+    ImageHeader header = {layer.rows, layer.cols, CV_8UC4, (uint32_t)counts.size()};
+    append(buffer, &header, sizeof(header));
+    append(buffer, counts.data(), counts.size() * sizeof(uint32_t));
+    append(buffer, values.data(), values.size() * sizeof(uint32_t));
+}
+
+bool ProjectFormat::decodeLayer(const uchar *data, size_t size, TiledLayer &layer, Palette &palette)
+{
+    Cursor cursor(data, size);
+    ImageHeader header;
+
+    if (!cursor.read(&header, sizeof(header)) || 0 > header.rows || 0 > header.cols) {
+        return false;
+    }
+
+    if (0 == header.rows || 0 == header.cols) {
+        layer = TiledLayer();
+        return 0 == header.runCount;
+    }
+
+    if (CV_8UC4 != header.type || !validImageHeader(header, size)) {
+        return false;
+    }
+
+    const uchar *counts = cursor.take(header.runCount * sizeof(uint32_t));
+    const uchar *values = cursor.take(header.runCount * sizeof(uint32_t));
+    if (!counts || !values) {
+        return false;
+    }
+
+    layer = TiledLayer(header.rows, header.cols);
+
+    uint64_t position = 0;
+    uint64_t end = (uint64_t)header.rows * header.cols;
+
+    for (uint32_t i = 0; i < header.runCount; ++i) {
+        uint32_t count;
+        uint32_t value;
+        memcpy(&count, counts + i * sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&value, values + i * sizeof(uint32_t), sizeof(uint32_t));
+
+        if (end - position < count) {
+            return false;
+        }
+
+        uint8_t index;
+        if (!palette.index(value, index)) {
+            return false;
+        }
+
+        for (uint64_t last = position + count; position < last;) {
+            int y = position / header.cols;
+            int x = position % header.cols;
+            int length = MIN(last - position, (uint64_t)(header.cols - x));
+            layer.fill(y, x, x + length, index);
+            position += length;
+        }
+    }
+
+    return position == end;
+}
+
+// The section is laid out as FlatContours holds the contours, so both directions are plain copies.
+template<typename T>
+void ProjectFormat::encodeContours(const FlatContours<T> &contours, std::vector<uchar> &buffer)
+{
+    static_assert(sizeof(int) == sizeof(uint32_t), "offsets are written as uint32_t");
+
+    uint32_t count = contours.size();
+    uint32_t pointCount = contours.points.size();
+
+    append(buffer, &count, sizeof(count));
+    append(buffer, &pointCount, sizeof(pointCount));
+    append(buffer, contours.offsets.data(), contours.offsets.size() * sizeof(uint32_t));
+    append(buffer, contours.points.data(), pointCount * sizeof(T));
+}
+
+template<typename T>
+bool ProjectFormat::decodeContours(const uchar *data, size_t size, FlatContours<T> &contours)
+{
+    Cursor cursor(data, size);
+    uint32_t count, pointCount;
+
+    if (!cursor.read(&count, sizeof(count)) || !cursor.read(&pointCount, sizeof(pointCount)) || size / sizeof(uint32_t) < count) {
+        return false;
+    }
+
+    contours.offsets.resize(count + 1);
+    if (!cursor.read(contours.offsets.data(), contours.offsets.size() * sizeof(uint32_t))) {
+        return false;
+    }
+
+    const uchar *points = cursor.take(pointCount * sizeof(T));
+    if (!points || 0 > contours.offsets[0] || pointCount != (uint32_t)contours.offsets[count]) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        if (contours.offsets[i + 1] < contours.offsets[i]) {
+            return false;
+        }
+    }
+
+    contours.points.resize(pointCount);
+    if (0 < pointCount) {
+        memcpy(contours.points.data(), points, pointCount * sizeof(T));
+    }
+
+    return true;
+}
+
+template void ProjectFormat::encodeContours<cv::Point>(const FlatContours<cv::Point> &, std::vector<uchar> &);
+template void ProjectFormat::encodeContours<cv::Point2f>(const FlatContours<cv::Point2f> &, std::vector<uchar> &);
+template bool ProjectFormat::decodeContours<cv::Point>(const uchar *, size_t, FlatContours<cv::Point> &);
+template bool ProjectFormat::decodeContours<cv::Point2f>(const uchar *, size_t, FlatContours<cv::Point2f> &);
+
+void ProjectFormat::encodeHierarchy(const std::vector<cv::Vec4i> &hierarchy, std::vector<uchar> &buffer)
+{
+    uint32_t count = hierarchy.size();
+    append(buffer, &count, sizeof(count));
+    append(buffer, hierarchy.data(), count * sizeof(cv::Vec4i));
+}
+
+bool ProjectFormat::decodeHierarchy(const uchar *data, size_t size, std::vector<cv::Vec4i> &hierarchy)
+{
+    Cursor cursor(data, size);
+    uint32_t count;
+
+    if (!cursor.read(&count, sizeof(count)) || size / sizeof(cv::Vec4i) < count) {
+        return false;
+    }
+
+    hierarchy.resize(count);
+    return cursor.read(hierarchy.data(), count * sizeof(cv::Vec4i));
+}
+
+static void flattenPaths(Path *path, int parent, std::vector<PathRecord> &records, std::vector<SegmentRecord> &segments)
+{
+    PathRecord record;
+    memset(&record, 0, sizeof(record));
+
+    record.parent = parent;
+    record.segmentCount = path->segments.size();
+    record.closed = path->closed;
+    record.hasColor = nullptr != path->color;
+    record.bounds[0] = path->bounds.x;
+    record.bounds[1] = path->bounds.y;
+    record.bounds[2] = path->bounds.width;
+    record.bounds[3] = path->bounds.height;
+    if (path->color) {
+        for (int i = 0; i < 4; ++i) {
+            record.color[i] = (*path->color)[i];
+        }
+    }
+
+    int index = records.size();
+    records.push_back(record);
+
+    for (Segment &s : path->segments) {
+        SegmentRecord segment = {s.type, {s[0].x, s[0].y, s[1].x, s[1].y, s[2].x, s[2].y}};
+        segments.push_back(segment);
+    }
+
+    for (Path *child : path->children) {
+        flattenPaths(child, index, records, segments);
+    }
+}
+
+void ProjectFormat::encodePaths(const std::vector<Path *> &paths, std::vector<uchar> &buffer)
+{
+    std::vector<PathRecord> records;
+    std::vector<SegmentRecord> segments;
+
+    for (Path *path : paths) {
+        flattenPaths(path, -1, records, segments);
+    }
+
+    uint32_t counts[2] = {(uint32_t)records.size(), (uint32_t)segments.size()};
+    append(buffer, counts, sizeof(counts));
+    append(buffer, records.data(), records.size() * sizeof(PathRecord));
+    append(buffer, segments.data(), segments.size() * sizeof(SegmentRecord));
+}
+
+bool ProjectFormat::decodePaths(const uchar *data, size_t size, std::vector<Path *> &paths)
+{
+    Cursor cursor(data, size);
+    uint32_t counts[2];
+
+    if (!cursor.read(counts, sizeof(counts)) || size / sizeof(PathRecord) < counts[0] || size / sizeof(SegmentRecord) < counts[1]) {
+        return false;
+    }
+
+    std::vector<PathRecord> records(counts[0]);
+    std::vector<SegmentRecord> segments(counts[1]);
+    if (!cursor.read(records.data(), records.size() * sizeof(PathRecord))
+            || !cursor.read(segments.data(), segments.size() * sizeof(SegmentRecord))) {
+        return false;
+    }
+
+    for (SegmentRecord &segment : segments) {
+        if (Segment::Type::Move > segment.type || Segment::Type::Curve < segment.type) {
+            return false;
+        }
+    }
+
+    std::vector<Path *> all;
+    all.reserve(records.size());
+    uint32_t segmentIndex = 0;
+
+    for (PathRecord &record : records) {
+        if (record.parent >= (int)all.size() || counts[1] - segmentIndex < record.segmentCount) {
+            for (Path *path : all) {
+                delete path;
+            }
+            paths.clear();
+            return false;
+        }
+
+        Path *path = new Path();
+        path->closed = record.closed;
+        path->bounds = cv::Rect2f(record.bounds[0], record.bounds[1], record.bounds[2], record.bounds[3]);
+        if (record.hasColor) {
+            path->color = new cv::Scalar(record.color[0], record.color[1], record.color[2], record.color[3]);
+        }
+
+        path->segments.resize(record.segmentCount);
+        for (Segment &s : path->segments) {
+            SegmentRecord &segment = segments[segmentIndex++];
+            s.type = (Segment::Type)segment.type;
+            for (int i = 0; i < 3; ++i) {
+                s[i] = cv::Point2f(segment.p[i * 2], segment.p[i * 2 + 1]);
+            }
+        }
+
+        if (0 > record.parent) {
+            paths.push_back(path);
+        }
+        else {
+            all[record.parent]->children.push_back(path);
+        }
+        all.push_back(path);
+    }
+
+    return true;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "Document.h"
+
+#include <vector>
+#include <cstdint>
+
+namespace illustrace {
+
+class ProjectFormat {
+public:
+    static const char Magic[4];
+    static const uint32_t Version = 1;
+
+    enum Tag : uint32_t {
+        Parameters = 1,
+        BinarizedImage,
+        NegativeImage,
+        PreprocessedImage,
+        PaintLayer,
+        PaintMask,
+        OutlineContours,
+        ApproximatedOutlineContours,
+        OutlineHierarchy,
+        Paths,
+        PaintPaths,
+    };
+
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t sectionCount;
+        uint32_t reserved;
+    };
+
+    struct Section {
+        uint32_t tag;
+        uint32_t reserved;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    struct DocumentParameters {
+        double brightness;
+        double blur;
+        double detail;
+        double smoothing;
+        double thickness;
+        double rotation;
+        double color[4];
+        double backgroundColor[4];
+        int32_t contentRect[4];
+        int32_t clippingRect[4];
+        int32_t boundingRect[4];
+        int32_t traceRect[4];
+        uint8_t negative;
+        uint8_t backgroundEnable;
+        uint8_t fitting;
+        uint8_t reserved;
+        float despeckle;
+    };
+
+    static void encodeParameters(Document *document, std::vector<uchar> &buffer);
+    static bool decodeParameters(const uchar *data, size_t size, DocumentParameters &parameters);
+
+    static void encodeImage(const cv::Mat &image, std::vector<uchar> &buffer);
+    static bool decodeImage(const uchar *data, size_t size, cv::Mat &image);
+    static void encodeLayer(const TiledLayer &layer, const Palette &palette, std::vector<uchar> &buffer);
+    static bool decodeLayer(const uchar *data, size_t size, TiledLayer &layer, Palette &palette);
+
+    template<typename T>
+    static void encodeContours(const FlatContours<T> &contours, std::vector<uchar> &buffer);
+    template<typename T>
+    static bool decodeContours(const uchar *data, size_t size, FlatContours<T> &contours);
+
+    static void encodeHierarchy(const std::vector<cv::Vec4i> &hierarchy, std::vector<uchar> &buffer);
+    static bool decodeHierarchy(const uchar *data, size_t size, std::vector<cv::Vec4i> &hierarchy);
+
+    static void encodePaths(const std::vector<Path *> &paths, std::vector<uchar> &buffer);
+    static bool decodePaths(const uchar *data, size_t size, std::vector<Path *> &paths);
+};
+
+} // namespace illustrace
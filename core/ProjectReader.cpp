@@ -0,0 +1,303 @@
+#include "ProjectReader.h"
+#include "ProjectFormat.h"
+#include "Filter.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace illustrace;
+
+// The file is mapped and every section is decoded in place, then handed to the document.
+// Nothing of the trace pipeline runs; only the region map is rebuilt from the paint mask.
+
+struct ProjectData {
+    ProjectFormat::DocumentParameters parameters;
+    cv::Mat negativeImage;
+    cv::Mat preprocessedImage;
+    TiledLayer paintLayer;
+    Palette paintPalette;
+    cv::Mat paintMask;
+    FlatContours<cv::Point> *outlineContours;
+    FlatContours<cv::Point2f> *approximatedOutlineContours;
+    std::vector<Path *> *paths;
+    std::vector<Path *> *paintPaths;
+
+    ProjectData() :
+        outlineContours(new FlatContours<cv::Point>()),
+        approximatedOutlineContours(new FlatContours<cv::Point2f>()),
+        paths(new std::vector<Path *>()),
+        paintPaths(new std::vector<Path *>())
+    {
+    }
+
+    ~ProjectData() {
+        delete outlineContours;
+        delete approximatedOutlineContours;
+        if (paths) {
+            for (Path *path : *paths) {
+                delete path;
+            }
+            delete paths;
+        }
+        if (paintPaths) {
+            for (Path *path : *paintPaths) {
+                delete path;
+            }
+            delete paintPaths;
+        }
+    }
+};
+
+static bool decode(const uchar *data, size_t size, ProjectData &project);
+static bool validate(ProjectData &project);
+static bool validatePaths(const std::vector<Path *> &paths, const cv::Rect2f &limit);
+static void apply(ProjectData &project, Document *document);
+
+bool ProjectReader::read(const char *filepath, Document *document)
+{
+    int fd = open(filepath, O_RDONLY);
+    if (-1 == fd) {
+        return false;
+    }
+
+    struct stat st;
+    if (0 != fstat(fd, &st) || sizeof(ProjectFormat::Header) > st.st_size) {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map) {
+        return false;
+    }
+
+    ProjectData project;
+    bool ret;
+
+    // A broken file may still make an allocation fail
+    try {
+        ret = decode((const uchar *)map, st.st_size, project) && validate(project);
+    } catch (const std::exception &) {
+        ret = false;
+    }
+    munmap(map, st.st_size);
+
+    if (ret) {
+        apply(project, document);
+    }
+
+    return ret;
+}
+
+// Local functions
+
+static bool decode(const uchar *data, size_t size, ProjectData &project)
+{
+    ProjectFormat::Header header;
+    memcpy(&header, data, sizeof(header));
+
+    if (0 != memcmp(header.magic, ProjectFormat::Magic, sizeof(header.magic)) || ProjectFormat::Version != header.version) {
+        return false;
+    }
+
+    if ((size - sizeof(header)) / sizeof(ProjectFormat::Section) < header.sectionCount) {
+        return false;
+    }
+
+    bool hasParameters = false;
+
+    for (uint32_t i = 0; i < header.sectionCount; ++i) {
+        ProjectFormat::Section section;
+        memcpy(&section, data + sizeof(header) + i * sizeof(section), sizeof(section));
+
+        if (size < section.offset || size - section.offset < section.size) {
+            return false;
+        }
+
+        const uchar *p = data + section.offset;
+        size_t length = section.size;
+        bool ret = true;
+
+        switch (section.tag) {
+        case ProjectFormat::Tag::Parameters:
+            ret = hasParameters = ProjectFormat::decodeParameters(p, length, project.parameters);
+            break;
+        case ProjectFormat::Tag::NegativeImage:
+            ret = ProjectFormat::decodeImage(p, length, project.negativeImage);
+            break;
+        case ProjectFormat::Tag::PreprocessedImage:
+            ret = ProjectFormat::decodeImage(p, length, project.preprocessedImage);
+            break;
+        case ProjectFormat::Tag::PaintLayer:
+            ret = ProjectFormat::decodeLayer(p, length, project.paintLayer, project.paintPalette);
+            break;
+        case ProjectFormat::Tag::PaintMask:
+            ret = ProjectFormat::decodeImage(p, length, project.paintMask);
+            break;
+        case ProjectFormat::Tag::OutlineContours:
+            ret = ProjectFormat::decodeContours(p, length, *project.outlineContours);
+            break;
+        case ProjectFormat::Tag::ApproximatedOutlineContours:
+            ret = ProjectFormat::decodeContours(p, length, *project.approximatedOutlineContours);
+            break;
+        case ProjectFormat::Tag::OutlineHierarchy:
+            ret = ProjectFormat::decodeHierarchy(p, length, project.outlineContours->hierarchy);
+            break;
+        case ProjectFormat::Tag::Paths:
+            ret = ProjectFormat::decodePaths(p, length, *project.paths);
+            break;
+        case ProjectFormat::Tag::PaintPaths:
+            ret = ProjectFormat::decodePaths(p, length, *project.paintPaths);
+            break;
+        default:
+            // Unknown sections from newer writers are skipped
+            break;
+        }
+
+        if (!ret) {
+            return false;
+        }
+    }
+
+    return hasParameters;
+}
+
+// Every image and layer is the size of the content rect or empty, and the other rects lie in it,
+// so a document built from the sections is as consistent as a traced one.
+static bool validate(ProjectData &project)
+{
+    ProjectFormat::DocumentParameters &parameters = project.parameters;
+    cv::Rect contentRect(parameters.contentRect[0], parameters.contentRect[1], parameters.contentRect[2], parameters.contentRect[3]);
+    cv::Rect clippingRect(parameters.clippingRect[0], parameters.clippingRect[1], parameters.clippingRect[2], parameters.clippingRect[3]);
+    cv::Rect traceRect(parameters.traceRect[0], parameters.traceRect[1], parameters.traceRect[2], parameters.traceRect[3]);
+
+    // In 64 bits, as the sums of broken rects overflow int
+    auto inside = [&](const cv::Rect &rect) {
+        return 0 <= rect.x && 0 <= rect.y && 0 <= rect.width && 0 <= rect.height
+            && (int64_t)rect.x + rect.width <= contentRect.width && (int64_t)rect.y + rect.height <= contentRect.height;
+    };
+
+    if (0 != contentRect.x || 0 != contentRect.y || !inside(contentRect) || !inside(clippingRect) || !inside(traceRect)) {
+        return false;
+    }
+
+    cv::Mat *images[] = {&project.negativeImage, &project.preprocessedImage, &project.paintMask};
+    for (cv::Mat *image : images) {
+        if (!image->empty() && (CV_8UC1 != image->type() || contentRect.size() != image->size())) {
+            return false;
+        }
+    }
+
+    if (!project.paintLayer.empty() && contentRect.size() != project.paintLayer.size()) {
+        return false;
+    }
+
+    std::vector<cv::Vec4i> &hierarchy = project.outlineContours->hierarchy;
+    int count = project.outlineContours->size();
+
+    if (hierarchy.size() != count
+            || (!project.approximatedOutlineContours->empty() && project.approximatedOutlineContours->size() != count)) {
+        return false;
+    }
+
+    for (cv::Vec4i &entry : hierarchy) {
+        for (int i = 0; i < 4; ++i) {
+            if (-1 > entry[i] || count <= entry[i]) {
+                return false;
+            }
+        }
+    }
+
+    // Control points may lie off the content, but not by more than its size
+    float margin = MAX(contentRect.width, contentRect.height);
+    cv::Rect2f limit(-margin, -margin, contentRect.width + margin * 2, contentRect.height + margin * 2);
+    return validatePaths(*project.paths, limit) && validatePaths(*project.paintPaths, limit);
+}
+
+static bool validatePaths(const std::vector<Path *> &paths, const cv::Rect2f &limit)
+{
+    // NaN fails every comparison
+    auto inside = [&](const cv::Point2f &p) {
+        return limit.x <= p.x && p.x <= limit.x + limit.width && limit.y <= p.y && p.y <= limit.y + limit.height;
+    };
+
+    for (Path *path : paths) {
+        const cv::Rect2f &bounds = path->bounds;
+        if (!(0.0f <= bounds.width && 0.0f <= bounds.height && inside(bounds.tl()) && inside(bounds.br()))) {
+            return false;
+        }
+
+        for (Segment &segment : path->segments) {
+            if (!inside(segment[0]) || !inside(segment[1]) || !inside(segment[2])) {
+                return false;
+            }
+        }
+
+        if (!validatePaths(path->children, limit)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void apply(ProjectData &project, Document *document)
+{
+    ProjectFormat::DocumentParameters &parameters = project.parameters;
+
+    document->brightness(parameters.brightness);
+    document->negative(parameters.negative);
+    document->blur(parameters.blur);
+    document->despeckle(parameters.despeckle);
+    document->detail(parameters.detail);
+    document->smoothing(parameters.smoothing);
+    document->fitting(Document::FittingMode::LeastSquares == parameters.fitting ? Document::FittingMode::LeastSquares : Document::FittingMode::Spline);
+    document->thickness(parameters.thickness);
+    document->rotation(parameters.rotation);
+
+    cv::Scalar color(parameters.color[0], parameters.color[1], parameters.color[2], parameters.color[3]);
+    document->color(color);
+    cv::Scalar backgroundColor(parameters.backgroundColor[0], parameters.backgroundColor[1], parameters.backgroundColor[2], parameters.backgroundColor[3]);
+    document->backgroundColor(backgroundColor);
+    document->backgroundEnable(parameters.backgroundEnable);
+
+    cv::Rect contentRect(parameters.contentRect[0], parameters.contentRect[1], parameters.contentRect[2], parameters.contentRect[3]);
+    cv::Rect clippingRect(parameters.clippingRect[0], parameters.clippingRect[1], parameters.clippingRect[2], parameters.clippingRect[3]);
+    cv::Rect boundingRect(parameters.boundingRect[0], parameters.boundingRect[1], parameters.boundingRect[2], parameters.boundingRect[3]);
+    cv::Rect traceRect(parameters.traceRect[0], parameters.traceRect[1], parameters.traceRect[2], parameters.traceRect[3]);
+    document->contentRect(contentRect);
+    document->clippingRect(clippingRect);
+    document->boundingRect(boundingRect);
+    document->traceRect(traceRect);
+
+    cv::Mat binarizedImage = project.negativeImage.clone();
+    Filter::negative(binarizedImage);
+    document->binarizedImage(binarizedImage);
+    document->negativeImage(project.negativeImage);
+    document->preprocessedImage(project.preprocessedImage);
+    document->paintLayer(project.paintLayer);
+    document->paintPalette(project.paintPalette);
+
+    if (!project.approximatedOutlineContours->empty()) {
+        project.approximatedOutlineContours->hierarchy = project.outlineContours->hierarchy;
+    }
+
+    document->outlineContours(project.outlineContours);
+    document->approximatedOutlineContours(project.approximatedOutlineContours);
+    document->paths(project.paths);
+    document->paintPaths(project.paintPaths);
+
+    if (!project.paintMask.empty()) {
+        document->regionMap().build(project.paintMask);
+        document->paintMask(project.paintMask);
+    }
+
+    project.outlineContours = nullptr;
+    project.approximatedOutlineContours = nullptr;
+    project.paths = nullptr;
+    project.paintPaths = nullptr;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "Document.h"
+
+namespace illustrace {
+
+class ProjectReader {
+public:
+    static bool read(const char *filepath, Document *document);
+};
+
+} // namespace illustrace
@@ -0,0 +1,112 @@
+#include "ProjectWriter.h"
+#include "ProjectFormat.h"
+#include "Util.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#define SECTION_ALIGNMENT 8
+
+using namespace illustrace;
+
+typedef std::vector<std::pair<ProjectFormat::Tag, std::vector<uchar>>> Sections;
+
+static bool writeSections(const char *filepath, Sections &sections);
+
+// A paint mask not up to date with the paths is written empty, and built again by the reader's
+// first paint.
+bool ProjectWriter::write(const char *filepath, Document *document)
+{
+    Sections sections;
+    bool paintMaskValid = !document->paintMaskStale() && document->paintMaskDirtyRects().empty();
+    cv::Mat paintMask = paintMaskValid ? document->paintMask() : cv::Mat();
+
+    auto section = [&](ProjectFormat::Tag tag) -> std::vector<uchar> & {
+        sections.push_back(std::make_pair(tag, std::vector<uchar>()));
+        return sections.back().second;
+    };
+
+    ProjectFormat::encodeParameters(document, section(ProjectFormat::Tag::Parameters));
+    ProjectFormat::encodeImage(document->negativeImage(), section(ProjectFormat::Tag::NegativeImage));
+    ProjectFormat::encodeImage(document->preprocessedImage(), section(ProjectFormat::Tag::PreprocessedImage));
+    ProjectFormat::encodeLayer(document->paintLayer(), document->paintPalette(), section(ProjectFormat::Tag::PaintLayer));
+    ProjectFormat::encodeImage(paintMask, section(ProjectFormat::Tag::PaintMask));
+    ProjectFormat::encodeContours(*document->outlineContours(), section(ProjectFormat::Tag::OutlineContours));
+    ProjectFormat::encodeContours(*document->approximatedOutlineContours(), section(ProjectFormat::Tag::ApproximatedOutlineContours));
+    ProjectFormat::encodeHierarchy(document->outlineContours()->hierarchy, section(ProjectFormat::Tag::OutlineHierarchy));
+    ProjectFormat::encodePaths(*document->paths(), section(ProjectFormat::Tag::Paths));
+    ProjectFormat::encodePaths(*document->paintPaths(), section(ProjectFormat::Tag::PaintPaths));
+
+    return writeSections(filepath, sections);
+}
+
+// Only the state up to the outline contours. A reader gets empty approximated contours,
+// paths and paint mask, which are rebuilt from the contours.
+bool ProjectWriter::writeContours(const char *filepath, Document *document)
+{
+    Sections sections;
+
+    auto section = [&](ProjectFormat::Tag tag) -> std::vector<uchar> & {
+        sections.push_back(std::make_pair(tag, std::vector<uchar>()));
+        return sections.back().second;
+    };
+
+    ProjectFormat::encodeParameters(document, section(ProjectFormat::Tag::Parameters));
+    ProjectFormat::encodeImage(document->negativeImage(), section(ProjectFormat::Tag::NegativeImage));
+    ProjectFormat::encodeImage(document->preprocessedImage(), section(ProjectFormat::Tag::PreprocessedImage));
+    ProjectFormat::encodeLayer(document->paintLayer(), document->paintPalette(), section(ProjectFormat::Tag::PaintLayer));
+    ProjectFormat::encodeContours(*document->outlineContours(), section(ProjectFormat::Tag::OutlineContours));
+    ProjectFormat::encodeHierarchy(document->outlineContours()->hierarchy, section(ProjectFormat::Tag::OutlineHierarchy));
+
+    return writeSections(filepath, sections);
+}
+
+// Local functions
+
+// The project is written to a temporary file first, synced, and renamed over the target,
+// so an interrupted save or a power loss never leaves a broken project behind.
+static bool writeSections(const char *filepath, Sections &sections)
+{
+    ProjectFormat::Header header;
+    memcpy(header.magic, ProjectFormat::Magic, sizeof(header.magic));
+    header.version = ProjectFormat::Version;
+    header.sectionCount = sections.size();
+    header.reserved = 0;
+
+    std::vector<ProjectFormat::Section> table;
+    uint64_t offset = sizeof(header) + sections.size() * sizeof(ProjectFormat::Section);
+
+    for (auto &entry : sections) {
+        offset = (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+        table.push_back((ProjectFormat::Section){entry.first, 0, offset, entry.second.size()});
+        offset += entry.second.size();
+    }
+
+    std::string tmpFilepath = std::string(filepath) + ".tmp";
+    FILE *fp = fopen(tmpFilepath.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+
+    bool ret = 1 == fwrite(&header, sizeof(header), 1, fp)
+        && table.size() == fwrite(table.data(), sizeof(ProjectFormat::Section), table.size(), fp);
+
+    static const uchar padding[SECTION_ALIGNMENT] = {0};
+
+    for (int i = 0; ret && i < sections.size(); ++i) {
+        long position = ftell(fp);
+        ret = table[i].offset - position == fwrite(padding, 1, table[i].offset - position, fp)
+            && sections[i].second.size() == fwrite(sections[i].second.data(), 1, sections[i].second.size(), fp);
+    }
+
+    ret = ret && 0 == fflush(fp) && util::syncFile(fileno(fp));
+    ret = 0 == fclose(fp) && ret;
+
+    if (!ret || 0 != rename(tmpFilepath.c_str(), filepath)) {
+        remove(tmpFilepath.c_str());
+        return false;
+    }
+
+    return util::syncDirectory(filepath);
+}
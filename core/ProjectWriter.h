@@ -0,0 +1,13 @@
+#pragma once
+
+#include "Document.h"
+
+namespace illustrace {
+
+class ProjectWriter {
+public:
+    static bool write(const char *filepath, Document *document);
+    static bool writeContours(const char *filepath, Document *document);
+};
+
+} // namespace illustrace
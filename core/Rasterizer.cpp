@@ -0,0 +1,294 @@
+#include "Rasterizer.h"
+
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <algorithm>
+
+#define FLATTENING_TOLERANCE 0.1
+#define MAXIMUM_CURVE_STEPS 256
+
+using namespace illustrace;
+
+// Binary 8-bit rasterizer for the paint mask. A pixel is set to 255 when its center is covered,
+// so the result does not depend on how the mask is split into clip rects.
+
+struct Edge {
+    double y0;
+    double y1;
+    double x0;
+    double dxdy;
+};
+
+template<class P>
+static void flattenPath(const P *path, std::vector<Rasterizer::Polyline> &polylines);
+static void flattenCurve(cv::Point2f p0, const cv::Point2f &p1, const cv::Point2f &p2, const cv::Point2f &p3, Rasterizer::Polyline &polyline);
+static void fillSpan(uchar *row, const cv::Rect &clip, double x0, double x1);
+
+void Rasterizer::flatten(Path *path, std::vector<Polyline> &polylines)
+{
+    polylines.clear();
+    flattenPath(path, polylines);
+}
+
+void Rasterizer::flatten(PackedPath *path, std::vector<Polyline> &polylines)
+{
+    polylines.clear();
+    flattenPath(path, polylines);
+}
+
+cv::Rect Rasterizer::bounds(const std::vector<Polyline> &polylines, float margin)
+{
+    float minX = FLT_MAX, minY = FLT_MAX;
+    float maxX = -FLT_MAX, maxY = -FLT_MAX;
+
+    for (const Polyline &polyline : polylines) {
+        for (const cv::Point2f &p : polyline) {
+            minX = MIN(minX, p.x);
+            minY = MIN(minY, p.y);
+            maxX = MAX(maxX, p.x);
+            maxY = MAX(maxY, p.y);
+        }
+    }
+
+    if (minX > maxX) {
+        return cv::Rect();
+    }
+
+    int x0 = floor(minX - margin);
+    int y0 = floor(minY - margin);
+    int x1 = ceil(maxX + margin) + 1;
+    int y1 = ceil(maxY + margin) + 1;
+    return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+void Rasterizer::fill(cv::Mat &mask, const cv::Rect &clip, const std::vector<Polyline> &polylines)
+{
+    std::vector<Edge> edges;
+
+    for (const Polyline &polyline : polylines) {
+        int length = polyline.size();
+
+        for (int i = 0; i < length; ++i) {
+            cv::Point2f a = polyline[i];
+            cv::Point2f b = polyline[(i + 1) % length];
+
+            if (a.y == b.y) {
+                continue;
+            }
+            if (a.y > b.y) {
+                std::swap(a, b);
+            }
+            if (b.y < clip.y || clip.y + clip.height < a.y) {
+                continue;
+            }
+
+            edges.push_back((Edge){a.y, b.y, a.x, (double)(b.x - a.x) / (b.y - a.y)});
+        }
+    }
+
+    if (edges.empty()) {
+        return;
+    }
+
+    std::sort(edges.begin(), edges.end(), [](const Edge &e1, const Edge &e2) {
+        return e1.y0 < e2.y0;
+    });
+
+    std::vector<const Edge *> active;
+    std::vector<double> crossings;
+    int next = 0;
+
+    for (int y = clip.y; y < clip.y + clip.height; ++y) {
+        double center = y + 0.5;
+
+        for (; next < edges.size() && edges[next].y0 <= center; ++next) {
+            active.push_back(&edges[next]);
+        }
+
+        active.erase(std::remove_if(active.begin(), active.end(), [center](const Edge *e) {
+            return e->y1 <= center;
+        }), active.end());
+
+        if (active.empty()) {
+            if (next == edges.size()) {
+                break;
+            }
+            continue;
+        }
+
+        crossings.clear();
+        for (const Edge *e : active) {
+            crossings.push_back(e->x0 + (center - e->y0) * e->dxdy);
+        }
+        std::sort(crossings.begin(), crossings.end());
+
+        uchar *row = mask.ptr<uchar>(y);
+        for (int i = 0; i + 1 < crossings.size(); i += 2) {
+            fillSpan(row, clip, crossings[i], crossings[i + 1]);
+        }
+    }
+}
+
+void Rasterizer::stroke(cv::Mat &mask, const cv::Rect &clip, const std::vector<Polyline> &polylines, float width)
+{
+    float radius = width / 2.0;
+
+    for (const Polyline &polyline : polylines) {
+        if (1 == polyline.size()) {
+            capsule(mask, clip, polyline[0], polyline[0], radius);
+            continue;
+        }
+
+        for (int i = 1; i < polyline.size(); ++i) {
+            capsule(mask, clip, polyline[i - 1], polyline[i], radius);
+        }
+    }
+}
+
+void Rasterizer::capsule(cv::Mat &mask, const cv::Rect &clip, const cv::Point2f &p1, const cv::Point2f &p2, float radius)
+{
+    capsuleSpans(clip, p1, p2, radius, [&](int y, int x0, int x1) {
+        memset(mask.ptr<uchar>(y) + x0, 255, x1 - x0);
+    });
+}
+
+// The capsule is convex, so its cross section at y is the hull of the sections of
+// the two end discs and of the body rectangle.
+bool Rasterizer::capsuleSpan(const cv::Point2f &p1, const cv::Point2f &p2, float radius, float y, float &x0, float &x1)
+{
+    double r2 = radius * radius;
+    double lo = DBL_MAX;
+    double hi = -DBL_MAX;
+
+    for (const cv::Point2f *p : {&p1, &p2}) {
+        double dy = y - p->y;
+        if (dy * dy <= r2) {
+            double h = sqrt(r2 - dy * dy);
+            lo = MIN(lo, p->x - h);
+            hi = MAX(hi, p->x + h);
+        }
+    }
+
+    double dx = p2.x - p1.x;
+    double dy = p2.y - p1.y;
+    double length2 = dx * dx + dy * dy;
+
+    if (0.0 < length2) {
+        double length = sqrt(length2);
+        double ry = y - p1.y;
+        double bodyLo = -DBL_MAX;
+        double bodyHi = DBL_MAX;
+        bool inside = true;
+
+        // 0 <= projection onto the axis <= length2
+        if (0.0 != dx) {
+            double t0 = p1.x + (0.0 - ry * dy) / dx;
+            double t1 = p1.x + (length2 - ry * dy) / dx;
+            bodyLo = MAX(bodyLo, MIN(t0, t1));
+            bodyHi = MIN(bodyHi, MAX(t0, t1));
+        }
+        else {
+            inside = 0.0 <= ry * dy && ry * dy <= length2;
+        }
+
+        // |distance from the axis| <= radius
+        if (0.0 != dy) {
+            double n0 = p1.x + (ry * dx - radius * length) / dy;
+            double n1 = p1.x + (ry * dx + radius * length) / dy;
+            bodyLo = MAX(bodyLo, MIN(n0, n1));
+            bodyHi = MIN(bodyHi, MAX(n0, n1));
+        }
+        else {
+            inside = inside && fabs(ry * dx) <= radius * length;
+        }
+
+        if (inside && bodyLo <= bodyHi) {
+            lo = MIN(lo, bodyLo);
+            hi = MAX(hi, bodyHi);
+        }
+    }
+
+    if (lo > hi) {
+        return false;
+    }
+
+    x0 = lo;
+    x1 = hi;
+    return true;
+}
+
+// Local functions
+
+template<class P>
+static void flattenPath(const P *path, std::vector<Rasterizer::Polyline> &polylines)
+{
+    int first = polylines.size();
+
+    for (const auto &s : path->segments) {
+        switch (s.type) {
+        case Segment::Type::Move:
+            polylines.emplace_back();
+            polylines.back().push_back(s[2]);
+            break;
+        case Segment::Type::Line:
+            if (polylines.size() == first) {
+                polylines.emplace_back();
+            }
+            polylines.back().push_back(s[2]);
+            break;
+        case Segment::Type::Curve:
+            if (polylines.size() == first) {
+                polylines.emplace_back();
+                polylines.back().push_back(s[0]);
+            }
+            flattenCurve(polylines.back().back(), s[0], s[1], s[2], polylines.back());
+            break;
+        }
+    }
+
+    if (path->closed && polylines.size() > first) {
+        Rasterizer::Polyline &polyline = polylines.back();
+        if (1 < polyline.size() && polyline.front() != polyline.back()) {
+            polyline.push_back(polyline.front());
+        }
+    }
+
+    for (const auto *child : path->children) {
+        flattenPath(child, polylines);
+    }
+}
+
+// Number of steps by Wang's formula, keeping the chords within the tolerance of the curve.
+static void flattenCurve(cv::Point2f p0, const cv::Point2f &p1, const cv::Point2f &p2, const cv::Point2f &p3, Rasterizer::Polyline &polyline)
+{
+    cv::Point2f d1 = p0 - p1 * 2.0 + p2;
+    cv::Point2f d2 = p1 - p2 * 2.0 + p3;
+    double dd = sqrt(MAX(d1.dot(d1), d2.dot(d2)));
+
+    int steps = ceil(sqrt(0.75 * dd / FLATTENING_TOLERANCE));
+    steps = MAX(1, MIN(MAXIMUM_CURVE_STEPS, steps));
+
+    for (int i = 1; i < steps; ++i) {
+        double t = (double)i / steps;
+        double mt = 1.0 - t;
+        double a = mt * mt * mt;
+        double b = 3.0 * mt * mt * t;
+        double c = 3.0 * mt * t * t;
+        double d = t * t * t;
+        polyline.push_back(cv::Point2f(a * p0.x + b * p1.x + c * p2.x + d * p3.x,
+                                       a * p0.y + b * p1.y + c * p2.y + d * p3.y));
+    }
+
+    polyline.push_back(p3);
+}
+
+static void fillSpan(uchar *row, const cv::Rect &clip, double x0, double x1)
+{
+    int from = MAX(clip.x, (int)ceil(x0 - 0.5));
+    int to = MIN(clip.x + clip.width, (int)ceil(x1 - 0.5));
+
+    if (from < to) {
+        memset(row + from, 255, to - from);
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Document.h"
+#include "PackedPath.h"
+
+#include <cmath>
+
+namespace illustrace {
+
+class Rasterizer {
+public:
+    typedef std::vector<cv::Point2f> Polyline;
+
+    static void flatten(Path *path, std::vector<Polyline> &polylines);
+    static void flatten(PackedPath *path, std::vector<Polyline> &polylines);
+    static cv::Rect bounds(const std::vector<Polyline> &polylines, float margin);
+
+    static void fill(cv::Mat &mask, const cv::Rect &clip, const std::vector<Polyline> &polylines);
+    static void stroke(cv::Mat &mask, const cv::Rect &clip, const std::vector<Polyline> &polylines, float width);
+    static void capsule(cv::Mat &mask, const cv::Rect &clip, const cv::Point2f &p1, const cv::Point2f &p2, float radius);
+    static bool capsuleSpan(const cv::Point2f &p1, const cv::Point2f &p2, float radius, float y, float &x0, float &x1);
+
+    // Calls fn(y, x0, x1) for every row of clip with the pixels [x0, x1) whose centers the capsule covers.
+    template <class F>
+    static void capsuleSpans(const cv::Rect &clip, const cv::Point2f &p1, const cv::Point2f &p2, float radius, F fn);
+};
+
+template <class F>
+void Rasterizer::capsuleSpans(const cv::Rect &clip, const cv::Point2f &p1, const cv::Point2f &p2, float radius, F fn)
+{
+    int y0 = MAX(clip.y, (int)floor(MIN(p1.y, p2.y) - radius));
+    int y1 = MIN(clip.y + clip.height, (int)ceil(MAX(p1.y, p2.y) + radius) + 1);
+
+    if (MAX(p1.x, p2.x) + radius < clip.x || clip.x + clip.width < MIN(p1.x, p2.x) - radius) {
+        return;
+    }
+
+    for (int y = y0; y < y1; ++y) {
+        float x0, x1;
+        if (capsuleSpan(p1, p2, radius, y + 0.5, x0, x1)) {
+            int from = MAX(clip.x, (int)ceil(x0 - 0.5));
+            int to = MIN(clip.x + clip.width, (int)ceil(x1 - 0.5));
+            if (from < to) {
+                fn(y, from, to);
+            }
+        }
+    }
+}
+
+} // namespace illustrace
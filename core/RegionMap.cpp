@@ -0,0 +1,294 @@
+#include "RegionMap.h"
+#include "TaskScheduler.h"
+
+#include <numeric>
+
+using namespace illustrace;
+
+// Within a tile, 4-connected labeling by union-find over row runs, which double as the spans of
+// the regions. Components of neighbouring tiles are joined where both pixels across the border
+// are unmasked, again by union-find, and the smallest component of each set labels its region.
+
+static int root(std::vector<int> &parents, int index);
+
+RegionMap::RegionMap() : tileCols(0), tileRows(0)
+{
+}
+
+void RegionMap::build(const cv::Mat &paintMask)
+{
+    tileCols = (paintMask.cols + TileSize - 1) / TileSize;
+    tileRows = (paintMask.rows + TileSize - 1) / TileSize;
+    tiles.assign(tileCols * tileRows, Tile());
+
+    cv::Rect maskRect(0, 0, paintMask.cols, paintMask.rows);
+    std::vector<int> indices(tiles.size());
+
+    for (int i = 0; i < tiles.size(); ++i) {
+        tiles[i].rect = cv::Rect(i % tileCols * TileSize, i / tileCols * TileSize, TileSize, TileSize) & maskRect;
+        indices[i] = i;
+    }
+
+    labels.create(paintMask.rows, paintMask.cols, CV_32SC1);
+    labelTiles(paintMask, indices);
+    join();
+}
+
+void RegionMap::update(const cv::Mat &paintMask, const std::vector<cv::Rect> &dirtyRects)
+{
+    if (labels.size() != paintMask.size()) {
+        build(paintMask);
+        return;
+    }
+
+    cv::Rect maskRect(0, 0, paintMask.cols, paintMask.rows);
+    std::vector<bool> dirty(tiles.size(), false);
+
+    for (const cv::Rect &dirtyRect : dirtyRects) {
+        cv::Rect rect = dirtyRect & maskRect;
+        if (0 >= rect.area()) {
+            continue;
+        }
+
+        for (int row = rect.y / TileSize; row <= (rect.y + rect.height - 1) / TileSize; ++row) {
+            for (int col = rect.x / TileSize; col <= (rect.x + rect.width - 1) / TileSize; ++col) {
+                dirty[row * tileCols + col] = true;
+            }
+        }
+    }
+
+    std::vector<int> indices;
+    for (int i = 0; i < dirty.size(); ++i) {
+        if (dirty[i]) {
+            indices.push_back(i);
+        }
+    }
+
+    if (indices.empty()) {
+        return;
+    }
+
+    labelTiles(paintMask, indices);
+    join();
+}
+
+void RegionMap::clear()
+{
+    tileCols = 0;
+    tileRows = 0;
+    tiles.clear();
+    labels.release();
+    roots.clear();
+    componentTiles.clear();
+    rootComponents.clear();
+    rootOffsets.clear();
+    _regions.clear();
+}
+
+int RegionMap::label(int x, int y)
+{
+    if (x < 0 || labels.cols <= x || y < 0 || labels.rows <= y) {
+        return -1;
+    }
+
+    int component = labels.at<int>(y, x);
+    if (-1 == component) {
+        return -1;
+    }
+
+    return roots[tiles[y / TileSize * tileCols + x / TileSize].firstComponent + component];
+}
+
+Region *RegionMap::region(int x, int y)
+{
+    int index = label(x, y);
+    if (-1 == index) {
+        return nullptr;
+    }
+
+    auto it = _regions.find(index);
+    if (_regions.end() != it) {
+        return &it->second;
+    }
+
+    Region &region = _regions[index];
+
+    for (int i = rootOffsets[index]; i < rootOffsets[index + 1]; ++i) {
+        int component = rootComponents[i];
+        Tile &tile = tiles[componentTiles[component]];
+        int local = component - tile.firstComponent;
+
+        for (int j = tile.componentOffsets[local]; j < tile.componentOffsets[local + 1]; ++j) {
+            Span &span = tile.runs[tile.componentRuns[j]];
+            cv::Rect rect(span.x0, span.y, span.x1 - span.x0, 1);
+            region.boundingRect = region.spans.empty() ? rect : region.boundingRect | rect;
+            region.spans.push_back(span);
+        }
+    }
+
+    return &region;
+}
+
+void RegionMap::labelTiles(const cv::Mat &paintMask, const std::vector<int> &indices)
+{
+    TaskScheduler::shared().parallelFor(indices.size(), [&](int i) {
+        labelTile(paintMask, tiles[indices[i]]);
+    });
+}
+
+void RegionMap::labelTile(const cv::Mat &paintMask, Tile &tile)
+{
+    const cv::Rect &rect = tile.rect;
+    int end = rect.x + rect.width;
+    std::vector<Span> &runs = tile.runs;
+    std::vector<int> rowOffsets(rect.height + 1);
+
+    runs.clear();
+
+    for (int y = rect.y; y < rect.y + rect.height; ++y) {
+        const uchar *data = paintMask.ptr<uchar>(y);
+        rowOffsets[y - rect.y] = runs.size();
+
+        int x = rect.x;
+        while (x < end) {
+            for (; x < end && 255 == data[x]; ++x);
+            if (x == end) {
+                break;
+            }
+
+            int x0 = x;
+            for (; x < end && 255 != data[x]; ++x);
+            runs.push_back((Span){y, x0, x});
+        }
+    }
+    rowOffsets[rect.height] = runs.size();
+
+    std::vector<int> parents(runs.size());
+    std::iota(parents.begin(), parents.end(), 0);
+
+    for (int y = 1; y < rect.height; ++y) {
+        int above = rowOffsets[y - 1];
+        int current = rowOffsets[y];
+
+        while (above < rowOffsets[y] && current < rowOffsets[y + 1]) {
+            if (runs[current].x0 < runs[above].x1 && runs[above].x0 < runs[current].x1) {
+                int r1 = root(parents, above);
+                int r2 = root(parents, current);
+                parents[MAX(r1, r2)] = MIN(r1, r2);
+            }
+
+            if (runs[above].x1 < runs[current].x1) {
+                ++above;
+            }
+            else {
+                ++current;
+            }
+        }
+    }
+
+    // A root is never after its runs, so components are numbered in the order of their first run.
+    std::vector<int> components(runs.size());
+    int count = 0;
+
+    labels(rect).setTo(cv::Scalar(-1));
+
+    for (int i = 0; i < runs.size(); ++i) {
+        int r = root(parents, i);
+        components[i] = r == i ? count++ : components[r];
+
+        int *row = labels.ptr<int>(runs[i].y);
+        std::fill(row + runs[i].x0, row + runs[i].x1, components[i]);
+    }
+
+    tile.componentOffsets.assign(count + 1, 0);
+    for (int component : components) {
+        ++tile.componentOffsets[component + 1];
+    }
+    std::partial_sum(tile.componentOffsets.begin(), tile.componentOffsets.end(), tile.componentOffsets.begin());
+
+    std::vector<int> positions(tile.componentOffsets.begin(), tile.componentOffsets.end() - 1);
+    tile.componentRuns.resize(runs.size());
+    for (int i = 0; i < runs.size(); ++i) {
+        tile.componentRuns[positions[components[i]]++] = i;
+    }
+}
+
+void RegionMap::join()
+{
+    int count = 0;
+    for (Tile &tile : tiles) {
+        tile.firstComponent = count;
+        count += tile.componentOffsets.size() - 1;
+    }
+
+    componentTiles.resize(count);
+    for (int i = 0; i < tiles.size(); ++i) {
+        std::fill(componentTiles.begin() + tiles[i].firstComponent, componentTiles.begin() + tiles[i].firstComponent + tiles[i].componentOffsets.size() - 1, i);
+    }
+
+    std::vector<int> parents(count);
+    std::iota(parents.begin(), parents.end(), 0);
+
+    auto unite = [&](int component1, int component2) {
+        int r1 = root(parents, component1);
+        int r2 = root(parents, component2);
+        parents[MAX(r1, r2)] = MIN(r1, r2);
+    };
+
+    for (int row = 0; row < tileRows; ++row) {
+        for (int col = 0; col < tileCols; ++col) {
+            Tile &tile = tiles[row * tileCols + col];
+
+            if (col + 1 < tileCols) {
+                Tile &right = tiles[row * tileCols + col + 1];
+                int x = right.rect.x;
+
+                for (int y = tile.rect.y; y < tile.rect.y + tile.rect.height; ++y) {
+                    const int *data = labels.ptr<int>(y);
+                    if (-1 != data[x - 1] && -1 != data[x]) {
+                        unite(tile.firstComponent + data[x - 1], right.firstComponent + data[x]);
+                    }
+                }
+            }
+
+            if (row + 1 < tileRows) {
+                Tile &below = tiles[(row + 1) * tileCols + col];
+                const int *above = labels.ptr<int>(below.rect.y - 1);
+                const int *data = labels.ptr<int>(below.rect.y);
+
+                for (int x = tile.rect.x; x < tile.rect.x + tile.rect.width; ++x) {
+                    if (-1 != above[x] && -1 != data[x]) {
+                        unite(tile.firstComponent + above[x], below.firstComponent + data[x]);
+                    }
+                }
+            }
+        }
+    }
+
+    roots.resize(count);
+    rootOffsets.assign(count + 1, 0);
+    for (int i = 0; i < count; ++i) {
+        roots[i] = root(parents, i);
+        ++rootOffsets[roots[i] + 1];
+    }
+    std::partial_sum(rootOffsets.begin(), rootOffsets.end(), rootOffsets.begin());
+
+    std::vector<int> positions(rootOffsets.begin(), rootOffsets.end() - 1);
+    rootComponents.resize(count);
+    for (int i = 0; i < count; ++i) {
+        rootComponents[positions[roots[i]]++] = i;
+    }
+
+    _regions.clear();
+}
+
+// Local functions
+
+static int root(std::vector<int> &parents, int index)
+{
+    while (parents[index] != index) {
+        parents[index] = parents[parents[index]];
+        index = parents[index];
+    }
+    return index;
+}
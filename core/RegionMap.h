@@ -0,0 +1,68 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+#include <vector>
+#include <unordered_map>
+
+namespace illustrace {
+
+struct Span {
+    int y;
+    int x0;
+    int x1;
+};
+
+struct Region {
+    cv::Rect boundingRect;
+    std::vector<Span> spans;
+};
+
+// 4-connected regions of the pixels not covered by the paint mask. The map is kept in tiles
+// labeled on their own and joined across the tile borders, so an update only labels the tiles
+// it is given again and redoes the joins, which cost the tile borders rather than the image.
+class RegionMap {
+public:
+    static const int TileSize = 256;
+
+    RegionMap();
+
+    void build(const cv::Mat &paintMask);
+    // Rects are where the mask changed since the last build or update.
+    void update(const cv::Mat &paintMask, const std::vector<cv::Rect> &dirtyRects);
+    void clear();
+
+    // Labels are equal for the pixels of one region and -1 under the mask.
+    int label(int x, int y);
+    // Spans of a region are cut at tile borders. Regions are gathered on first lookup and stay
+    // valid until the next build or update.
+    Region *region(int x, int y);
+
+private:
+    struct Tile {
+        cv::Rect rect;
+        std::vector<Span> runs;
+        // Runs grouped by component, those of component i from componentOffsets[i]
+        std::vector<int> componentRuns;
+        std::vector<int> componentOffsets;
+        int firstComponent;
+    };
+
+    void labelTiles(const cv::Mat &paintMask, const std::vector<int> &indices);
+    void labelTile(const cv::Mat &paintMask, Tile &tile);
+    void join();
+
+    int tileCols;
+    int tileRows;
+    std::vector<Tile> tiles;
+    // Components of the tile per pixel
+    cv::Mat labels;
+    // Per component of the whole map, its region label and the tile it lies in
+    std::vector<int> roots;
+    std::vector<int> componentTiles;
+    // Components grouped by region, those of region label r from rootOffsets[r]
+    std::vector<int> rootComponents;
+    std::vector<int> rootOffsets;
+    std::unordered_map<int, Region> _regions;
+};
+
+} // namespace illustrace
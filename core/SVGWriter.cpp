@@ -1,15 +1,68 @@
 #include "SVGWriter.h"
+#include "TaskScheduler.h"
 
 #include <libxml/encoding.h>
 #include <libxml/xmlwriter.h>
 
 #include <sstream>
 
+#define PATHS_GRAIN 16
+
 using namespace illustrace;
 
-static void writePathToStringStream(Path *path, std::stringstream &ss)
+enum OutCode {
+    Left = 1,
+    Right = 2,
+    Top = 4,
+    Bottom = 8,
+};
+
+static inline int outCode(const cv::Point2f &p, const cv::Rect2f &rect)
+{
+    return (p.x < rect.x ? Left : 0)
+        | (rect.x + rect.width < p.x ? Right : 0)
+        | (p.y < rect.y ? Top : 0)
+        | (rect.y + rect.height < p.y ? Bottom : 0);
+}
+
+// With a clip rect, runs of segments that stay in one half plane outside the rect are
+// written as a single line to the end of the run. The region between the run and the
+// line lies in that half plane too, so neither the fill nor the stroke inside the rect changes.
+template<class P>
+static void writePathToStringStream(const P *path, std::stringstream &ss, const cv::Rect2f *clip)
 {
-    for (Segment &s : path->segments) {
+    cv::Point2f current;
+    int runCode = 0;
+
+    for (const auto &s : path->segments) {
+        if (clip && Segment::Type::Move != s.type) {
+            int code = outCode(current, *clip) & outCode(s[2], *clip);
+            if (Segment::Type::Curve == s.type) {
+                code &= outCode(s[0], *clip) & outCode(s[1], *clip);
+            }
+
+            if (runCode & code) {
+                runCode &= code;
+                current = s[2];
+                continue;
+            }
+
+            if (runCode) {
+                ss << " L" << current.x << "," << current.y;
+            }
+
+            runCode = code;
+            if (runCode) {
+                current = s[2];
+                continue;
+            }
+        }
+
+        if (runCode) {
+            ss << " L" << current.x << "," << current.y;
+            runCode = 0;
+        }
+
         switch (s.type) {
         case Segment::Type::Move:
             ss << "M" << s[2].x << "," << s[2].y;
@@ -21,29 +74,115 @@ static void writePathToStringStream(Path *path, std::stringstream &ss)
             ss << " C" << s[0].x << "," << s[0].y << " " << s[1].x << "," << s[1].y << " " << s[2].x << "," << s[2].y;
             break;
         }
+
+        current = s[2];
+    }
+
+    if (runCode) {
+        ss << " L" << current.x << "," << current.y;
     }
 
     if (path->closed) {
         ss << " Z";
     }
 
-    for (Path *child : path->children) {
+    for (const auto *child : path->children) {
         ss << " ";
-        writePathToStringStream(child, ss);
+        writePathToStringStream(child, ss, clip);
     }
 }
 
-bool SVGWriter::write(const char *filepath, Document *document, const char *comment)
+// Path data is formatted in parallel, then written in document order.
+static void formatPaths(std::vector<Path *> &paths, const cv::Rect2f *clip, std::vector<std::string> &data)
 {
-    int ret = 0;
-    char str[128];
+    data.resize(paths.size());
 
+    TaskScheduler::shared().parallelFor(paths.size(), PATHS_GRAIN, [&](int i) {
+        data[i] = SVGWriter::pathData(paths[i], clip);
+    });
+}
+
+struct SinkContext {
+    SVGWriter::Sink sink;
+    void *context;
+};
+
+static int writeToSink(void *context, const char *data, int length)
+{
+    SinkContext *sinkContext = (SinkContext *)context;
+    return sinkContext->sink(sinkContext->context, data, length) ? length : -1;
+}
+
+static bool appendToBuffer(void *context, const char *data, size_t length)
+{
+    std::vector<char> *buffer = (std::vector<char> *)context;
+    buffer->insert(buffer->end(), data, data + length);
+    return true;
+}
+
+static bool writeDocument(xmlTextWriterPtr writer, Document *document, const char *comment, bool clipSegments);
+
+bool SVGWriter::write(const char *filepath, Document *document, const char *comment, bool clipSegments)
+{
     xmlTextWriterPtr writer = xmlNewTextWriterFilename(filepath, 0);
     if (!writer) {
         return false;
     }
 
-#define CHECK_AND_ABORT if (-1 == ret) { xmlFreeTextWriter(writer); return false; }
+    bool ret = writeDocument(writer, document, comment, clipSegments);
+    xmlFreeTextWriter(writer);
+    return ret;
+}
+
+bool SVGWriter::write(std::vector<char> &buffer, Document *document, const char *comment, bool clipSegments)
+{
+    return write(appendToBuffer, &buffer, document, comment, clipSegments);
+}
+
+// libxml2 hands its output buffer straight to the sink, so the document is never copied as a whole.
+bool SVGWriter::write(Sink sink, void *context, Document *document, const char *comment, bool clipSegments)
+{
+    SinkContext sinkContext = {sink, context};
+
+    xmlOutputBufferPtr output = xmlOutputBufferCreateIO(writeToSink, nullptr, &sinkContext, nullptr);
+    if (!output) {
+        return false;
+    }
+
+    xmlTextWriterPtr writer = xmlNewTextWriter(output);
+    if (!writer) {
+        xmlOutputBufferClose(output);
+        return false;
+    }
+
+    bool ret = writeDocument(writer, document, comment, clipSegments);
+    ret = 0 <= xmlTextWriterFlush(writer) && ret;
+    xmlFreeTextWriter(writer);
+    return ret;
+}
+
+std::string SVGWriter::pathData(Path *path, const cv::Rect2f *clip)
+{
+    std::stringstream ss;
+    writePathToStringStream(path, ss, clip);
+    return ss.str();
+}
+
+std::string SVGWriter::pathData(PackedPath *path, const cv::Rect2f *clip)
+{
+    std::stringstream ss;
+    writePathToStringStream(path, ss, clip);
+    return ss.str();
+}
+
+static bool writeDocument(xmlTextWriterPtr writer, Document *document, const char *comment, bool clipSegments)
+{
+    TaskScheduler::LaneScope scope(TaskScheduler::Lane::Background);
+
+    int ret = 0;
+    char str[128];
+
+#define CHECK_AND_ABORT if (-1 == ret) { return false; }
 
     ret = xmlTextWriterSetIndent(writer, 1);
     CHECK_AND_ABORT;
@@ -56,6 +195,19 @@ bool SVGWriter::write(const char *filepath, Document *document, const char *comm
 
     cv::Rect &clippingRect = document->clippingRect();
 
+    double margin = document->thickness() / 2.0 + 1.0;
+    cv::Rect2f clip(clippingRect.x - margin, clippingRect.y - margin, clippingRect.width + margin * 2, clippingRect.height + margin * 2);
+
+    std::vector<Path *> paintPaths;
+    std::vector<Path *> paths;
+    document->paintPathIndex().query(clip, paintPaths);
+    document->pathIndex().query(clip, paths);
+
+    std::vector<std::string> paintPathData;
+    std::vector<std::string> pathData;
+    formatPaths(paintPaths, clipSegments ? &clip : nullptr, paintPathData);
+    formatPaths(paths, clipSegments ? &clip : nullptr, pathData);
+
     sprintf(str, "%dpx", clippingRect.width);
     ret = xmlTextWriterWriteAttribute(writer, BAD_CAST "width", BAD_CAST str);
     CHECK_AND_ABORT;
@@ -89,16 +241,15 @@ bool SVGWriter::write(const char *filepath, Document *document, const char *comm
             CHECK_AND_ABORT;
         }
 
-        auto *paintPaths = document->paintPaths();
-        if (paintPaths && !paintPaths->empty()) {
+        if (!paintPaths.empty()) {
             ret = xmlTextWriterStartElement(writer, BAD_CAST "g");
             CHECK_AND_ABORT;
 
             ret = xmlTextWriterWriteAttribute(writer, BAD_CAST "fill-rule", BAD_CAST "evenodd");
             CHECK_AND_ABORT;
 
-            for (auto *path : *paintPaths) {
-                std::stringstream ss = std::stringstream("");
+            for (int i = 0; i < paintPaths.size(); ++i) {
+                Path *path = paintPaths[i];
 
                 ret = xmlTextWriterStartElement(writer, BAD_CAST "path");
                 CHECK_AND_ABORT;
@@ -108,9 +259,7 @@ bool SVGWriter::write(const char *filepath, Document *document, const char *comm
                 ret = xmlTextWriterWriteAttribute(writer, BAD_CAST "fill", BAD_CAST str);
                 CHECK_AND_ABORT;
 
-                writePathToStringStream(path, ss);
-
-                ret = xmlTextWriterWriteAttribute(writer, BAD_CAST "d", BAD_CAST ss.str().c_str());
+                ret = xmlTextWriterWriteAttribute(writer, BAD_CAST "d", BAD_CAST paintPathData[i].c_str());
                 CHECK_AND_ABORT;
                 ret = xmlTextWriterFullEndElement(writer);
                 CHECK_AND_ABORT;
@@ -147,15 +296,11 @@ bool SVGWriter::write(const char *filepath, Document *document, const char *comm
         ret = xmlTextWriterWriteAttribute(writer, BAD_CAST "fill", BAD_CAST str);
         CHECK_AND_ABORT;
 
-        for (auto *path : *document->paths()) {
-            std::stringstream ss = std::stringstream("");
-
+        for (auto &data : pathData) {
             ret = xmlTextWriterStartElement(writer, BAD_CAST "path");
             CHECK_AND_ABORT;
 
-            writePathToStringStream(path, ss);
-
-            ret = xmlTextWriterWriteAttribute(writer, BAD_CAST "d", BAD_CAST ss.str().c_str());
+            ret = xmlTextWriterWriteAttribute(writer, BAD_CAST "d", BAD_CAST data.c_str());
             CHECK_AND_ABORT;
             ret = xmlTextWriterFullEndElement(writer);
             CHECK_AND_ABORT;
@@ -171,7 +316,7 @@ bool SVGWriter::write(const char *filepath, Document *document, const char *comm
     ret = xmlTextWriterEndDocument(writer);
     CHECK_AND_ABORT;
 
-    xmlFreeTextWriter(writer);
+#undef CHECK_AND_ABORT
 
-    return 0 == ret;
+    return true;
 }
@@ -1,12 +1,22 @@
 #pragma once
 
 #include "Document.h"
+#include "PackedPath.h"
+
+#include <vector>
 
 namespace illustrace {
 
 class SVGWriter {
 public:
-    static bool write(const char *filepath, Document *document, const char *comment);
+    typedef bool (*Sink)(void *context, const char *data, size_t length);
+
+    static bool write(const char *filepath, Document *document, const char *comment, bool clipSegments = false);
+    static bool write(std::vector<char> &buffer, Document *document, const char *comment, bool clipSegments = false);
+    static bool write(Sink sink, void *context, Document *document, const char *comment, bool clipSegments = false);
+
+    static std::string pathData(Path *path, const cv::Rect2f *clip = nullptr);
+    static std::string pathData(PackedPath *path, const cv::Rect2f *clip = nullptr);
 };
 
 } // namespace illustrace
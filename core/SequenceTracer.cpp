@@ -0,0 +1,258 @@
+#include "SequenceTracer.h"
+#include "TaskScheduler.h"
+
+#include <cstring>
+#include <algorithm>
+
+#define TILE_SIZE 64
+#define CONTOURS_GRAIN 64
+
+using namespace illustrace;
+
+static uint64_t contourHash(const FlatContours<cv::Point>::Contour &contour);
+
+SequenceTracer::SequenceTracer()
+{
+    reset();
+}
+
+SequenceTracer::~SequenceTracer()
+{
+    reset();
+}
+
+void SequenceTracer::reset()
+{
+    for (PackedPath *path : fitted) {
+        delete path;
+    }
+
+    fitted.clear();
+    contours.clear();
+    approximated.clear();
+    contourIndex.clear();
+    previousImage.release();
+    parameters = Parameters();
+    _statistics = Statistics();
+}
+
+const SequenceTracer::Statistics &SequenceTracer::statistics()
+{
+    return _statistics;
+}
+
+// Contour building still runs over the whole frame when any tile changed, the reuse starts
+// at approximation. Fitted paths are kept packed and without hierarchy, and unpacked per frame.
+void SequenceTracer::trace(cv::Mat &frame, Document *document, const cv::Rect *clippingRect)
+{
+    TaskScheduler::LaneScope scope(TaskScheduler::Lane::Background);
+
+    illustrace.layout(frame, document, clippingRect);
+
+    Parameters current = {
+        document->brightness(),
+        document->blur(),
+        document->despeckle(),
+        document->detail(),
+        document->smoothing(),
+        document->thickness(),
+        document->negative(),
+        document->fitting(),
+        frame.size(),
+        document->traceRect(),
+    };
+
+    if (current.brightness != parameters.brightness || current.blur != parameters.blur
+            || current.despeckle != parameters.despeckle
+            || current.detail != parameters.detail || current.smoothing != parameters.smoothing
+            || current.thickness != parameters.thickness || current.negative != parameters.negative
+            || current.fitting != parameters.fitting
+            || current.size != parameters.size || current.traceRect != parameters.traceRect) {
+        reset();
+        parameters = current;
+    }
+
+    illustrace.binarize(frame, document);
+    cv::Mat &image = document->preprocessedImage();
+
+    int changedTiles = diff(image);
+
+    if (!previousImage.empty() && 0 == changedTiles) {
+        restore(document);
+        return;
+    }
+
+    illustrace.buildLines(document);
+
+    auto &outlineContours = *document->outlineContours();
+    int count = outlineContours.size();
+
+    std::vector<int> sources(count, -1);
+    std::vector<bool> matched(contours.size(), false);
+    int reused = 0;
+
+    for (int i = 0; i < count; ++i) {
+        auto range = contourIndex.equal_range(contourHash(outlineContours[i]));
+        for (auto it = range.first; it != range.second; ++it) {
+            if (!matched[it->second] && contours[it->second] == outlineContours[i]) {
+                matched[it->second] = true;
+                sources[i] = it->second;
+                ++reused;
+                break;
+            }
+        }
+    }
+
+    double epsilon = illustrace.epsilon(document);
+    double smoothing = document->smoothing();
+    bool leastSquares = Document::FittingMode::LeastSquares == document->fitting();
+    int chunks = (count + CONTOURS_GRAIN - 1) / CONTOURS_GRAIN;
+
+    // As in Illustrace::approximateLines, each contour is approximated into the range its outline
+    // takes, reused ones included, and the results are packed afterwards.
+    auto *approximatedOutlineContours = new FlatContours<cv::Point2f>();
+    approximatedOutlineContours->points.resize(outlineContours.points.size());
+    approximatedOutlineContours->offsets = outlineContours.offsets;
+    approximatedOutlineContours->hierarchy = outlineContours.hierarchy;
+    std::vector<int> lengths(count);
+    std::vector<PackedPath *> packedPaths(count, nullptr);
+    std::vector<Path *> paths(count, nullptr);
+
+    TaskScheduler::shared().parallelFor(chunks, [&](int i) {
+        std::vector<cv::Point2f> line;
+        int end = MIN(count, (i + 1) * CONTOURS_GRAIN);
+
+        for (int j = i * CONTOURS_GRAIN; j < end; ++j) {
+            auto slot = approximatedOutlineContours->points.begin() + approximatedOutlineContours->offsets[j];
+            paths[j] = new Path();
+
+            if (-1 != sources[j]) {
+                auto source = approximated[sources[j]];
+                std::copy(source.begin(), source.end(), slot);
+                lengths[j] = source.size();
+                packedPaths[j] = fitted[sources[j]];
+                packedPaths[j]->unpack(paths[j]);
+            }
+            else {
+                cv::approxPolyDP(outlineContours[j].mat(), line, epsilon, false);
+                std::copy(line.begin(), line.end(), slot);
+                lengths[j] = line.size();
+                if (leastSquares) {
+                    BezierSplineBuilder::fit(FlatContours<cv::Point2f>::Contour(line.data(), line.data() + line.size()), paths[j], epsilon, smoothing);
+                }
+                else {
+                    BezierSplineBuilder::build(line, paths[j], smoothing, true, false);
+                }
+                packedPaths[j] = new PackedPath(paths[j]);
+            }
+        }
+    });
+
+    approximatedOutlineContours->pack(lengths);
+
+    std::vector<cv::Rect2f> dirtyRects;
+    for (int i = 0; i < count; ++i) {
+        if (-1 == sources[i]) {
+            dirtyRects.push_back(packedPaths[i]->bounds);
+        }
+    }
+    for (int i = 0; i < fitted.size(); ++i) {
+        if (!matched[i]) {
+            dirtyRects.push_back(fitted[i]->bounds);
+            delete fitted[i];
+        }
+    }
+
+    auto *hierarchyPaths = new std::vector<Path *>();
+    illustrace.buildPathsHierarchy(paths, nullptr, outlineContours.hierarchy, 0, *hierarchyPaths);
+
+    document->approximatedOutlineContours(approximatedOutlineContours);
+    if (previousImage.empty()) {
+        document->paths(hierarchyPaths);
+    }
+    else {
+        document->paths(hierarchyPaths, dirtyRects);
+    }
+
+    previousImage = image.clone();
+    boundingRect = document->boundingRect();
+    contours = outlineContours;
+    approximated = *approximatedOutlineContours;
+    fitted.swap(packedPaths);
+
+    contourIndex.clear();
+    for (int i = 0; i < count; ++i) {
+        contourIndex.insert(std::make_pair(contourHash(contours[i]), i));
+    }
+
+    _statistics.contours = count;
+    _statistics.reusedContours = reused;
+}
+
+// Returns the number of tiles differing from the previous preprocessed image, every tile
+// when there is none.
+int SequenceTracer::diff(const cv::Mat &image)
+{
+    int tileCols = (image.cols + TILE_SIZE - 1) / TILE_SIZE;
+    int tileRows = (image.rows + TILE_SIZE - 1) / TILE_SIZE;
+
+    _statistics.tiles = tileCols * tileRows;
+
+    if (previousImage.empty()) {
+        _statistics.changedTiles = _statistics.tiles;
+        return _statistics.changedTiles;
+    }
+
+    std::vector<char> changed(tileCols * tileRows, 0);
+    cv::Rect imageRect(0, 0, image.cols, image.rows);
+
+    TaskScheduler::shared().parallelFor(tileCols * tileRows, [&](int i) {
+        cv::Rect tile = cv::Rect(i % tileCols * TILE_SIZE, i / tileCols * TILE_SIZE, TILE_SIZE, TILE_SIZE) & imageRect;
+        for (int y = tile.y; y < tile.y + tile.height; ++y) {
+            if (0 != memcmp(image.ptr(y, tile.x), previousImage.ptr(y, tile.x), tile.width)) {
+                changed[i] = 1;
+                return;
+            }
+        }
+    });
+
+    _statistics.changedTiles = std::count(changed.begin(), changed.end(), 1);
+    return _statistics.changedTiles;
+}
+
+void SequenceTracer::restore(Document *document)
+{
+    int count = contours.size();
+
+    document->boundingRect(boundingRect);
+    document->outlineContours(new FlatContours<cv::Point>(contours));
+    document->approximatedOutlineContours(new FlatContours<cv::Point2f>(approximated));
+
+    std::vector<Path *> paths(count);
+    for (int i = 0; i < count; ++i) {
+        paths[i] = new Path();
+        fitted[i]->unpack(paths[i]);
+    }
+
+    auto *hierarchyPaths = new std::vector<Path *>();
+    illustrace.buildPathsHierarchy(paths, nullptr, contours.hierarchy, 0, *hierarchyPaths);
+    document->paths(hierarchyPaths, std::vector<cv::Rect2f>());
+
+    _statistics.contours = count;
+    _statistics.reusedContours = count;
+}
+
+// Local functions
+
+static uint64_t contourHash(const FlatContours<cv::Point>::Contour &contour)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    const uchar *p = (const uchar *)contour.data();
+    size_t length = contour.size() * sizeof(cv::Point);
+
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ p[i]) * 0x100000001B3ULL;
+    }
+
+    return hash;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "Illustrace.h"
+#include "PackedPath.h"
+
+#include <unordered_map>
+
+namespace illustrace {
+
+// Traces the frames of a video or an image sequence one after another. Each preprocessed frame is
+// compared with the previous one tile by tile; an unchanged frame reuses the whole previous result,
+// otherwise contours identical to ones of the previous frame reuse their approximation and bezier
+// path, and the paths are set with the bounds of added or removed ones as paint mask dirty rects,
+// so only the mask tiles they reach are rasterized again when the mask is next needed.
+class SequenceTracer {
+public:
+    struct Statistics {
+        int tiles;
+        int changedTiles;
+        int contours;
+        int reusedContours;
+    };
+
+    SequenceTracer();
+    ~SequenceTracer();
+
+    void trace(cv::Mat &frame, Document *document, const cv::Rect *clippingRect = nullptr);
+    void reset();
+    const Statistics &statistics();
+
+private:
+    struct Parameters {
+        double brightness;
+        double blur;
+        double despeckle;
+        double detail;
+        double smoothing;
+        double thickness;
+        bool negative;
+        Document::FittingMode fitting;
+        cv::Size size;
+        cv::Rect traceRect;
+    };
+
+    int diff(const cv::Mat &image);
+    void restore(Document *document);
+
+    Illustrace illustrace;
+    Parameters parameters;
+    cv::Mat previousImage;
+    cv::Rect boundingRect;
+    FlatContours<cv::Point> contours;
+    FlatContours<cv::Point2f> approximated;
+    std::vector<PackedPath *> fitted;
+    std::unordered_multimap<uint64_t, int> contourIndex;
+    Statistics _statistics;
+};
+
+} // namespace illustrace
@@ -0,0 +1,286 @@
+#include "TaskScheduler.h"
+
+#include "opencv2/core.hpp"
+
+#include <exception>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace illustrace;
+
+// Work-stealing scheduler shared by every parallel stage of the library.
+// A parallel loop is one task over its whole index range. Whoever runs a task splits it in
+// halves down to the grain, keeps the first half and pushes the rest onto its own deque,
+// where idle workers steal the largest pieces from the front. The caller helps until its
+// loop is done, so nested loops never block a worker.
+//
+// Tasks of the interactive lane are always taken before those of the background lane.
+// A thread stays in the lane of the task it runs, so nested loops inherit it.
+
+struct TaskScheduler::Job {
+    void (*invoke)(void *, int);
+    void *context;
+    Lane lane;
+    int grain;
+    std::atomic<int> remaining;
+    std::atomic<bool> failed;
+    std::mutex mutex;
+    std::exception_ptr exception;
+};
+
+static thread_local int workerIndex = -1;
+static thread_local TaskScheduler::Lane currentLane = TaskScheduler::Lane::Interactive;
+
+static bool pinThread(std::thread *thread, int cpu);
+
+TaskScheduler::LaneScope::LaneScope(Lane lane) : previous(currentLane)
+{
+    currentLane = lane;
+}
+
+TaskScheduler::LaneScope::~LaneScope()
+{
+    currentLane = previous;
+}
+
+TaskScheduler &TaskScheduler::shared()
+{
+    static TaskScheduler scheduler;
+    return scheduler;
+}
+
+TaskScheduler::TaskScheduler() : queued(0), terminated(false)
+{
+    start(0, std::vector<int>());
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    stop();
+}
+
+// Must not be called while a loop is running. Returns false when a thread could not be pinned
+// to its CPU; the threads run unpinned then.
+bool TaskScheduler::configure(int threads, const std::vector<int> &cpus)
+{
+    stop();
+    return start(threads, cpus);
+}
+
+int TaskScheduler::threads()
+{
+    return workers.size() + 1;
+}
+
+bool TaskScheduler::start(int threads, const std::vector<int> &cpus)
+{
+    if (0 >= threads) {
+        threads = cpus.empty() ? std::thread::hardware_concurrency() : cpus.size();
+    }
+    threads = MAX(1, threads);
+
+    // OpenCV functions are called from the tasks and must not spawn threads of their own
+    cv::setNumThreads(0);
+
+    terminated = false;
+
+    bool pinned = cpus.empty() || pinThread(nullptr, cpus[0]);
+
+    for (int i = 0; i < threads - 1; ++i) {
+        workers.push_back(new Worker());
+    }
+
+    for (int i = 0; i < threads - 1; ++i) {
+        _threads.push_back(std::thread(&TaskScheduler::work, this, i));
+        if (!cpus.empty()) {
+            pinned = pinThread(&_threads.back(), cpus[(i + 1) % cpus.size()]) && pinned;
+        }
+    }
+
+    return pinned;
+}
+
+void TaskScheduler::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        terminated = true;
+    }
+
+    condition.notify_all();
+
+    for (auto &thread : _threads) {
+        thread.join();
+    }
+    _threads.clear();
+
+    for (Worker *worker : workers) {
+        delete worker;
+    }
+    workers.clear();
+}
+
+void TaskScheduler::run(int count, int grain, void (*invoke)(void *, int), void *context)
+{
+    Job job;
+    job.invoke = invoke;
+    job.context = context;
+    job.lane = currentLane;
+    job.grain = MAX(1, grain);
+    job.remaining = count;
+    job.failed = false;
+
+    Task task = {&job, 0, count};
+    execute(task);
+
+    while (0 < job.remaining) {
+        if (next(job.lane, task)) {
+            execute(task);
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+
+    if (job.exception) {
+        std::rethrow_exception(job.exception);
+    }
+}
+
+void TaskScheduler::work(int index)
+{
+    workerIndex = index;
+
+    for (;;) {
+        Task task;
+        if (next(Lane::Background, task)) {
+            execute(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] { return terminated || 0 < queued; });
+        if (terminated) {
+            break;
+        }
+    }
+
+    workerIndex = -1;
+}
+
+void TaskScheduler::push(Task &task)
+{
+    int lane = (int)task.job->lane;
+    Queue &queue = -1 != workerIndex ? workers[workerIndex]->queues[lane] : injection[lane];
+
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(task);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++queued;
+    }
+
+    condition.notify_one();
+}
+
+// Own deque from the back, then the injected loops, then the others' deques from the front.
+// A thread in the interactive lane does not pick up background work.
+bool TaskScheduler::next(Lane lane, Task &task)
+{
+    for (int l = 0; l <= (int)lane; ++l) {
+        Queue *queues[] = {-1 != workerIndex ? &workers[workerIndex]->queues[l] : nullptr, &injection[l]};
+
+        for (int i = 0; i < 2; ++i) {
+            if (!queues[i]) {
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(queues[i]->mutex);
+            if (!queues[i]->tasks.empty()) {
+                if (0 == i) {
+                    task = queues[i]->tasks.back();
+                    queues[i]->tasks.pop_back();
+                }
+                else {
+                    task = queues[i]->tasks.front();
+                    queues[i]->tasks.pop_front();
+                }
+                --queued;
+                return true;
+            }
+        }
+
+        int count = workers.size();
+        int offset = -1 != workerIndex ? workerIndex + 1 : 0;
+
+        for (int i = 0; i < count; ++i) {
+            Queue &queue = workers[(offset + i) % count]->queues[l];
+
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty()) {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+                --queued;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void TaskScheduler::execute(Task &task)
+{
+    Job *job = task.job;
+    LaneScope scope(job->lane);
+
+    while (task.end - task.begin > job->grain) {
+        Task half = {job, (task.begin + task.end) / 2, task.end};
+        push(half);
+        task.end = half.begin;
+    }
+
+    // The first exception is thrown again by run() once every task is done; the rest of the loop is skipped
+    if (!job->failed) {
+        try {
+            for (int i = task.begin; i < task.end; ++i) {
+                job->invoke(job->context, i);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            if (!job->exception) {
+                job->exception = std::current_exception();
+            }
+            job->failed = true;
+        }
+    }
+
+    // The job lives on the caller's stack and may be gone right after this
+    job->remaining -= task.end - task.begin;
+}
+
+// Local functions
+
+// Pins the thread, or the calling one when null. Affinity is only supported on Linux, elsewhere
+// the CPU is ignored.
+static bool pinThread(std::thread *thread, int cpu)
+{
+#ifdef __linux__
+    if (0 > cpu || CPU_SETSIZE <= cpu) {
+        return false;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return 0 == pthread_setaffinity_np(thread ? thread->native_handle() : pthread_self(), sizeof(set), &set);
+#else
+    return true;
+#endif
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+
+namespace illustrace {
+
+class TaskScheduler {
+public:
+    enum class Lane : int {
+        Interactive,
+        Background,
+    };
+
+    class LaneScope {
+    public:
+        LaneScope(Lane lane);
+        ~LaneScope();
+
+    private:
+        Lane previous;
+    };
+
+    static TaskScheduler &shared();
+
+    bool configure(int threads, const std::vector<int> &cpus = std::vector<int>());
+    int threads();
+
+    template<typename Func>
+    void parallelFor(int count, Func func)
+    {
+        parallelFor(count, 1, func);
+    }
+
+    template<typename Func>
+    void parallelFor(int count, int grain, Func func)
+    {
+        if (1 == count) {
+            func(0);
+        }
+        else if (1 < count) {
+            run(count, grain, [](void *context, int index) {
+                (*(Func *)context)(index);
+            }, &func);
+        }
+    }
+
+private:
+    struct Job;
+
+    struct Task {
+        Job *job;
+        int begin;
+        int end;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    struct Worker {
+        Queue queues[2];
+    };
+
+    TaskScheduler();
+    ~TaskScheduler();
+
+    bool start(int threads, const std::vector<int> &cpus);
+    void stop();
+    void run(int count, int grain, void (*invoke)(void *, int), void *context);
+    void work(int index);
+    void push(Task &task);
+    bool next(Lane lane, Task &task);
+    void execute(Task &task);
+
+    std::vector<std::thread> _threads;
+    std::vector<Worker *> workers;
+    Queue injection[2];
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::atomic<int> queued;
+    bool terminated;
+};
+
+} // namespace illustrace
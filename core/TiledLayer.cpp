@@ -0,0 +1,179 @@
+#include "TiledLayer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#define TILE_SHIFT 6
+
+using namespace illustrace;
+
+static_assert(TiledLayer::TileSize == 1 << TILE_SHIFT, "tile lookups shift by TILE_SHIFT");
+
+TiledLayer::TiledLayer() : rows(0), cols(0), table(std::make_shared<Table>())
+{
+    table->tileCols = 0;
+    table->tileRows = 0;
+}
+
+TiledLayer::TiledLayer(int rows, int cols) : rows(rows), cols(cols), table(std::make_shared<Table>())
+{
+    table->tileCols = (cols + TileSize - 1) / TileSize;
+    table->tileRows = (rows + TileSize - 1) / TileSize;
+    table->tiles.resize(table->tileCols * table->tileRows);
+}
+
+TiledLayer TiledLayer::clone() const
+{
+    TiledLayer layer;
+    layer.rows = rows;
+    layer.cols = cols;
+    *layer.table = *table;
+    return layer;
+}
+
+bool TiledLayer::empty() const
+{
+    return 0 == rows || 0 == cols;
+}
+
+cv::Size TiledLayer::size() const
+{
+    return cv::Size(cols, rows);
+}
+
+uint8_t TiledLayer::at(int x, int y) const
+{
+    const Tile *tile = table->tiles[(y >> TILE_SHIFT) * table->tileCols + (x >> TILE_SHIFT)].get();
+    return tile ? (*tile)[(y & (TileSize - 1)) * TileSize + (x & (TileSize - 1))] : 0;
+}
+
+void TiledLayer::set(int x, int y, uint8_t index)
+{
+    int col = x >> TILE_SHIFT;
+    int row = y >> TILE_SHIFT;
+
+    if (0 == index && !table->tiles[row * table->tileCols + col]) {
+        return;
+    }
+
+    writableTile(col, row)[(y & (TileSize - 1)) * TileSize + (x & (TileSize - 1))] = index;
+}
+
+void TiledLayer::fill(int y, int x0, int x1, uint8_t index)
+{
+    int row = y >> TILE_SHIFT;
+    int offset = (y & (TileSize - 1)) * TileSize;
+
+    while (x0 < x1) {
+        int col = x0 >> TILE_SHIFT;
+        int end = MIN(x1, (col + 1) * TileSize);
+
+        if (0 != index || table->tiles[row * table->tileCols + col]) {
+            uint8_t *pixels = writableTile(col, row) + offset;
+            memset(pixels + (x0 & (TileSize - 1)), index, end - x0);
+        }
+
+        x0 = end;
+    }
+}
+
+bool TiledLayer::filled(int y, int x0, int x1, uint8_t index) const
+{
+    int row = y >> TILE_SHIFT;
+    int offset = (y & (TileSize - 1)) * TileSize;
+
+    while (x0 < x1) {
+        int col = x0 >> TILE_SHIFT;
+        int end = MIN(x1, (col + 1) * TileSize);
+
+        const Tile *tile = table->tiles[row * table->tileCols + col].get();
+        if (tile) {
+            const uint8_t *pixels = tile->data() + offset;
+            if (!std::all_of(pixels + (x0 & (TileSize - 1)), pixels + (x0 & (TileSize - 1)) + end - x0, [=](uint8_t i) { return i == index; })) {
+                return false;
+            }
+        }
+        else if (0 != index) {
+            return false;
+        }
+
+        x0 = end;
+    }
+
+    return true;
+}
+
+int TiledLayer::tileCols() const
+{
+    return table->tileCols;
+}
+
+int TiledLayer::tileRows() const
+{
+    return table->tileRows;
+}
+
+cv::Rect TiledLayer::tileRect(int col, int row) const
+{
+    return cv::Rect(col * TileSize, row * TileSize, TileSize, TileSize) & cv::Rect(0, 0, cols, rows);
+}
+
+const uint8_t *TiledLayer::tile(int col, int row) const
+{
+    const Tile *tile = table->tiles[row * table->tileCols + col].get();
+    return tile ? tile->data() : nullptr;
+}
+
+int TiledLayer::allocatedTiles() const
+{
+    return std::count_if(table->tiles.begin(), table->tiles.end(), [](const std::shared_ptr<Tile> &tile) { return !!tile; });
+}
+
+void TiledLayer::usedIndices(std::vector<bool> &used) const
+{
+    for (const std::shared_ptr<Tile> &tile : table->tiles) {
+        if (tile) {
+            for (uint8_t index : *tile) {
+                used[index] = true;
+            }
+        }
+    }
+}
+
+void TiledLayer::copyTo(cv::Mat &image, const cv::Rect &rect, const Palette &palette) const
+{
+    image = cv::Mat::zeros(rect.height, rect.width, CV_8UC4);
+
+    for (int row = rect.y >> TILE_SHIFT; row <= (rect.y + rect.height - 1) >> TILE_SHIFT; ++row) {
+        for (int col = rect.x >> TILE_SHIFT; col <= (rect.x + rect.width - 1) >> TILE_SHIFT; ++col) {
+            const uint8_t *pixels = tile(col, row);
+            if (!pixels) {
+                continue;
+            }
+
+            cv::Rect r = tileRect(col, row) & rect;
+            for (int y = r.y; y < r.y + r.height; ++y) {
+                const uint8_t *src = pixels + (y & (TileSize - 1)) * TileSize + (r.x & (TileSize - 1));
+                uint32_t *dst = image.ptr<uint32_t>(y - rect.y, r.x - rect.x);
+                for (int x = 0; x < r.width; ++x) {
+                    dst[x] = palette.color(src[x]);
+                }
+            }
+        }
+    }
+}
+
+// A tile still shared with a clone is copied before the first write.
+uint8_t *TiledLayer::writableTile(int col, int row)
+{
+    std::shared_ptr<Tile> &tile = table->tiles[row * table->tileCols + col];
+
+    if (!tile) {
+        tile = std::make_shared<Tile>(TileSize * TileSize, 0);
+    }
+    else if (1 < tile.use_count()) {
+        tile = std::make_shared<Tile>(*tile);
+    }
+
+    return tile->data();
+}
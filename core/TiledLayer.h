@@ -0,0 +1,64 @@
+#pragma once
+
+#include "Palette.h"
+
+#include "opencv2/core.hpp"
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+namespace illustrace {
+
+// Sparse raster of palette indices. Pixels live in square tiles allocated on the first write of an
+// index other than 0, transparent, and absent tiles read as 0, so memory follows the painted area.
+// As with cv::Mat, copies share the pixels and clone() makes an independent layer; a clone shares
+// the tiles as well until either side writes into one, so a snapshot only copies the tile table.
+class TiledLayer {
+public:
+    static const int TileSize = 64;
+
+    TiledLayer();
+    TiledLayer(int rows, int cols);
+
+    TiledLayer clone() const;
+    bool empty() const;
+    cv::Size size() const;
+
+    uint8_t at(int x, int y) const;
+    void set(int x, int y, uint8_t index);
+
+    // Spans are [x0, x1) of row y.
+    void fill(int y, int x0, int x1, uint8_t index);
+    bool filled(int y, int x0, int x1, uint8_t index) const;
+
+    int tileCols() const;
+    int tileRows() const;
+    cv::Rect tileRect(int col, int row) const;
+    // Pixels of an allocated tile, rows TileSize apart, or nullptr for an absent one.
+    const uint8_t *tile(int col, int row) const;
+    int allocatedTiles() const;
+    // Marks the indices found in the layer, used having a flag for each palette index.
+    void usedIndices(std::vector<bool> &used) const;
+
+    // Dense CV_8UC4 copy of rect in the colors of the palette.
+    void copyTo(cv::Mat &image, const cv::Rect &rect, const Palette &palette) const;
+
+    int rows;
+    int cols;
+
+private:
+    typedef std::vector<uint8_t> Tile;
+
+    struct Table {
+        int tileCols;
+        int tileRows;
+        std::vector<std::shared_ptr<Tile>> tiles;
+    };
+
+    uint8_t *writableTile(int col, int row);
+
+    std::shared_ptr<Table> table;
+};
+
+} // namespace illustrace
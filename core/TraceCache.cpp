@@ -0,0 +1,276 @@
+#include "TraceCache.h"
+#include "ProjectReader.h"
+#include "ProjectWriter.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define KEY_VERSION 3
+
+using namespace illustrace;
+
+static const char Extension[] = ".illustrace";
+
+// Two independent multiply-xorshift lanes, 128 bits in total. Good enough for content
+// addressing of our own images, not meant to resist crafted collisions.
+class Hasher {
+public:
+    Hasher(uint64_t seed0, uint64_t seed1) : h0(seed0 ^ 0x243F6A8885A308D3ULL), h1(seed1 ^ 0x13198A2E03707344ULL) {}
+
+    void update(const void *data, size_t length)
+    {
+        const uchar *p = (const uchar *)data;
+
+        for (; 8 <= length; p += 8, length -= 8) {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            mix(word);
+        }
+
+        if (0 < length) {
+            uint64_t word = 0;
+            memcpy(&word, p, length);
+            mix(word ^ ((uint64_t)length << 56));
+        }
+    }
+
+    template<typename T>
+    void update(const T &value)
+    {
+        update(&value, sizeof(value));
+    }
+
+    void digest(uint64_t hash[2])
+    {
+        hash[0] = finalize(h0 ^ rotate(h1, 17));
+        hash[1] = finalize(h1 ^ rotate(h0, 43));
+    }
+
+private:
+    uint64_t h0;
+    uint64_t h1;
+
+    static inline uint64_t rotate(uint64_t x, int r)
+    {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static inline uint64_t finalize(uint64_t x)
+    {
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+
+    inline void mix(uint64_t word)
+    {
+        h0 = (h0 ^ word) * 0x9E3779B97F4A7C15ULL;
+        h0 ^= h0 >> 32;
+        h1 = (h1 ^ rotate(word, 29)) * 0xC2B2AE3D27D4EB4FULL;
+        h1 ^= h1 >> 29;
+    }
+};
+
+static std::string entryName(const uint64_t hash[2]);
+static bool isEntryName(const char *name);
+
+TraceCache::TraceCache(const char *directory, size_t capacity) : directory(directory), capacity(capacity), total(0)
+{
+    mkdir(directory, 0755);
+
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        return;
+    }
+
+    std::vector<std::pair<time_t, Entry>> found;
+
+    struct dirent *dirent;
+    while ((dirent = readdir(dir))) {
+        struct stat st;
+        if (isEntryName(dirent->d_name) && 0 == stat(filepath(dirent->d_name).c_str(), &st)) {
+            found.push_back(std::make_pair(st.st_mtime, (Entry){dirent->d_name, (size_t)st.st_size}));
+        }
+    }
+    closedir(dir);
+
+    std::sort(found.begin(), found.end(), [](const std::pair<time_t, Entry> &e1, const std::pair<time_t, Entry> &e2) {
+        return e1.first < e2.first;
+    });
+
+    for (auto &entry : found) {
+        insert(entry.second.name, entry.second.size);
+    }
+
+    evict();
+}
+
+// Color and the like do not change the geometry, so they are not part of the key.
+void TraceCache::key(const cv::Mat &sourceImage, Document *document, Key &key)
+{
+    Hasher contours(KEY_VERSION, sourceImage.type());
+
+    contours.update(sourceImage.rows);
+    contours.update(sourceImage.cols);
+    for (int y = 0; y < sourceImage.rows; ++y) {
+        contours.update(sourceImage.ptr(y), sourceImage.cols * sourceImage.elemSize());
+    }
+
+    for (cv::Rect *rect : {&document->contentRect(), &document->clippingRect(), &document->traceRect()}) {
+        int32_t values[4] = {rect->x, rect->y, rect->width, rect->height};
+        contours.update(values);
+    }
+
+    double values[] = {document->brightness(), document->blur(), (double)document->negative(), document->despeckle()};
+    contours.update(values);
+    contours.digest(key.contours);
+
+    Hasher paths(key.contours[0], key.contours[1]);
+    double pathValues[] = {document->detail(), document->smoothing(), document->thickness(), (double)document->fitting()};
+    paths.update(pathValues);
+    paths.digest(key.paths);
+}
+
+// Parameters which are not part of the key are kept as they were set before loading.
+TraceCache::Level TraceCache::load(const Key &key, Document *document)
+{
+    std::string name;
+    Level level;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (index.count(name = entryName(key.paths))) {
+            level = Level::Paths;
+        }
+        else if (index.count(name = entryName(key.contours))) {
+            level = Level::Contours;
+        }
+        else {
+            return Level::Miss;
+        }
+    }
+
+    double detail = document->detail();
+    double smoothing = document->smoothing();
+    double thickness = document->thickness();
+    double rotation = document->rotation();
+    cv::Scalar color = document->color();
+    cv::Scalar backgroundColor = document->backgroundColor();
+    bool backgroundEnable = document->backgroundEnable();
+
+    std::string path = filepath(name);
+    if (!ProjectReader::read(path.c_str(), document)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        remove(name);
+        return Level::Miss;
+    }
+
+    document->detail(detail);
+    document->smoothing(smoothing);
+    document->thickness(thickness);
+    document->rotation(rotation);
+    document->color(color);
+    document->backgroundColor(backgroundColor);
+    document->backgroundEnable(backgroundEnable);
+
+    utimes(path.c_str(), nullptr);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(name);
+    if (index.end() != it) {
+        entries.splice(entries.begin(), entries, it->second);
+    }
+
+    return level;
+}
+
+void TraceCache::store(const Key &key, Level level, Document *document)
+{
+    std::string name = entryName(Level::Paths == level ? key.paths : key.contours);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index.count(name) || writing.count(name)) {
+            return;
+        }
+        writing.insert(name);
+    }
+
+    std::string path = filepath(name);
+    bool ret = Level::Paths == level
+        ? ProjectWriter::write(path.c_str(), document)
+        : ProjectWriter::writeContours(path.c_str(), document);
+
+    struct stat st;
+    ret = ret && 0 == stat(path.c_str(), &st);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    writing.erase(name);
+
+    if (ret) {
+        insert(name, st.st_size);
+        evict();
+    }
+}
+
+size_t TraceCache::size()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return total;
+}
+
+std::string TraceCache::filepath(const std::string &name)
+{
+    return directory + "/" + name;
+}
+
+void TraceCache::insert(const std::string &name, size_t size)
+{
+    entries.push_front((Entry){name, size});
+    index[name] = entries.begin();
+    total += size;
+}
+
+void TraceCache::remove(const std::string &name)
+{
+    auto it = index.find(name);
+    if (index.end() == it) {
+        return;
+    }
+
+    unlink(filepath(name).c_str());
+    total -= it->second->size;
+    entries.erase(it->second);
+    index.erase(it);
+}
+
+void TraceCache::evict()
+{
+    while (capacity < total && !entries.empty()) {
+        std::string name = entries.back().name;
+        remove(name);
+    }
+}
+
+// Local functions
+
+static std::string entryName(const uint64_t hash[2])
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx%016llx%s", (unsigned long long)hash[0], (unsigned long long)hash[1], Extension);
+    return name;
+}
+
+static bool isEntryName(const char *name)
+{
+    size_t length = strlen(name);
+    return 32 + sizeof(Extension) - 1 == length
+        && 0 == strcmp(name + 32, Extension)
+        && 32 == strspn(name, "0123456789abcdef");
+}
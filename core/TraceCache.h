@@ -0,0 +1,58 @@
+#pragma once
+
+#include "Document.h"
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace illustrace {
+
+// On-disk cache of trace results, addressed by a hash of the source pixels and the trace parameters.
+// Entries are project files: Contours entries hold the state up to the outline contours and are keyed
+// by the parameters used until then, Paths entries hold the whole trace.
+class TraceCache {
+public:
+    enum class Level : int {
+        Miss,
+        Contours,
+        Paths,
+    };
+
+    struct Key {
+        uint64_t contours[2];
+        uint64_t paths[2];
+    };
+
+    TraceCache(const char *directory, size_t capacity);
+
+    static void key(const cv::Mat &sourceImage, Document *document, Key &key);
+
+    Level load(const Key &key, Document *document);
+    void store(const Key &key, Level level, Document *document);
+    size_t size();
+
+private:
+    struct Entry {
+        std::string name;
+        size_t size;
+    };
+
+    std::string filepath(const std::string &name);
+    void insert(const std::string &name, size_t size);
+    void remove(const std::string &name);
+    void evict();
+
+    std::string directory;
+    size_t capacity;
+    size_t total;
+    std::list<Entry> entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    std::unordered_set<std::string> writing;
+    std::mutex mutex;
+};
+
+} // namespace illustrace
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <string>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
 namespace illustrace {
 namespace util {
 
@@ -49,5 +54,45 @@ static inline int modIndex(int index, size_t length)
     return length <= index ? index % length : index;
 }
 
+// Unlike cv::Rect_::operator|=, a rect of zero width or height, as the bounds of a straight
+// horizontal or vertical path, still extends the union.
+template<class T>
+static inline void unionRect(T &r1, const T &r2)
+{
+    auto x = std::min(r1.x, r2.x);
+    auto y = std::min(r1.y, r2.y);
+    r1.width = std::max(r1.x + r1.width, r2.x + r2.width) - x;
+    r1.height = std::max(r1.y + r1.height, r2.y + r2.height) - y;
+    r1.x = x;
+    r1.y = y;
+}
+
+// fsync does not flush the drive's write cache on Darwin, F_FULLFSYNC does.
+static inline bool syncFile(int fd)
+{
+#ifdef __APPLE__
+    if (-1 != fcntl(fd, F_FULLFSYNC)) {
+        return true;
+    }
+#endif
+    return 0 == fsync(fd);
+}
+
+// Makes a rename or an unlink of an entry in the directory of filepath durable.
+static inline bool syncDirectory(const std::string &filepath)
+{
+    size_t slash = filepath.rfind('/');
+    std::string directory = std::string::npos == slash ? "." : 0 == slash ? "/" : filepath.substr(0, slash);
+
+    int fd = open(directory.c_str(), O_RDONLY);
+    if (-1 == fd) {
+        return false;
+    }
+
+    bool ret = syncFile(fd);
+    close(fd);
+    return ret;
+}
+
 } // namespace util
 } // namespace illustrace
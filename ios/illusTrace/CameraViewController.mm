@@ -175,10 +175,9 @@ using namespace illustrace;
     size_t height = CVPixelBufferGetHeight(pixelBuffer);
     
     cv::Mat sourceImage((int)height, (int)width, CV_8UC4, baseAddress, bytesPerRow);
-    std::vector<std::vector<cv::Point>> outlineContours;
-    std::vector<cv::Vec4i> outlineHierarchy;
+    FlatContours<cv::Point> outlineContours;
     
-    _illustrace.traceForPreview(sourceImage, outlineContours, outlineHierarchy, _brightnessSlider.value, _negative);
+    _illustrace.traceForPreview(sourceImage, outlineContours, _brightnessSlider.value, _negative);
     
     CGColorSpaceRef colorSpace = CGColorSpaceCreateDeviceRGB();
     CGContextRef bitmapContext = CGBitmapContextCreate(baseAddress, width, height, 8, bytesPerRow, colorSpace, kCGBitmapByteOrder32Little | kCGImageAlphaPremultipliedFirst);
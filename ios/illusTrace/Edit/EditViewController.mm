@@ -14,15 +14,19 @@
 #import "Illustrace.h"
 #import "Editor.h"
 #import "EditorObserver.h"
+#import "AsyncTracer.h"
+#import "AsyncTracerObserver.h"
 #import "Color.h"
 
 using namespace illustrace;
 
-@interface EditViewController () <EditorObserver> {
+@interface EditViewController () <EditorObserver, AsyncTracerObserver> {
     Illustrace _illustrace;
+    AsyncTracer _tracer;
     Editor *_editor;
     
     EditorObserverBridge _editorObserverBridge;
+    AsyncTracerObserverBridge _tracerObserverBridge;
 }
 @property (weak, nonatomic) IBOutlet PreviewView *previewView;
 @property (weak, nonatomic) IBOutlet UIToolbar *toolbar;
@@ -47,10 +51,13 @@ using namespace illustrace;
     _previewView.document = _document;
     _previewView.backgroundColor = [UIColor colorWithPatternImage:[UIImage imageNamed:@"tile"]];
     
-    _editor = new Editor(&_illustrace, _document);
+    _editor = new Editor(&_illustrace, _document, &_tracer);
     _editor->addObserver(&_editorObserverBridge);
     _editorObserverBridge.observer = self;
     
+    _tracer.addObserver(&_tracerObserverBridge);
+    _tracerObserverBridge.observer = self;
+    
     _shapeVC = [EditShapeViewController new];
     _shapeVC.editor = _editor;
     _shapeVC.previewView = _previewView;
@@ -67,6 +74,12 @@ using namespace illustrace;
     self.activeVC = _shapeVC;
 }
 
+- (void)dealloc
+{
+    _tracer.removeObserver(&_tracerObserverBridge);
+    delete _editor;
+}
+
 - (void)didReceiveMemoryWarning
 {
     [super didReceiveMemoryWarning];
@@ -175,4 +188,17 @@ using namespace illustrace;
     }
 }
 
+#pragma mark AsyncTracerObserver
+
+- (void)asyncTracer:(AsyncTracer *)tracer notify:(va_list)argList
+{
+    AsyncTracer::Event event = static_cast<AsyncTracer::Event>(va_arg(argList, int));
+
+    if (AsyncTracer::Event::Completed == event) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            _tracer.publish();
+        });
+    }
+}
+
 @end
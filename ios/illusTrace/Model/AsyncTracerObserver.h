@@ -0,0 +1,23 @@
+//
+//  AsyncTracerObserver.h
+//  illusTrace
+//
+//  Copyright © 2016年 Noriyoshi Abe. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "AsyncTracer.h"
+
+// Notified on the tracer's worker thread.
+@protocol AsyncTracerObserver <NSObject>
+- (void)asyncTracer:(illustrace::AsyncTracer *)tracer notify:(va_list)argList;
+@end
+
+class AsyncTracerObserverBridge : public illustrace::Observer <illustrace::AsyncTracer> {
+public:
+    void notify(illustrace::AsyncTracer *sender, va_list argList) {
+        [this->observer asyncTracer:sender notify:argList];
+    }
+    
+    id <AsyncTracerObserver> observer;
+};
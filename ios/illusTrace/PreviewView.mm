@@ -213,22 +213,39 @@ using namespace illustrace;
 
 - (void)drawPaintLayer:(CGContextRef)context
 {
-    auto &_image = _document->paintLayer();
-    CFDataRef data = CFDataCreate(NULL, _image.data, _image.step[0] * _image.rows);
-    CGDataProviderRef provider = CGDataProviderCreateWithCFData(data);
+    auto &layer = _document->paintLayer();
+    auto &palette = _document->paintPalette();
     CGColorSpaceRef colorSpace = CGColorSpaceCreateDeviceRGB();
-    CGImageRef image = CGImageCreate(_image.cols, _image.rows, 8, 32, _image.step[0], colorSpace, kCGBitmapByteOrderDefault | kCGImageAlphaLast, provider, NULL, NO, kCGRenderingIntentDefault);
+    size_t stride = TiledLayer::TileSize * sizeof(uint32_t);
+    std::vector<uint32_t> pixels(TiledLayer::TileSize * TiledLayer::TileSize);
     
-    CGAffineTransform flipY = CGAffineTransformMake(1, 0, 0, -1, 0, _image.rows);
+    CGAffineTransform flipY = CGAffineTransformMake(1, 0, 0, -1, 0, layer.rows);
     CGContextConcatCTM(context, flipY);
-   
-    CGRect rect = CGRectMake(0, 0, _image.cols, _image.rows);
-    CGContextDrawImage(context, rect, image);
     
-    CGImageRelease(image);
+    for (int row = 0; row < layer.tileRows(); ++row) {
+        for (int col = 0; col < layer.tileCols(); ++col) {
+            const uint8_t *indices = layer.tile(col, row);
+            if (!indices) {
+                continue;
+            }
+            
+            std::transform(indices, indices + pixels.size(), pixels.begin(), [&](uint8_t index) { return palette.color(index); });
+            
+            cv::Rect tileRect = layer.tileRect(col, row);
+            CFDataRef data = CFDataCreate(NULL, (const UInt8 *)pixels.data(), stride * tileRect.height);
+            CGDataProviderRef provider = CGDataProviderCreateWithCFData(data);
+            CGImageRef image = CGImageCreate(tileRect.width, tileRect.height, 8, 32, stride, colorSpace, kCGBitmapByteOrderDefault | kCGImageAlphaLast, provider, NULL, NO, kCGRenderingIntentDefault);
+            
+            CGRect rect = CGRectMake(tileRect.x, layer.rows - tileRect.y - tileRect.height, tileRect.width, tileRect.height);
+            CGContextDrawImage(context, rect, image);
+            
+            CGImageRelease(image);
+            CGDataProviderRelease(provider);
+            CFRelease(data);
+        }
+    }
+    
     CGColorSpaceRelease(colorSpace);
-    CGDataProviderRelease(provider);
-    CFRelease(data);
     
     CGContextConcatCTM(context, CGAffineTransformInvert(flipY));
 }